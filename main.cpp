@@ -4,6 +4,84 @@
 #include <vector>
 #include <string>
 #include <optional>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ranges>
+#include <sstream>
+#include <tuple>
+#include <thread>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <charconv>
+#include <cstdlib>
+#include <string_view>
+#include <utility>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#endif
+
+#if defined(PATCHER_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+
+/**
+ * @brief Fires a USDT probe of the `wow_patcher` provider.
+ *
+ * Probes mark the pipeline phases of every job so bpftrace or perf can measure them on a
+ * live batch or service, and cost a single nop when nobody is attached. Without
+ * `<sys/sdt.h>` they compile to nothing. Every probe's first argument is the path of the
+ * file it concerns; `error` arguments are 0 on success, an errno value where one is
+ * known, and -1 otherwise.
+ *
+ *  - `file__start(path)`, `file__done(path, error)`: one patch or rollback job.
+ *  - `backup__start(path)`, `backup__done(path, bytes, error)`: copying the original aside.
+ *  - `validate__start(path)`, `validate__done(path, error)`.
+ *  - `plan__start(path)`, `plan__done(path, writes, error)`: resolving the patch plan.
+ *  - `write__start(path)`, `write__done(path, bytes, error)`: writing the patched image.
+ *  - `fsync__start(path)`, `fsync__done(path, error)`.
+ *  - `syncfs__start(path)`, `syncfs__done(path, error)`: a group commit flushing the filesystem of `path`.
+ *  - `verify__start(path)`, `verify__done(path, error)`: checking a digest after the fact.
+ *
+ * For example: `bpftrace -e 'usdt:./WoW_335a_Patcher:wow_patcher:fsync__done { @[arg1] = count(); }'`.
+ */
+#if defined(STAP_PROBEV)
+#define PATCHER_PROBE(name, ...) STAP_PROBEV(wow_patcher, name, __VA_ARGS__)
+#else
+#define PATCHER_PROBE(name, ...) static_cast<void>(0)
+#endif
 
 namespace fs = std::filesystem;
 /**
@@ -21,6 +99,27 @@ std::fstream wowExe;
  * been modified or corrupted.
  */
 constexpr std::streamsize kExpectedSize = 0x757C00;
+/**
+ * @brief A single patch: the bytes to write at a file offset, and the fix it belongs to.
+ *
+ * Entries that together make up one fix share the same name, so selecting a fix by
+ * name always selects all of its writes. `after` lists the file offsets of entries
+ * that must be on disk before this one is written, e.g. the code a jump diverts into.
+ */
+struct Patch {
+    std::string name;
+    std::streampos pos;
+    std::vector<std::uint8_t> data;
+    std::vector<std::streamoff> after{};
+};
+/**
+ * @brief The full list of patches known to the patcher.
+ */
+using PatchTable = std::vector<Patch>;
+/**
+ * @brief A patch profile: bit `i` selects entry `i` of the patch table.
+ */
+using PatchSelection = std::uint64_t;
 
 /**
  * Checks for errors in a given output stream and logs an error message if any error is detected.
@@ -43,7 +142,7 @@ template<typename T>
  * Writes a sequence of bytes to a specific position in a binary stream.
  *
  * This function attempts to write a sequence of byte values starting at a specified
- * position in an external file stream referred to by the global variable `wowExe`.
+ * position in a file stream, by default the global variable `wowExe`.
  * If the stream is not open, an error message is displayed and the function returns.
  * The function checks for errors at each step: repositioning the write pointer
  * and writing each value.
@@ -51,20 +150,21 @@ template<typename T>
  * @tparam T The type of elements in the vector to be written to the stream.
  * @param pos The position in the stream where the writing should start.
  * @param values A vector containing the values to be written to the stream.
+ * @param stream The stream to write to.
  */
-void writeBytesAt(const std::streampos pos, const std::vector<T> &values) {
-    if (!wowExe) {
+void writeBytesAt(const std::streampos pos, const std::vector<T> &values, std::fstream &stream = wowExe) {
+    if (!stream) {
         std::cerr << "Stream is not open\n";
         return;
     }
-    wowExe.clear();
-    wowExe.seekp(pos);
-    if (handleStreamError(wowExe, "Failed to set position in the stream"))
+    stream.clear();
+    stream.seekp(pos);
+    if (handleStreamError(stream, "Failed to set position in the stream"))
         return;
 
     for (const auto &value: values) {
-        wowExe.write(reinterpret_cast<const char *>(&value), sizeof(value));
-        if (handleStreamError(wowExe, "Failed to write to the stream"))
+        stream.write(reinterpret_cast<const char *>(&value), sizeof(value));
+        if (handleStreamError(stream, "Failed to write to the stream"))
             return;
     }
 }
@@ -125,52 +225,73 @@ void writeRepeatedBytesAt(const std::streampos &pos, const uint8_t value, const
  * @brief Creates a backup of the specified file.
  *
  * This function attempts to create a backup copy of the file specified by `filepath`.
- * The backup file will have a ".backup" extension appended to the original file name.
+ * The backup file normally has a ".backup" extension appended to the original file name.
  * If the backup is successfully created, the path to the backup file is returned.
  * If the backup creation fails, an empty optional is returned.
  *
  * @param filepath The path to the file that needs to be backed up.
+ * @param backupPath Where the backup is written; missing parent directories are created.
  * @return A std::optional containing the backup file path if the backup is successful;
  *         otherwise, an empty std::optional.
  */
-[[nodiscard]] std::optional<std::string> createBackup(const std::string &filepath) {
-    std::string backupPath = filepath + ".backup";
+[[nodiscard]] std::optional<std::string> createBackup(const std::string &filepath, const std::string &backupPath) {
+    PATCHER_PROBE(backup__start, filepath.c_str());
     try {
+        if (const fs::path parent = fs::path(backupPath).parent_path(); !parent.empty())
+            fs::create_directories(parent);
         fs::copy(filepath, backupPath, fs::copy_options::overwrite_existing);
+        PATCHER_PROBE(backup__done, filepath.c_str(), static_cast<std::uint64_t>(fs::file_size(backupPath)), 0);
         std::cout << "Backup created at: " << backupPath << "\n";
         return backupPath;
     } catch (const std::exception &e) {
+        PATCHER_PROBE(backup__done, filepath.c_str(), std::uint64_t{0}, -1);
         std::cerr << "Failed to create backup: " << e.what() << "\n";
         return std::nullopt;
     }
 }
 
+/**
+ * Recognizes an executable grown by injectImage: the original image followed by a
+ * `.patch` section that ends the file.
+ *
+ * @param filepath The executable.
+ * @param size Its size in bytes.
+ * @return true if the file is such a grown image.
+ */
+[[nodiscard]] bool isInjectedImage(const std::string &filepath, std::streamoff size);
+
 /**
  * Validates whether the given file path points to a valid executable file.
  *
  * This function performs the following checks on the specified file:
  *  1. Verifies that the file exists.
  *  2. Opens the file in binary mode to ensure it is accessible.
- *  3. Checks that the file size matches the expected size.
+ *  3. Checks that the file size matches the expected size, or that the file is a
+ *     known patched state grown by an injected section (see isInjectedImage).
  *
  * @param filepath The path to the executable file to be validated.
  * @return true if the executable is valid, false otherwise.
  */
 [[nodiscard]] bool validateExecutable(const std::string &filepath) {
+    PATCHER_PROBE(validate__start, filepath.c_str());
     if (!fs::exists(filepath)) {
+        PATCHER_PROBE(validate__done, filepath.c_str(), ENOENT);
         std::cerr << "Executable not found.\n";
         return false;
     }
     std::ifstream file(filepath, std::ios::binary);
     if (!file) {
+        PATCHER_PROBE(validate__done, filepath.c_str(), -1);
         std::cerr << "Failed to open executable for validation.\n";
         return false;
     }
     file.seekg(0, std::ios::end);
-    if (file.tellg() != kExpectedSize) {
+    if (const std::streamoff size = file.tellg(); size != kExpectedSize && !isInjectedImage(filepath, size)) {
+        PATCHER_PROBE(validate__done, filepath.c_str(), -1);
         std::cerr << "Validation failed: unexpected file size.\n";
         return false;
     }
+    PATCHER_PROBE(validate__done, filepath.c_str(), 0);
     std::cout << "Executable validation passed.\n";
     return true;
 }
@@ -180,8 +301,8 @@ void writeRepeatedBytesAt(const std::streampos &pos, const uint8_t value, const
  *
  * This function checks if a backup file with the same name as the input file
  * parameter exists but with a ".backup" extension. If it exists, the function
- * attempts to remove the original file and rename the backup file to the
- * original file name.
+ * renames the backup file over the original file name, which atomically
+ * replaces the original.
  *
  * @param wow The path to the original file for which the backup should be restored.
  * @return true if the backup was successfully restored, false otherwise.
@@ -189,7 +310,6 @@ void writeRepeatedBytesAt(const std::streampos &pos, const uint8_t value, const
 bool restoreBackup(const std::string &wow) {
     if (const std::string backupPath = wow + ".backup"; fs::exists(backupPath)) {
         try {
-            fs::remove(wow);
             fs::rename(backupPath, wow);
             return true;
         } catch (const fs::filesystem_error &e) {
@@ -202,83 +322,52 @@ bool restoreBackup(const std::string &wow) {
 }
 
 /**
- * @brief Main function to patch the World of Warcraft executable.
- *
- * This function performs several operations to patch the World of Warcraft executable
- * located at the provided path. It verifies if the path is valid, creates a backup
- * of the executable, validates the executable before patching, and applies several
- * patches to it. The patches include fixes such as resolving a remote code execution
- * exploit, enabling full screen mode from windowed mode, making certain animations
- * and actions consistent, among others.
+ * @brief Returns the table of patches applied to the executable.
  *
- * @param argc The number of command-line arguments.
- * @param argv The array of command-line arguments, where `argv[1]` should be the path
- * to the World of Warcraft executable.
+ * Each entry pairs a file offset inside the executable with the bytes that
+ * must be written there, tagged with the name of the fix it belongs to. The
+ * table is shared by the on-disk patching path in `main()`, the live patching
+ * mode and the hashing modes.
  *
- * @return An integer indicating the status of the execution. Returns `EXIT_SUCCESS`
- * if patching is completed successfully, or `EXIT_FAILURE` if an error occurs at any
- * stage of the process.
+ * @return The list of patches making up the patch set.
  */
-int main(const int argc, char **argv) {
-    constexpr int errorState = EXIT_SUCCESS;
-    if (argc < 2) {
-        std::cerr << "World of Warcraft exe path not provided!\n";
-        return EXIT_FAILURE;
-    }
-
-    const std::string wowPath = argv[1];
-
-    if (!fs::exists(wowPath)) {
-        std::cerr << "Executable not found at: " << wowPath << "\n";
-        return EXIT_FAILURE;
-    }
-
-    if (!createBackup(wowPath)) {
-        std::cerr << "Backup creation failed. Aborting.\n";
-        return EXIT_FAILURE;
-    }
-
-    if (!validateExecutable(wowPath)) {
-        std::cerr << "Executable validation failed. Aborting.\n";
-        return EXIT_FAILURE;
-    }
-
-    wowExe.open(wowPath, std::ios::in | std::ios::out | std::ios::binary);
-    if (!wowExe) {
-        std::cerr << "Failed to open executable for patching.\n";
-        return EXIT_FAILURE;
-    }
-
-    std::vector<std::pair<std::streampos, std::vector<std::uint8_t> > > patches = {
+[[nodiscard]] PatchTable buildPatchTable() {
+    return {
         // Remote code execution exploit
-        {0x2A7, {0xC0}},
+        {"rce-exploit", 0x2A7, {0xC0}},
         // Windowed mode to full screen
-        {0xE94, {0xEB}},
+        {"windowed-fullscreen", 0xE94, {0xEB}},
         // Melee swing on right-click
-        {0x2E1C67, std::vector<uint8_t>(11, 0x90)},
+        {"melee-right-click", 0x2E1C67, std::vector<uint8_t>(11, 0x90)},
         // NPC attack animation when turning
-        {0x33D7C9, {0xEB}},
+        {"npc-turn-animation", 0x33D7C9, {0xEB}},
         // "Ghost" attack when NPC evades combat
-        {0x355BF, {0xEB}},
+        {"ghost-attack", 0x355BF, {0xEB}},
         // Missing pre-cast animation for spells
-        {0x33E0D6, std::vector<uint8_t>(22, 0x90)},
+        {"precast-animation", 0x33E0D6, std::vector<uint8_t>(22, 0x90)},
         // Patch mail timeout
-        {0x16D899, {0x05, 0x01, 0x00, 0x00, 0x00}},
+        {"mail-timeout", 0x16D899, {0x05, 0x01, 0x00, 0x00, 0x00}},
         // Area trigger timer precision
-        {0x2DB241, {50}},
+        {"areatrigger-precision", 0x2DB241, {50}},
         // Blue Moon
-        {0x5CFBC0, {0xC7, 0x05, 0x74, 0x8E, 0xD3, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xC3}},
-        // Mouse flickering and camera snapping issue when mouse has high report rate
-        {0x469A2C, {0xE9, 0x71, 0xF0, 0x0B, 0x00, 0xF8, 0x13, 0xD4, 0x00, 0x8B, 0x1D, 0xFC}},
+        {"blue-moon", 0x5CFBC0, {0xC7, 0x05, 0x74, 0x8E, 0xD3, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xC3}},
+        // Mouse flickering and camera snapping issue when mouse has high report rate.
+        // The jump at 0x469A2C diverts into the cave at 0x528AA2, which jumps back to
+        // 0x469A35, and 0x4691B1 branches into the cave at 0x469183, so each jump is only
+        // written once the code it enters is.
+        {
+            "mouse-flicker", 0x469A2C, {0xE9, 0x71, 0xF0, 0x0B, 0x00, 0xF8, 0x13, 0xD4, 0x00, 0x8B, 0x1D, 0xFC},
+            {0x528AA2}
+        },
         {
-            0x528AA2, {
+            "mouse-flicker", 0x528AA2, {
                 0x8D, 0x4D, 0xF0, 0x51, 0x57, 0xFF, 0x15, 0xDC, 0xF5, 0x9D, 0x00, 0x8B, 0x45, 0xF0, 0x8B, 0x15,
                 0xF8,
                 0x13, 0xD4, 0x00, 0xE9, 0x7A, 0x0F, 0xF4, 0xFF
             }
         },
         {
-            0x4691B1, {
+            "mouse-flicker", 0x4691B1, {
                 0x89, 0xE5, 0x8B, 0x05, 0xFC, 0x13, 0xD4, 0x00, 0x8B, 0x0D, 0xF8, 0x13, 0xD4, 0x00, 0xEB, 0xC2,
                 0x7D,
                 0x03, 0x83, 0xC1, 0x01, 0x83, 0xC0, 0x32, 0x83, 0xC1, 0x32, 0x3B, 0x0D, 0xEC, 0xBC, 0xCA, 0x00,
@@ -288,21 +377,7725 @@ int main(const int argc, char **argv) {
                 0x32, 0x83, 0xE8, 0x32, 0x89, 0x0D, 0xF8, 0x13, 0xD4, 0x00, 0x89, 0x05, 0xFC, 0x13, 0xD4, 0x00,
                 0x89,
                 0xEC, 0x5D, 0xE9, 0xB4, 0xF7, 0xFF, 0xFF, 0xEC, 0x5D, 0xC3, 0xC3
-            }
+            },
+            {0x469183}
         },
         {
-            0x469183, std::vector<uint8_t>{
+            "mouse-flicker", 0x469183, std::vector<uint8_t>{
                 0x83, 0xF8, 0x32, 0x7D, 0x03, 0x83, 0xC0, 0x01, 0x83, 0xF9, 0x32, 0xEB, 0x31
             }
         }
     };
+}
+
+/**
+ * Parses a patch profile specification into a selection over the patch table.
+ *
+ * A profile is either `all`, `none`, or a comma-separated list of fix names such as
+ * `rce-exploit,mouse-flicker`. Naming a fix selects every table entry belonging to it.
+ *
+ * @param table The patch table the profile refers to.
+ * @param spec The profile specification.
+ * @return The selection, or an empty std::optional if the profile names an unknown fix.
+ */
+[[nodiscard]] std::optional<PatchSelection> parseProfile(const PatchTable &table, const std::string_view spec) {
+    if (table.size() > 64) {
+        std::cerr << "Patch table has more entries than a profile can select.\n";
+        return std::nullopt;
+    }
+    const PatchSelection all = table.size() == 64 ? ~PatchSelection{0} : (PatchSelection{1} << table.size()) - 1;
+    if (spec == "all")
+        return all;
+    if (spec == "none")
+        return PatchSelection{0};
 
-    for (const auto &[pos, data]: patches) {
-        writeBytesAt(pos, data);
+    PatchSelection selection = 0;
+    std::size_t begin = 0;
+    while (begin <= spec.size()) {
+        const std::size_t end = std::min(spec.find(',', begin), spec.size());
+        const std::string_view name = spec.substr(begin, end - begin);
+        bool found = false;
+        for (std::size_t i = 0; i < table.size(); ++i) {
+            if (table[i].name == name) {
+                selection |= PatchSelection{1} << i;
+                found = true;
+            }
+        }
+        if (!found) {
+            std::cerr << "Unknown fix in profile: '" << name << "'\n";
+            return std::nullopt;
+        }
+        begin = end + 1;
     }
+    return selection;
+}
 
-    wowExe.close();
-    std::cout << "Patching completed successfully.\n";
+/**
+ * Checks whether a table entry is part of a selection.
+ *
+ * @param selection The selection to test.
+ * @param index The index of the entry in the patch table.
+ * @return true if the entry is selected.
+ */
+[[nodiscard]] constexpr bool isSelected(const PatchSelection selection, const std::size_t index) {
+    return index < 64 && (selection >> index & 1) != 0;
+}
+
+/**
+ * Orders the selected patches into waves that respect their `after` dependencies.
+ *
+ * Every entry lands in a later wave than all the entries it depends on. After all
+ * writes of a wave are durable, the image is valid: nothing written so far jumps into
+ * code that is not there yet.
+ *
+ * @param table The patch table.
+ * @param selection The selected patches.
+ * @return The wave of each table entry (0 for unselected ones), or an empty std::optional
+ *         if a dependency is not selected or the dependencies form a cycle.
+ */
+[[nodiscard]] std::optional<std::vector<std::uint32_t> > patchWaves(const PatchTable &table,
+                                                                  const PatchSelection selection) {
+    std::vector<std::vector<std::size_t> > dependencies(table.size());
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        if (!isSelected(selection, i))
+            continue;
+        for (const std::streamoff offset: table[i].after) {
+            bool found = false;
+            for (std::size_t j = 0; j < table.size(); ++j) {
+                if (isSelected(selection, j) && static_cast<std::streamoff>(table[j].pos) == offset) {
+                    dependencies[i].push_back(j);
+                    found = true;
+                }
+            }
+            if (!found) {
+                std::cerr << "Patch '" << table[i].name << "' depends on 0x" << std::hex << offset << std::dec
+                        << ", which is not selected.\n";
+                return std::nullopt;
+            }
+        }
+    }
+
+    std::vector<std::uint32_t> waves(table.size(), 0);
+    for (std::size_t round = 0; round <= table.size(); ++round) {
+        bool changed = false;
+        for (std::size_t i = 0; i < table.size(); ++i) {
+            for (const std::size_t j: dependencies[i]) {
+                if (waves[i] <= waves[j]) {
+                    waves[i] = waves[j] + 1;
+                    changed = true;
+                }
+            }
+        }
+        if (!changed)
+            return waves;
+    }
+    std::cerr << "Patch dependencies form a cycle.\n";
+    return std::nullopt;
+}
+
+/**
+ * @brief A single entry of the PE section table.
+ */
+struct PeSection {
+    std::string name;
+    std::uint32_t virtualAddress = 0;
+    std::uint32_t virtualSize = 0;
+    std::uint32_t rawPointer = 0;
+    std::uint32_t rawSize = 0;
+    std::uint32_t characteristics = 0;
+};
+
+/**
+ * @brief The parts of the PE headers needed to translate file offsets into virtual addresses.
+ */
+struct PeImage {
+    std::uint32_t imageBase = 0;
+    std::uint32_t sizeOfHeaders = 0;
+    std::uint32_t fileHeaderOffset = 0;
+    std::vector<PeSection> sections;
+};
+
+/**
+ * Reads a little-endian scalar from a byte buffer.
+ *
+ * @tparam T The scalar type to read.
+ * @param bytes The buffer to read from.
+ * @param offset The offset of the first byte of the value.
+ * @return The value, or an empty std::optional if it does not fit in the buffer.
+ */
+template<typename T>
+[[nodiscard]] std::optional<T> readScalar(const std::vector<std::uint8_t> &bytes, const std::size_t offset) {
+    if (offset > bytes.size() || bytes.size() - offset < sizeof(T))
+        return std::nullopt;
+    T value{};
+    std::memcpy(&value, bytes.data() + offset, sizeof(T));
+    return value;
+}
+
+/**
+ * Parses the DOS, COFF and optional headers plus the section table of a PE32 image.
+ *
+ * @param bytes The leading bytes of the image; they must cover the whole section table.
+ * @return The parsed headers, or an empty std::optional if the buffer is not a PE32 image.
+ */
+[[nodiscard]] std::optional<PeImage> parsePeHeaders(const std::vector<std::uint8_t> &bytes) {
+    if (bytes.size() < 0x40 || bytes[0] != 'M' || bytes[1] != 'Z') {
+        std::cerr << "Not a PE image: missing MZ signature.\n";
+        return std::nullopt;
+    }
+    const auto peOffset = readScalar<std::uint32_t>(bytes, 0x3C);
+    const auto signature = peOffset ? readScalar<std::uint32_t>(bytes, *peOffset) : std::nullopt;
+    if (!signature || *signature != 0x00004550) {
+        std::cerr << "Not a PE image: missing PE signature.\n";
+        return std::nullopt;
+    }
+
+    PeImage image;
+    image.fileHeaderOffset = *peOffset + 4;
+    const auto sectionCount = readScalar<std::uint16_t>(bytes, image.fileHeaderOffset + 2);
+    const auto optionalSize = readScalar<std::uint16_t>(bytes, image.fileHeaderOffset + 16);
+    const std::size_t optionalOffset = image.fileHeaderOffset + 20;
+    const auto magic = readScalar<std::uint16_t>(bytes, optionalOffset);
+    const auto imageBase = readScalar<std::uint32_t>(bytes, optionalOffset + 28);
+    const auto sizeOfHeaders = readScalar<std::uint32_t>(bytes, optionalOffset + 60);
+    if (!sectionCount || !optionalSize || !magic || *magic != 0x10B || !imageBase || !sizeOfHeaders) {
+        std::cerr << "Not a PE32 image: malformed optional header.\n";
+        return std::nullopt;
+    }
+    image.imageBase = *imageBase;
+    image.sizeOfHeaders = *sizeOfHeaders;
+
+    const std::size_t tableOffset = optionalOffset + *optionalSize;
+    for (std::uint16_t i = 0; i < *sectionCount; ++i) {
+        const std::size_t entry = tableOffset + i * 40u;
+        const auto characteristics = readScalar<std::uint32_t>(bytes, entry + 36);
+        if (!characteristics) {
+            std::cerr << "Truncated PE section table.\n";
+            return std::nullopt;
+        }
+        PeSection section;
+        const auto nameBegin = bytes.begin() + static_cast<std::ptrdiff_t>(entry);
+        section.name.assign(nameBegin, std::find(nameBegin, nameBegin + 8, 0));
+        section.virtualSize = *readScalar<std::uint32_t>(bytes, entry + 8);
+        section.virtualAddress = *readScalar<std::uint32_t>(bytes, entry + 12);
+        section.rawSize = *readScalar<std::uint32_t>(bytes, entry + 16);
+        section.rawPointer = *readScalar<std::uint32_t>(bytes, entry + 20);
+        section.characteristics = *characteristics;
+        image.sections.push_back(std::move(section));
+    }
+    return image;
+}
+
+/**
+ * Reads and parses the PE headers of the executable at the given path.
+ *
+ * @param filepath The path of the executable.
+ * @return The parsed headers, or an empty std::optional on I/O or format errors.
+ */
+[[nodiscard]] std::optional<PeImage> readPeHeaders(const std::string &filepath) {
+    std::ifstream file(filepath, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open " << filepath << " to read PE headers.\n";
+        return std::nullopt;
+    }
+    std::vector<std::uint8_t> bytes(0x1000);
+    file.read(reinterpret_cast<char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    bytes.resize(static_cast<std::size_t>(file.gcount()));
+    return parsePeHeaders(bytes);
+}
+
+/**
+ * Translates a range of file offsets into a relative virtual address using the section table.
+ *
+ * Offsets inside the headers map one to one, since the loader maps the headers at the
+ * image base. The whole range must lie within the mapped part of a single section's raw
+ * data: the first `min(SizeOfRawData, VirtualSize)` bytes, or all of it when VirtualSize is 0.
+ *
+ * @param image The parsed PE headers.
+ * @param offset The file offset of the first byte of the range.
+ * @param length The length of the range in bytes.
+ * @return The RVA of the first byte, or an empty std::optional if the range is not mapped.
+ */
+[[nodiscard]] std::optional<std::uint32_t> fileOffsetToRva(const PeImage &image, const std::uint32_t offset,
+                                                           const std::uint32_t length) {
+    if (offset + length <= image.sizeOfHeaders)
+        return offset;
+    for (const auto &section: image.sections) {
+        // Raw data past VirtualSize is file alignment padding the loader does not map.
+        const std::uint32_t mapped =
+                section.virtualSize == 0 ? section.rawSize : std::min(section.rawSize, section.virtualSize);
+        if (offset >= section.rawPointer && offset + length <= section.rawPointer + mapped)
+            return section.virtualAddress + (offset - section.rawPointer);
+    }
+    return std::nullopt;
+}
+
+/**
+ * Reads the bytes at the given file offset into a buffer of the requested size.
+ *
+ * @param filepath The path of the file to read.
+ * @param pos The file offset to start reading from.
+ * @param size The number of bytes to read.
+ * @return The bytes read, or an empty std::optional if the range could not be read.
+ */
+[[nodiscard]] std::optional<std::vector<std::uint8_t> > readBytesAt(const std::string &filepath,
+                                                                   const std::streampos pos, const std::size_t size) {
+    std::ifstream file(filepath, std::ios::binary);
+    std::vector<std::uint8_t> bytes(size);
+    file.seekg(pos);
+    file.read(reinterpret_cast<char *>(bytes.data()), static_cast<std::streamsize>(size));
+    if (!file)
+        return std::nullopt;
+    return bytes;
+}
+
+#if defined(__linux__)
+/**
+ * @brief One patch of a live patching session, translated into the target's address space.
+ */
+struct LiveWrite {
+    std::uintptr_t address = 0;
+    std::vector<std::uint8_t> original;
+    std::vector<std::uint8_t> patched;
+    std::vector<std::uint8_t> current;
+};
+
+/**
+ * Transfers a batch of buffers from or to another process with process_vm_readv/process_vm_writev.
+ *
+ * The kernel transfers whole iovecs in order and stops at the first one that faults, so the
+ * returned count tells exactly which writes completed.
+ *
+ * @param pid The target process.
+ * @param writes The writes whose `current` (read) or `patched` (write) buffers are transferred.
+ * @param write True to write `patched` into the target, false to read into `current`.
+ * @return The number of leading entries that were transferred completely.
+ */
+[[nodiscard]] std::size_t transferProcessMemory(const pid_t pid, std::vector<LiveWrite *> &writes, const bool write) {
+    std::vector<iovec> local;
+    std::vector<iovec> remote;
+    for (auto *entry: writes) {
+        auto &buffer = write ? entry->patched : entry->current;
+        buffer.resize(entry->original.size());
+        local.push_back({buffer.data(), buffer.size()});
+        remote.push_back({reinterpret_cast<void *>(entry->address), buffer.size()});
+    }
+
+    std::size_t done = 0;
+    const std::size_t batchLimit = static_cast<std::size_t>(sysconf(_SC_IOV_MAX));
+    while (done < writes.size()) {
+        const std::size_t count = std::min(batchLimit, writes.size() - done);
+        const ssize_t result = write
+                                   ? process_vm_writev(pid, &local[done], count, &remote[done], count, 0)
+                                   : process_vm_readv(pid, &local[done], count, &remote[done], count, 0);
+        std::size_t transferred = result < 0 ? 0 : static_cast<std::size_t>(result);
+        std::size_t completed = 0;
+        while (completed < count && transferred >= local[done + completed].iov_len) {
+            transferred -= local[done + completed].iov_len;
+            ++completed;
+        }
+        done += completed;
+        if (completed < count)
+            break;
+    }
+    return done;
+}
+
+/**
+ * Locates the load address of the executable inside the target process.
+ *
+ * The mapping of the executable is found in `/proc/<pid>/maps` by device and inode. When the
+ * loader copied the image into anonymous memory instead (as Wine does for images whose file
+ * alignment is smaller than a page), the preferred image base is used. Either way the COFF
+ * header found at the candidate base must match the one on disk.
+ *
+ * @param pid The target process.
+ * @param exePath The path of the executable on disk.
+ * @param image The parsed PE headers of the executable.
+ * @return The module base address, or an empty std::optional if it could not be located.
+ */
+[[nodiscard]] std::optional<std::uintptr_t> findModuleBase(const pid_t pid, const std::string &exePath,
+                                                           const PeImage &image) {
+    struct stat exeStat{};
+    if (stat(exePath.c_str(), &exeStat) != 0) {
+        std::cerr << "Failed to stat " << exePath << ": " << std::strerror(errno) << "\n";
+        return std::nullopt;
+    }
+
+    std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+    if (!maps) {
+        std::cerr << "Failed to read memory map of process " << pid << ".\n";
+        return std::nullopt;
+    }
+
+    std::optional<std::uintptr_t> fileMapped;
+    bool preferredBaseMapped = false;
+    std::string line;
+    while (std::getline(maps, line)) {
+        unsigned long start = 0, end = 0, offset = 0, inode = 0;
+        unsigned devMajor = 0, devMinor = 0;
+        char perms[5] = {};
+        if (std::sscanf(line.c_str(), "%lx-%lx %4s %lx %x:%x %lu", &start, &end, perms, &offset, &devMajor,
+                        &devMinor, &inode) != 7)
+            continue;
+        if (inode == exeStat.st_ino && devMajor == major(exeStat.st_dev) && devMinor == minor(exeStat.st_dev) &&
+            offset == 0 && (!fileMapped || start < *fileMapped))
+            fileMapped = start;
+        if (start <= image.imageBase && image.imageBase < end)
+            preferredBaseMapped = true;
+    }
+
+    std::optional<std::uintptr_t> base = fileMapped;
+    if (!base && preferredBaseMapped)
+        base = image.imageBase;
+    if (!base) {
+        std::cerr << "Executable is not mapped in process " << pid << ".\n";
+        return std::nullopt;
+    }
+
+    const auto onDisk = readBytesAt(exePath, image.fileHeaderOffset, 20);
+    LiveWrite header{*base + image.fileHeaderOffset, std::vector<std::uint8_t>(20), {}, {}};
+    std::vector<LiveWrite *> batch{&header};
+    if (!onDisk || transferProcessMemory(pid, batch, false) != 1 || header.current != *onDisk) {
+        std::cerr << "Module at 0x" << std::hex << *base << std::dec << " in process " << pid
+                << " does not match " << exePath << ".\n";
+        return std::nullopt;
+    }
+    return base;
+}
+
+/**
+ * Writes the given entries while every thread of the target is stopped under ptrace.
+ *
+ * This is the fallback for pages process_vm_writev cannot write, such as read-only code
+ * pages: writes through `/proc/<pid>/mem` by a tracer ignore page protections.
+ *
+ * @param pid The target process.
+ * @param writes The entries to write.
+ * @return true if every entry was written, false otherwise.
+ */
+[[nodiscard]] bool writeUnderPtraceStop(const pid_t pid, const std::vector<LiveWrite *> &writes) {
+    std::vector<pid_t> stopped;
+    bool attachFailed = false;
+    for (bool foundNew = true; foundNew && !attachFailed;) {
+        foundNew = false;
+        std::error_code ec;
+        for (const auto &task: fs::directory_iterator("/proc/" + std::to_string(pid) + "/task", ec)) {
+            const pid_t tid = std::stoi(task.path().filename().string());
+            if (std::ranges::find(stopped, tid) != stopped.end())
+                continue;
+            foundNew = true;
+            int status = 0;
+            if (ptrace(PTRACE_ATTACH, tid, nullptr, nullptr) != 0 || waitpid(tid, &status, __WALL) != tid) {
+                std::cerr << "Failed to stop thread " << tid << ": " << std::strerror(errno) << "\n";
+                attachFailed = true;
+                break;
+            }
+            stopped.push_back(tid);
+        }
+    }
+
+    bool success = !attachFailed;
+    if (success) {
+        const int mem = open(("/proc/" + std::to_string(pid) + "/mem").c_str(), O_RDWR | O_CLOEXEC);
+        success = mem >= 0;
+        for (const auto *entry: writes) {
+            if (!success)
+                break;
+            const auto size = static_cast<ssize_t>(entry->patched.size());
+            success = pwrite(mem, entry->patched.data(), entry->patched.size(),
+                             static_cast<off_t>(entry->address)) == size;
+        }
+        if (!success)
+            std::cerr << "Failed to write process memory: " << std::strerror(errno) << "\n";
+        if (mem >= 0)
+            close(mem);
+    }
+
+    for (const pid_t tid: stopped)
+        ptrace(PTRACE_DETACH, tid, nullptr, nullptr);
+    return success;
+}
+#endif
+
+/**
+ * @brief Applies the patch table to a running client instead of the file on disk.
+ *
+ * The module base is located in `/proc/<pid>/maps` and every patch offset is translated
+ * to a virtual address through the PE section table. The bytes currently in memory are
+ * read in one batched process_vm_readv and compared against the original bytes, taken
+ * from the backup when one exists or from the executable otherwise. Nothing is written
+ * unless every patch is either still original or already applied. The pending patches
+ * are then written in one batched process_vm_writev; whatever it cannot write because
+ * the pages are read-only is written while the process is stopped under ptrace.
+ * runLiveStandIn provides a process to try this against without a client.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments: `--live <pid> <path to Wow.exe>`.
+ * @return `EXIT_SUCCESS` if the process ends up fully patched, `EXIT_FAILURE` otherwise.
+ */
+int runLivePatch(const int argc, char **argv) {
+#if defined(__linux__)
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " --live <pid> <path to Wow.exe>\n";
+        return EXIT_FAILURE;
+    }
+    pid_t pid = 0;
+    const std::string_view pidArg = argv[2];
+    if (const auto [ptr, ec] = std::from_chars(pidArg.data(), pidArg.data() + pidArg.size(), pid);
+        ec != std::errc{} || ptr != pidArg.data() + pidArg.size() || pid <= 0) {
+        std::cerr << "Invalid process id: " << pidArg << "\n";
+        return EXIT_FAILURE;
+    }
+    const std::string wowPath = argv[3];
+    const std::string referencePath = fs::exists(wowPath + ".backup") ? wowPath + ".backup" : wowPath;
+
+    const auto image = readPeHeaders(wowPath);
+    if (!image)
+        return EXIT_FAILURE;
+    const auto base = findModuleBase(pid, wowPath, *image);
+    if (!base)
+        return EXIT_FAILURE;
+
+    // Writes go out in dependency order, so code is in place before the jumps into it.
+    const PatchTable table = buildPatchTable();
+    const auto waves = patchWaves(table, *parseProfile(table, "all"));
+    if (!waves)
+        return EXIT_FAILURE;
+    std::vector<std::size_t> order(table.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::ranges::stable_sort(order, {}, [&](const std::size_t i) { return (*waves)[i]; });
+
+    std::vector<LiveWrite> writes;
+    for (const std::size_t i: order) {
+        const auto &[name, pos, data, after] = table[i];
+        const auto offset = static_cast<std::uint32_t>(static_cast<std::streamoff>(pos));
+        const auto rva = fileOffsetToRva(*image, offset, static_cast<std::uint32_t>(data.size()));
+        auto original = readBytesAt(referencePath, pos, data.size());
+        if (!rva || !original) {
+            std::cerr << "Patch at file offset 0x" << std::hex << offset << std::dec
+                    << " does not map into the loaded image.\n";
+            return EXIT_FAILURE;
+        }
+        writes.push_back({*base + *rva, std::move(*original), data, {}});
+    }
+
+    std::vector<LiveWrite *> all;
+    for (auto &entry: writes)
+        all.push_back(&entry);
+    if (transferProcessMemory(pid, all, false) != all.size()) {
+        std::cerr << "Failed to read memory of process " << pid << ": " << std::strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::vector<LiveWrite *> pending;
+    for (auto *entry: all) {
+        if (entry->current == entry->patched)
+            continue;
+        if (entry->current != entry->original) {
+            std::cerr << "Unexpected bytes at 0x" << std::hex << entry->address << std::dec
+                    << " in process " << pid << ". Aborting without changes.\n";
+            return EXIT_FAILURE;
+        }
+        pending.push_back(entry);
+    }
+
+    const std::size_t written = transferProcessMemory(pid, pending, true);
+    if (written < pending.size()) {
+        std::vector remaining(pending.begin() + static_cast<std::ptrdiff_t>(written), pending.end());
+        std::cout << "Falling back to ptrace for " << remaining.size() << " read-only patch(es).\n";
+        if (!writeUnderPtraceStop(pid, remaining))
+            return EXIT_FAILURE;
+    }
+
+    if (transferProcessMemory(pid, all, false) != all.size() ||
+        std::ranges::any_of(all, [](const LiveWrite *entry) { return entry->current != entry->patched; })) {
+        std::cerr << "Verification of process " << pid << " after patching failed.\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "Live patching of process " << pid << " completed: " << pending.size() << " applied, "
+            << all.size() - pending.size() << " already present.\n";
+    return EXIT_SUCCESS;
+#else
+    (void) argc;
+    (void) argv;
+    std::cerr << "Live patching is only supported on Linux.\n";
+    return EXIT_FAILURE;
+#endif
+}
+
+/**
+ * @brief A 256-bit digest.
+ */
+using Digest = std::array<std::uint8_t, 32>;
+
+/**
+ * @brief Incremental SHA-256 (FIPS 180-4).
+ */
+class Sha256 {
+public:
+    /**
+     * Feeds more data into the hash.
+     *
+     * @param data The bytes to hash.
+     * @param size The number of bytes.
+     */
+    void update(const std::uint8_t *data, std::size_t size) {
+        length_ += size;
+        if (buffered_ != 0) {
+            const std::size_t take = std::min(size, block_.size() - buffered_);
+            std::memcpy(block_.data() + buffered_, data, take);
+            buffered_ += take;
+            data += take;
+            size -= take;
+            if (buffered_ < block_.size())
+                return;
+            compress(block_.data());
+            buffered_ = 0;
+        }
+        for (; size >= block_.size(); data += block_.size(), size -= block_.size())
+            compress(data);
+        std::memcpy(block_.data(), data, size);
+        buffered_ = size;
+    }
+
+    /**
+     * Pads the message and returns the digest. The object must not be used afterwards.
+     *
+     * @return The SHA-256 digest of all data passed to update().
+     */
+    [[nodiscard]] Digest finish() {
+        const std::uint64_t bits = length_ * 8;
+        constexpr std::uint8_t pad = 0x80;
+        update(&pad, 1);
+        constexpr std::uint8_t zero = 0;
+        while (buffered_ != 56)
+            update(&zero, 1);
+        std::uint8_t trailer[8];
+        for (int i = 0; i < 8; ++i)
+            trailer[i] = static_cast<std::uint8_t>(bits >> (56 - 8 * i));
+        update(trailer, sizeof(trailer));
+
+        Digest digest{};
+        for (std::size_t i = 0; i < state_.size(); ++i)
+            for (std::size_t j = 0; j < 4; ++j)
+                digest[4 * i + j] = static_cast<std::uint8_t>(state_[i] >> (24 - 8 * j));
+        return digest;
+    }
+
+private:
+    static constexpr std::uint32_t rotr(const std::uint32_t x, const int n) { return x >> n | x << (32 - n); }
+
+    void compress(const std::uint8_t *block) {
+        static constexpr std::uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        std::uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = static_cast<std::uint32_t>(block[4 * i]) << 24 | static_cast<std::uint32_t>(block[4 * i + 1]) << 16 |
+                   static_cast<std::uint32_t>(block[4 * i + 2]) << 8 | block[4 * i + 3];
+        for (int i = 16; i < 64; ++i) {
+            const std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ w[i - 15] >> 3;
+            const std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ w[i - 2] >> 10;
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        auto [a, b, c, d, e, f, g, h] = state_;
+        for (int i = 0; i < 64; ++i) {
+            const std::uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            const std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        const std::uint32_t results[8] = {a, b, c, d, e, f, g, h};
+        for (std::size_t i = 0; i < state_.size(); ++i)
+            state_[i] += results[i];
+    }
+
+    std::array<std::uint32_t, 8> state_ = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    std::array<std::uint8_t, 64> block_{};
+    std::size_t buffered_ = 0;
+    std::uint64_t length_ = 0;
+};
+
+/**
+ * Formats a digest as lowercase hexadecimal.
+ *
+ * @param digest The digest to format.
+ * @return The 64-character hexadecimal representation.
+ */
+[[nodiscard]] std::string toHex(const Digest &digest) {
+    static constexpr char kDigits[] = "0123456789abcdef";
+    std::string hex;
+    for (const std::uint8_t byte: digest) {
+        hex += kDigits[byte >> 4];
+        hex += kDigits[byte & 0xF];
+    }
+    return hex;
+}
+
+/**
+ * Computes the version of a patch table: a digest over every entry's name, offset, bytes and dependencies.
+ *
+ * Anything derived from the table (manifests, caches) records this version so it can tell
+ * when the table has changed underneath it.
+ *
+ * @param table The patch table.
+ * @return The catalog version digest.
+ */
+[[nodiscard]] Digest catalogVersion(const PatchTable &table) {
+    Sha256 sha;
+    for (const auto &[name, pos, data, after]: table) {
+        const auto offset = static_cast<std::uint64_t>(static_cast<std::streamoff>(pos));
+        const std::uint64_t fields[4] = {name.size(), offset, data.size(), after.size()};
+        sha.update(reinterpret_cast<const std::uint8_t *>(fields), sizeof(fields));
+        sha.update(reinterpret_cast<const std::uint8_t *>(name.data()), name.size());
+        sha.update(data.data(), data.size());
+        sha.update(reinterpret_cast<const std::uint8_t *>(after.data()), after.size() * sizeof(std::streamoff));
+    }
+    return sha.finish();
+}
+
+/**
+ * @brief The chunk size of the image tree hash.
+ *
+ * Images are hashed as a two-level tree: every chunk of this size is hashed into a
+ * leaf, and the root hashes the leaves together with the image size. Changing a few
+ * bytes therefore only requires rehashing the chunks that contain them.
+ */
+constexpr std::size_t kHashChunkSize = 64 * 1024;
+
+/**
+ * @brief The leaf hashes of an image, one per `kHashChunkSize` chunk.
+ */
+struct ImageLeaves {
+    std::uint64_t size = 0;
+    std::vector<Digest> leaves;
+};
+
+/**
+ * Hashes a single chunk of an image into a leaf of the tree hash.
+ *
+ * @param data The chunk bytes.
+ * @param size The chunk size; only the last chunk may be shorter than `kHashChunkSize`.
+ * @return The leaf hash.
+ */
+[[nodiscard]] Digest hashLeaf(const std::uint8_t *data, const std::size_t size) {
+    Sha256 sha;
+    constexpr std::uint8_t leafTag = 0x00;
+    sha.update(&leafTag, 1);
+    sha.update(data, size);
+    return sha.finish();
+}
+
+/**
+ * Computes the root of the tree hash from the leaf hashes of an image.
+ *
+ * @param image The leaf hashes and size of the image.
+ * @return The image digest.
+ */
+[[nodiscard]] Digest combineLeaves(const ImageLeaves &image) {
+    Sha256 sha;
+    constexpr std::uint8_t rootTag = 0x01;
+    sha.update(&rootTag, 1);
+    for (const auto &leaf: image.leaves)
+        sha.update(leaf.data(), leaf.size());
+    std::uint8_t size[8];
+    for (int i = 0; i < 8; ++i)
+        size[i] = static_cast<std::uint8_t>(image.size >> (8 * i));
+    sha.update(size, sizeof(size));
+    return sha.finish();
+}
+
+/**
+ * Returns the directory used for the patcher's caches.
+ *
+ * `WOW_PATCHER_CACHE_DIR` takes precedence; otherwise the platform's per-user cache
+ * location is used.
+ *
+ * @return The cache directory. It is not created by this function.
+ */
+[[nodiscard]] fs::path cacheDirectory() {
+    if (const char *dir = std::getenv("WOW_PATCHER_CACHE_DIR"); dir && *dir)
+        return dir;
+    if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        return fs::path(xdg) / "wow-335a-patcher";
+#if defined(_WIN32)
+    if (const char *local = std::getenv("LOCALAPPDATA"); local && *local)
+        return fs::path(local) / "wow-335a-patcher";
+#endif
+    if (const char *home = std::getenv("HOME"); home && *home)
+        return fs::path(home) / ".cache" / "wow-335a-patcher";
+    return fs::temp_directory_path() / "wow-335a-patcher";
+}
+
+/**
+ * @brief Header of a cached leaf hash file.
+ *
+ * The cache entry is only valid for the file size and modification time it records.
+ */
+struct LeafCacheHeader {
+    char magic[4] = {'W', '3', 'L', 'H'};
+    std::uint32_t chunkSize = kHashChunkSize;
+    std::uint64_t size = 0;
+    std::int64_t modified = 0;
+    std::uint64_t count = 0;
+};
+
+/**
+ * Computes the leaf hashes of a file by streaming it chunk by chunk.
+ *
+ * @param filepath The file to hash.
+ * @return The leaf hashes, or an empty std::optional if the file could not be read.
+ */
+[[nodiscard]] std::optional<ImageLeaves> computeImageLeaves(const std::string &filepath) {
+    std::ifstream file(filepath, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open " << filepath << " for hashing.\n";
+        return std::nullopt;
+    }
+    ImageLeaves image;
+    std::vector<std::uint8_t> chunk(kHashChunkSize);
+    while (file) {
+        file.read(reinterpret_cast<char *>(chunk.data()), static_cast<std::streamsize>(chunk.size()));
+        const auto got = static_cast<std::size_t>(file.gcount());
+        if (got == 0)
+            break;
+        image.leaves.push_back(hashLeaf(chunk.data(), got));
+        image.size += got;
+    }
+    if (file.bad()) {
+        std::cerr << "Failed to read " << filepath << " for hashing.\n";
+        return std::nullopt;
+    }
+    return image;
+}
+
+/**
+ * @brief The identity of a file as seen by the leaf hash cache.
+ */
+struct LeafCacheKey {
+    fs::path cachePath;
+    std::uint64_t size = 0;
+    std::int64_t modified = 0;
+};
+
+/**
+ * Stats a file and derives the location of its leaf hash cache entry.
+ *
+ * @param filepath The file.
+ * @return The cache key, or an empty std::optional if the file cannot be stat'ed.
+ */
+[[nodiscard]] std::optional<LeafCacheKey> leafCacheKey(const std::string &filepath) {
+    std::error_code ec;
+    const fs::path canonical = fs::weakly_canonical(filepath, ec);
+    const auto size = fs::file_size(filepath, ec);
+    const auto modified = fs::last_write_time(filepath, ec).time_since_epoch().count();
+    if (ec) {
+        std::cerr << "Failed to stat " << filepath << ": " << ec.message() << "\n";
+        return std::nullopt;
+    }
+    const std::string key = canonical.string();
+    Sha256 keyHash;
+    keyHash.update(reinterpret_cast<const std::uint8_t *>(key.data()), key.size());
+    return LeafCacheKey{
+        cacheDirectory() / "leaves" / (toHex(keyHash.finish()).substr(0, 32) + ".bin"), size,
+        static_cast<std::int64_t>(modified)
+    };
+}
+
+/**
+ * Returns the cached leaf hashes of a file without reading the file itself.
+ *
+ * @param filepath The file.
+ * @return The leaf hashes, or an empty std::optional if there is no valid cache entry.
+ */
+[[nodiscard]] std::optional<ImageLeaves> lookupImageLeaves(const std::string &filepath) {
+    const auto key = leafCacheKey(filepath);
+    std::ifstream cached(key ? key->cachePath : fs::path{}, std::ios::binary);
+    LeafCacheHeader header;
+    if (!key || !cached.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, "W3LH", 4) != 0 || header.chunkSize != kHashChunkSize ||
+        header.size != key->size || header.modified != key->modified ||
+        header.count != (key->size + kHashChunkSize - 1) / kHashChunkSize)
+        return std::nullopt;
+    ImageLeaves image{key->size, std::vector<Digest>(header.count)};
+    if (!cached.read(reinterpret_cast<char *>(image.leaves.data()),
+                     static_cast<std::streamsize>(header.count * sizeof(Digest))))
+        return std::nullopt;
+    return image;
+}
+
+/**
+ * Records the leaf hashes of a file in the cache, for the file's current size and mtime.
+ *
+ * @param filepath The file the hashes belong to.
+ * @param image The leaf hashes of the file's current contents.
+ */
+void storeImageLeaves(const std::string &filepath, const ImageLeaves &image) {
+    const auto key = leafCacheKey(filepath);
+    if (!key || key->size != image.size)
+        return;
+    std::error_code ec;
+    fs::create_directories(key->cachePath.parent_path(), ec);
+    const fs::path tempPath = key->cachePath.string() + ".tmp" + std::to_string(std::hash<std::thread::id>{}(
+                                                                     std::this_thread::get_id()));
+    {
+        std::ofstream cache(tempPath, std::ios::binary | std::ios::trunc);
+        const LeafCacheHeader header{.size = key->size, .modified = key->modified, .count = image.leaves.size()};
+        cache.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        cache.write(reinterpret_cast<const char *>(image.leaves.data()),
+                    static_cast<std::streamsize>(image.leaves.size() * sizeof(Digest)));
+        if (!cache) {
+            fs::remove(tempPath, ec);
+            return;
+        }
+    }
+    fs::rename(tempPath, key->cachePath, ec);
+}
+
+/**
+ * Returns the leaf hashes of a file, reusing the cached ones when the file is unchanged.
+ *
+ * Cache entries live under cacheDirectory() and are keyed by the canonical path; an entry
+ * is reused only if the file's size and modification time still match.
+ *
+ * @param filepath The file to hash.
+ * @return The leaf hashes, or an empty std::optional if the file could not be read.
+ */
+[[nodiscard]] std::optional<ImageLeaves> loadImageLeaves(const std::string &filepath) {
+    if (auto cached = lookupImageLeaves(filepath))
+        return cached;
+    auto image = computeImageLeaves(filepath);
+    if (image)
+        storeImageLeaves(filepath, *image);
+    return image;
+}
+
+/**
+ * Computes the digest the image would have after applying a patch profile, without writing it.
+ *
+ * Only the chunks overlapped by selected patches are read back from the original and
+ * rehashed with the patch bytes substituted; every other leaf is reused as is.
+ *
+ * @param filepath The original, unpatched image.
+ * @param original The leaf hashes of the original image.
+ * @param table The patch table.
+ * @param selection The patches to apply.
+ * @return The digest of the patched image, or an empty std::optional on errors.
+ */
+[[nodiscard]] std::optional<Digest> virtualPatchedDigest(const std::string &filepath, const ImageLeaves &original,
+                                                         const PatchTable &table, const PatchSelection selection) {
+    std::vector<std::size_t> touched;
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        if (!isSelected(selection, i))
+            continue;
+        const auto begin = static_cast<std::uint64_t>(static_cast<std::streamoff>(table[i].pos));
+        const std::uint64_t end = begin + table[i].data.size();
+        if (end > original.size) {
+            std::cerr << "Patch '" << table[i].name << "' lies beyond the end of the image.\n";
+            return std::nullopt;
+        }
+        for (std::uint64_t chunk = begin / kHashChunkSize; chunk * kHashChunkSize < end; ++chunk)
+            touched.push_back(static_cast<std::size_t>(chunk));
+    }
+    std::ranges::sort(touched);
+    touched.erase(std::ranges::unique(touched).begin(), touched.end());
+
+    ImageLeaves patched = original;
+    for (const std::size_t chunk: touched) {
+        const std::uint64_t chunkBegin = chunk * kHashChunkSize;
+        const auto chunkSize = static_cast<std::size_t>(std::min<std::uint64_t>(kHashChunkSize,
+                                                                                original.size - chunkBegin));
+        auto bytes = readBytesAt(filepath, static_cast<std::streamoff>(chunkBegin), chunkSize);
+        if (!bytes) {
+            std::cerr << "Failed to read " << filepath << " for hashing.\n";
+            return std::nullopt;
+        }
+        for (std::size_t i = 0; i < table.size(); ++i) {
+            if (!isSelected(selection, i))
+                continue;
+            const auto begin = static_cast<std::uint64_t>(static_cast<std::streamoff>(table[i].pos));
+            for (std::size_t j = 0; j < table[i].data.size(); ++j) {
+                if (begin + j >= chunkBegin && begin + j < chunkBegin + chunkSize)
+                    (*bytes)[begin + j - chunkBegin] = table[i].data[j];
+            }
+        }
+        patched.leaves[chunk] = hashLeaf(bytes->data(), bytes->size());
+    }
+    return combineLeaves(patched);
+}
+
+/**
+ * @brief Prints the digest of the executable as it would be after applying each profile.
+ *
+ * The original image is hashed once (or its cached leaf hashes are reused) and every
+ * profile is then derived from it by rehashing only the chunks its patches touch. No
+ * patched copy is ever written.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments: `--hash <path to Wow.exe> [profile...]`.
+ * @return `EXIT_SUCCESS` if every digest was computed, `EXIT_FAILURE` otherwise.
+ */
+int runHashProfiles(const int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " --hash <path to Wow.exe> [profile...]\n";
+        return EXIT_FAILURE;
+    }
+    const std::string wowPath = argv[2];
+    const auto original = loadImageLeaves(wowPath);
+    if (!original)
+        return EXIT_FAILURE;
+
+    const PatchTable table = buildPatchTable();
+    std::vector<std::string_view> profiles(argv + 3, argv + argc);
+    if (profiles.empty())
+        profiles.emplace_back("all");
+    for (const auto profile: profiles) {
+        const auto selection = parseProfile(table, profile);
+        if (!selection)
+            return EXIT_FAILURE;
+        const auto digest = virtualPatchedDigest(wowPath, *original, table, *selection);
+        if (!digest)
+            return EXIT_FAILURE;
+        std::cout << toHex(*digest) << "  " << profile << "\n";
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Computes SipHash-2-4 of a message under a 128-bit key.
+ *
+ * @param key The 16-byte key.
+ * @param data The message.
+ * @param size The message length in bytes.
+ * @return The 64-bit keyed hash.
+ */
+[[nodiscard]] std::uint64_t sipHash24(const std::array<std::uint8_t, 16> &key, const std::uint8_t *data,
+                                      const std::size_t size) {
+    std::uint64_t k0 = 0, k1 = 0;
+    std::memcpy(&k0, key.data(), 8);
+    std::memcpy(&k1, key.data() + 8, 8);
+    std::uint64_t v0 = 0x736f6d6570736575ULL ^ k0, v1 = 0x646f72616e646f6dULL ^ k1;
+    std::uint64_t v2 = 0x6c7967656e657261ULL ^ k0, v3 = 0x7465646279746573ULL ^ k1;
+    const auto round = [&] {
+        v0 += v1;
+        v1 = v1 << 13 | v1 >> 51;
+        v1 ^= v0;
+        v0 = v0 << 32 | v0 >> 32;
+        v2 += v3;
+        v3 = v3 << 16 | v3 >> 48;
+        v3 ^= v2;
+        v0 += v3;
+        v3 = v3 << 21 | v3 >> 43;
+        v3 ^= v0;
+        v2 += v1;
+        v1 = v1 << 17 | v1 >> 47;
+        v1 ^= v2;
+        v2 = v2 << 32 | v2 >> 32;
+    };
+    const auto absorb = [&](const std::uint64_t m) {
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
+    };
+
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        std::uint64_t m = 0;
+        std::memcpy(&m, data + i, 8);
+        absorb(m);
+    }
+    std::uint64_t last = static_cast<std::uint64_t>(size) << 56;
+    for (std::size_t j = 0; i + j < size; ++j)
+        last |= static_cast<std::uint64_t>(data[i + j]) << (8 * j);
+    absorb(last);
+
+    v2 ^= 0xFF;
+    for (int r = 0; r < 4; ++r)
+        round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/**
+ * Reads a whole file into memory.
+ *
+ * @param filepath The file to read.
+ * @return The file contents, or an empty std::optional if it could not be read.
+ */
+[[nodiscard]] std::optional<std::vector<std::uint8_t> > readWholeFile(const std::string &filepath) {
+    std::error_code ec;
+    const auto size = fs::file_size(filepath, ec);
+    if (ec) {
+        std::cerr << "Failed to stat " << filepath << ": " << ec.message() << "\n";
+        return std::nullopt;
+    }
+    auto bytes = readBytesAt(filepath, 0, static_cast<std::size_t>(size));
+    if (!bytes)
+        std::cerr << "Failed to read " << filepath << ".\n";
+    return bytes;
+}
+
+/**
+ * Applies the selected patches to an image held in memory.
+ *
+ * @param image The image bytes to patch in place.
+ * @param table The patch table.
+ * @param selection The patches to apply.
+ * @return true if every selected patch fit inside the image, false otherwise.
+ */
+[[nodiscard]] bool applyPatches(std::vector<std::uint8_t> &image, const PatchTable &table,
+                                const PatchSelection selection) {
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        if (!isSelected(selection, i))
+            continue;
+        const auto offset = static_cast<std::size_t>(static_cast<std::streamoff>(table[i].pos));
+        if (offset > image.size() || image.size() - offset < table[i].data.size()) {
+            std::cerr << "Patch '" << table[i].name << "' lies beyond the end of the image.\n";
+            return false;
+        }
+        std::ranges::copy(table[i].data, image.begin() + static_cast<std::ptrdiff_t>(offset));
+    }
+    return true;
+}
+
+/**
+ * Copies a range of the image as the loader would lay it out in memory.
+ *
+ * Bytes of a section beyond its raw data, and gaps between sections, read as zero.
+ *
+ * @param file The raw image bytes.
+ * @param image The parsed PE headers of the image.
+ * @param rva The relative virtual address of the first byte.
+ * @param length The number of bytes to copy.
+ * @return The bytes of the range in the loaded image.
+ */
+[[nodiscard]] std::vector<std::uint8_t> readVirtualRange(const std::vector<std::uint8_t> &file, const PeImage &image,
+                                                         const std::uint32_t rva, const std::uint32_t length) {
+    std::vector<std::uint8_t> bytes(length);
+    const auto copyFrom = [&](const std::uint32_t regionRva, const std::uint32_t rawPointer,
+                              const std::uint32_t rawSize) {
+        const std::uint64_t begin = std::max<std::uint64_t>(rva, regionRva);
+        const std::uint64_t end = std::min<std::uint64_t>(std::uint64_t{rva} + length,
+                                                          std::uint64_t{regionRva} + rawSize);
+        for (std::uint64_t va = begin; va < end; ++va) {
+            const std::uint64_t offset = rawPointer + (va - regionRva);
+            if (offset < file.size())
+                bytes[va - rva] = file[offset];
+        }
+    };
+    copyFrom(0, 0, image.sizeOfHeaders);
+    for (const auto &section: image.sections)
+        copyFrom(section.virtualAddress, section.rawPointer, std::min(section.rawSize, section.virtualSize));
+    return bytes;
+}
+
+/**
+ * @brief Header of an integrity manifest file.
+ *
+ * A manifest is a flat little-endian file meant to be mapped directly: this header,
+ * then `profileCount` ManifestProfile entries, then `recordCount` ManifestRecord
+ * entries. `inputs` digests everything the manifest was generated from, so it can be
+ * regenerated exactly when the patch table, the image, the key or the request changes.
+ */
+struct ManifestHeader {
+    char magic[8] = {'W', '3', 'M', 'A', 'N', 'I', 'F', '1'};
+    std::uint32_t profileCount = 0;
+    std::uint32_t recordCount = 0;
+    std::uint64_t keyCheck = 0;
+    Digest catalog{};
+    Digest source{};
+    Digest inputs{};
+};
+
+/**
+ * @brief One profile of an integrity manifest and the slice of records belonging to it.
+ */
+struct ManifestProfile {
+    char name[48] = {};
+    std::uint64_t selection = 0;
+    std::uint32_t firstRecord = 0;
+    std::uint32_t recordCount = 0;
+};
+
+/**
+ * @brief One (VA, length, keyed hash) entry of an integrity manifest.
+ */
+struct ManifestRecord {
+    std::uint32_t va = 0;
+    std::uint32_t length = 0;
+    std::uint64_t hash = 0;
+};
+
+static_assert(sizeof(ManifestHeader) == 120 && sizeof(ManifestProfile) == 64 && sizeof(ManifestRecord) == 16);
+
+/**
+ * Parses a hexadecimal number, with or without a `0x` prefix.
+ *
+ * @param text The text to parse.
+ * @return The value, or an empty std::optional if the text is not a hexadecimal number.
+ */
+[[nodiscard]] std::optional<std::uint64_t> parseHex(std::string_view text) {
+    if (text.starts_with("0x") || text.starts_with("0X"))
+        text.remove_prefix(2);
+    std::uint64_t value = 0;
+    const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value, 16);
+    if (text.empty() || ec != std::errc{} || ptr != text.data() + text.size())
+        return std::nullopt;
+    return value;
+}
+
+/**
+ * @brief Exports the per-region integrity manifest for one or more patch profiles.
+ *
+ * For every profile the image is patched in memory and a SipHash-2-4 of each requested
+ * region and of every patched range is recorded, addressed by VA as the client sees it.
+ * The output is reproducible for a given key, and is only rewritten when one of its
+ * inputs changed, including the patch table itself.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments:
+ *             `--manifest <path to Wow.exe> <output> --key <hex> [--region <va>:<length>]... [profile...]`.
+ * @return `EXIT_SUCCESS` if the manifest is up to date, `EXIT_FAILURE` otherwise.
+ */
+int runManifestExport(const int argc, char **argv) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0]
+                << " --manifest <path to Wow.exe> <output> --key <32 hex digits> [--region <va>:<length>]..."
+                " [profile...]\n";
+        return EXIT_FAILURE;
+    }
+    const std::string wowPath = argv[2];
+    const std::string outputPath = argv[3];
+    std::optional<std::array<std::uint8_t, 16> > key;
+    std::vector<std::pair<std::uint32_t, std::uint32_t> > regions;
+    std::vector<std::string> profiles;
+    for (int i = 4; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--key" && i + 1 < argc) {
+            const std::string_view hex = argv[++i];
+            std::array<std::uint8_t, 16> bytes{};
+            for (std::size_t j = 0; hex.size() == 32 && j < bytes.size(); ++j) {
+                const auto byte = parseHex(hex.substr(2 * j, 2));
+                if (!byte)
+                    break;
+                bytes[j] = static_cast<std::uint8_t>(*byte);
+                if (j + 1 == bytes.size())
+                    key = bytes;
+            }
+            if (!key) {
+                std::cerr << "The key must be 32 hexadecimal digits.\n";
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--region" && i + 1 < argc) {
+            const std::string_view spec = argv[++i];
+            const std::size_t colon = spec.find(':');
+            const auto va = parseHex(spec.substr(0, colon));
+            const auto length = colon == std::string_view::npos ? std::nullopt : parseHex(spec.substr(colon + 1));
+            if (!va || !length || *va > UINT32_MAX || *length == 0 || *length > UINT32_MAX - *va) {
+                std::cerr << "Invalid region '" << spec << "', expected <va>:<length> in hex.\n";
+                return EXIT_FAILURE;
+            }
+            regions.emplace_back(static_cast<std::uint32_t>(*va), static_cast<std::uint32_t>(*length));
+        } else if (arg.size() < sizeof(ManifestProfile::name)) {
+            profiles.emplace_back(arg);
+        } else {
+            std::cerr << "Profile name too long: " << arg << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+    if (!key) {
+        std::cerr << "A manifest key is required (--key).\n";
+        return EXIT_FAILURE;
+    }
+    if (profiles.empty())
+        profiles.emplace_back("all");
+
+    const PatchTable table = buildPatchTable();
+    const auto leaves = loadImageLeaves(wowPath);
+    if (!leaves)
+        return EXIT_FAILURE;
+
+    ManifestHeader header;
+    header.keyCheck = sipHash24(*key, nullptr, 0);
+    header.catalog = catalogVersion(table);
+    header.source = combineLeaves(*leaves);
+    Sha256 inputs;
+    inputs.update(header.catalog.data(), header.catalog.size());
+    inputs.update(header.source.data(), header.source.size());
+    inputs.update(reinterpret_cast<const std::uint8_t *>(&header.keyCheck), sizeof(header.keyCheck));
+    for (const auto &[va, length]: regions) {
+        const std::uint32_t fields[2] = {va, length};
+        inputs.update(reinterpret_cast<const std::uint8_t *>(fields), sizeof(fields));
+    }
+    for (const auto &profile: profiles)
+        inputs.update(reinterpret_cast<const std::uint8_t *>(profile.c_str()), profile.size() + 1);
+    header.inputs = inputs.finish();
+
+    if (std::ifstream existing(outputPath, std::ios::binary); existing) {
+        ManifestHeader current;
+        existing.read(reinterpret_cast<char *>(&current), sizeof(current));
+        if (existing && std::memcmp(current.magic, header.magic, sizeof(header.magic)) == 0 &&
+            current.inputs == header.inputs) {
+            std::cout << "Manifest " << outputPath << " is up to date.\n";
+            return EXIT_SUCCESS;
+        }
+    }
+
+    const auto original = readWholeFile(wowPath);
+    const auto pe = original ? parsePeHeaders(*original) : std::nullopt;
+    if (!pe)
+        return EXIT_FAILURE;
+
+    std::vector<ManifestProfile> entries;
+    std::vector<ManifestRecord> records;
+    for (const auto &profile: profiles) {
+        const auto selection = parseProfile(table, profile);
+        if (!selection)
+            return EXIT_FAILURE;
+        std::vector<std::uint8_t> patched = *original;
+        if (!applyPatches(patched, table, *selection))
+            return EXIT_FAILURE;
+
+        std::vector<std::pair<std::uint32_t, std::uint32_t> > ranges = regions;
+        for (std::size_t i = 0; i < table.size(); ++i) {
+            if (!isSelected(*selection, i))
+                continue;
+            const auto length = static_cast<std::uint32_t>(table[i].data.size());
+            const auto rva = fileOffsetToRva(*pe, static_cast<std::uint32_t>(static_cast<std::streamoff>(
+                                                 table[i].pos)), length);
+            if (!rva) {
+                std::cerr << "Patch '" << table[i].name << "' does not map into the loaded image.\n";
+                return EXIT_FAILURE;
+            }
+            ranges.emplace_back(pe->imageBase + *rva, length);
+        }
+
+        ManifestProfile entry;
+        std::ranges::copy(profile, entry.name);
+        entry.selection = *selection;
+        entry.firstRecord = static_cast<std::uint32_t>(records.size());
+        for (const auto &[va, length]: ranges) {
+            if (va < pe->imageBase) {
+                std::cerr << "Region at 0x" << std::hex << va << std::dec << " lies below the image base.\n";
+                return EXIT_FAILURE;
+            }
+            const auto bytes = readVirtualRange(patched, *pe, va - pe->imageBase, length);
+            records.push_back({va, length, sipHash24(*key, bytes.data(), bytes.size())});
+        }
+        entry.recordCount = static_cast<std::uint32_t>(records.size()) - entry.firstRecord;
+        entries.push_back(entry);
+    }
+
+    header.profileCount = static_cast<std::uint32_t>(entries.size());
+    header.recordCount = static_cast<std::uint32_t>(records.size());
+    const std::string tempPath = outputPath + ".tmp";
+    {
+        std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(entries.data()),
+                  static_cast<std::streamsize>(entries.size() * sizeof(ManifestProfile)));
+        out.write(reinterpret_cast<const char *>(records.data()),
+                  static_cast<std::streamsize>(records.size() * sizeof(ManifestRecord)));
+        if (handleStreamError(out, "Failed to write manifest " + tempPath))
+            return EXIT_FAILURE;
+    }
+    std::error_code ec;
+    fs::rename(tempPath, outputPath, ec);
+    if (ec) {
+        std::cerr << "Failed to replace manifest " << outputPath << ": " << ec.message() << "\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "Manifest written to " << outputPath << ": " << entries.size() << " profile(s), "
+            << records.size() << " record(s).\n";
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief One coalesced write of a compiled patch plan.
+ *
+ * Writes of a lower wave must be durable before any write of a higher wave starts.
+ */
+struct PlanWrite {
+    std::uint32_t offset = 0;
+    std::vector<std::uint8_t> data;
+    std::uint32_t wave = 0;
+};
+
+/**
+ * @brief The writes needed to apply a patch selection to one specific image.
+ *
+ * A plan is only valid for the image digest, catalog version and selection it was
+ * compiled for; together they form its cache key.
+ */
+struct PatchPlan {
+    Digest image{};
+    Digest catalog{};
+    PatchSelection selection = 0;
+    std::vector<PlanWrite> writes;
+};
+
+/**
+ * @brief Header of a cached plan file.
+ *
+ * A plan file is flat and little-endian so it can be mapped directly: this header, then
+ * `writeCount` PlanFileWrite entries, then `byteCount` bytes of write payload that the
+ * entries point into.
+ */
+struct PlanFileHeader {
+    char magic[8] = {'W', '3', 'P', 'L', 'A', 'N', '0', '2'};
+    Digest image{};
+    Digest catalog{};
+    std::uint64_t selection = 0;
+    std::uint32_t writeCount = 0;
+    std::uint32_t byteCount = 0;
+};
+
+/**
+ * @brief One write of a cached plan file.
+ */
+struct PlanFileWrite {
+    std::uint32_t offset = 0;
+    std::uint32_t length = 0;
+    std::uint32_t dataOffset = 0;
+    std::uint32_t wave = 0;
+};
+
+static_assert(sizeof(PlanFileHeader) == 88 && sizeof(PlanFileWrite) == 16);
+
+/**
+ * Runs `body(begin, end)` over contiguous slices of `[0, count)` on all hardware threads.
+ *
+ * @tparam Body A callable taking `(std::size_t begin, std::size_t end)`.
+ * @param count The number of items.
+ * @param body The work for one slice.
+ */
+template<typename Body>
+void parallelFor(const std::size_t count, Body &&body) {
+    const std::size_t threads =
+            std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1, std::max<std::size_t>(count, 1));
+    const std::size_t slice = (count + threads - 1) / threads;
+    std::vector<std::jthread> workers;
+    for (std::size_t begin = slice; begin < count; begin += slice)
+        workers.emplace_back([&body, begin, end = std::min(count, begin + slice)] { body(begin, end); });
+    body(0, std::min(count, slice));
+}
+
+/**
+ * @brief Operand flags of an x86 opcode, as used by decodeInstruction.
+ */
+enum OpcodeFlags : std::uint8_t {
+    kOpModRm = 0x01,
+    /** The instruction's immediate is a relative branch displacement. */
+    kOpBranch = 0x02,
+    kOpPrefix = 0x04,
+    /** The immediate kind, one of the kImm* values. */
+    kOpImmShift = 4,
+};
+
+/**
+ * @brief Immediate operand kinds: none, byte, word, word or dword by operand size, the
+ * `enter` operands, a far pointer, a memory offset, and group 3 (only `test` has one).
+ */
+enum ImmediateKind : std::uint8_t {
+    kImmNone,
+    kImmByte,
+    kImmWord,
+    kImmFull,
+    kImmEnter,
+    kImmFar,
+    kImmOffset,
+    kImmGroup3,
+};
+
+/**
+ * @brief Operand layout of every one-byte opcode (0-255) and every `0F`-prefixed opcode
+ * (256-511) in 32-bit mode.
+ */
+constexpr auto kOpcodeTable = [] {
+    std::array<std::uint8_t, 512> table{};
+    const auto set = [&](const int first, const int last, const int flags, const ImmediateKind imm = kImmNone) {
+        for (int op = first; op <= last; ++op)
+            table[op] = static_cast<std::uint8_t>(flags | imm << kOpImmShift);
+    };
+    // One-byte opcodes. The arithmetic block repeats `op r/m,r` x4, `op al,ib`, `op eax,iz`.
+    for (int row = 0x00; row < 0x40; row += 8) {
+        set(row, row + 3, kOpModRm);
+        set(row + 4, row + 4, 0, kImmByte);
+        set(row + 5, row + 5, 0, kImmFull);
+    }
+    for (const int prefix: {0x26, 0x2E, 0x36, 0x3E, 0x64, 0x65, 0x66, 0x67, 0xF0, 0xF2, 0xF3})
+        set(prefix, prefix, kOpPrefix);
+    set(0x62, 0x63, kOpModRm);
+    set(0x68, 0x68, 0, kImmFull);
+    set(0x69, 0x69, kOpModRm, kImmFull);
+    set(0x6A, 0x6A, 0, kImmByte);
+    set(0x6B, 0x6B, kOpModRm, kImmByte);
+    set(0x70, 0x7F, kOpBranch, kImmByte);
+    set(0x80, 0x80, kOpModRm, kImmByte);
+    set(0x81, 0x81, kOpModRm, kImmFull);
+    set(0x82, 0x83, kOpModRm, kImmByte);
+    set(0x84, 0x8F, kOpModRm);
+    set(0x9A, 0x9A, 0, kImmFar);
+    set(0xA0, 0xA3, 0, kImmOffset);
+    set(0xA8, 0xA8, 0, kImmByte);
+    set(0xA9, 0xA9, 0, kImmFull);
+    set(0xB0, 0xB7, 0, kImmByte);
+    set(0xB8, 0xBF, 0, kImmFull);
+    set(0xC0, 0xC1, kOpModRm, kImmByte);
+    set(0xC2, 0xC2, 0, kImmWord);
+    set(0xC4, 0xC5, kOpModRm);
+    set(0xC6, 0xC6, kOpModRm, kImmByte);
+    set(0xC7, 0xC7, kOpModRm, kImmFull);
+    set(0xC8, 0xC8, 0, kImmEnter);
+    set(0xCA, 0xCA, 0, kImmWord);
+    set(0xCD, 0xCD, 0, kImmByte);
+    set(0xD0, 0xD3, kOpModRm);
+    set(0xD4, 0xD5, 0, kImmByte);
+    set(0xD8, 0xDF, kOpModRm);
+    set(0xE0, 0xE3, kOpBranch, kImmByte);
+    set(0xE4, 0xE7, 0, kImmByte);
+    set(0xE8, 0xE9, kOpBranch, kImmFull);
+    set(0xEA, 0xEA, 0, kImmFar);
+    set(0xEB, 0xEB, kOpBranch, kImmByte);
+    set(0xF6, 0xF7, kOpModRm, kImmGroup3);
+    set(0xFE, 0xFF, kOpModRm);
+    // Two-byte opcodes: nearly all take a ModRM byte; list the exceptions.
+    set(0x100, 0x1FF, kOpModRm);
+    for (const auto &[first, last]: {std::pair{0x04, 0x0C}, {0x0E, 0x0E}, {0x30, 0x37}, {0x39, 0x39}, {0x3B, 0x3F},
+                                    {0x77, 0x77}, {0xA0, 0xA2}, {0xA8, 0xAA}, {0xC8, 0xCF}})
+        set(0x100 + first, 0x100 + last, 0);
+    for (const int op: {0x0F, 0x3A, 0x70, 0x71, 0x72, 0x73, 0xA4, 0xAC, 0xBA, 0xC2, 0xC4, 0xC5, 0xC6})
+        set(0x100 + op, 0x100 + op, kOpModRm, kImmByte);
+    set(0x180, 0x18F, kOpBranch, kImmFull);
+    return table;
+}();
+
+/**
+ * @brief The length of a decoded instruction and, for direct branches, its displacement.
+ */
+struct DecodedInstruction {
+    std::uint32_t length = 1;
+    std::optional<std::int32_t> displacement;
+};
+
+/**
+ * Decodes the length of one 32-bit x86 instruction.
+ *
+ * Only the instruction's layout is decoded: prefixes, opcode, ModRM, SIB, displacement
+ * and immediate. Bytes that do not form an instruction, including one cut short by
+ * `available` or running past 15 bytes, decode as a one-byte instruction, so a linear
+ * sweep always advances through padding, embedded data and a section's ragged end.
+ *
+ * @param code The instruction's first byte.
+ * @param available The number of bytes readable at `code`.
+ * @return The instruction's length and, for `jmp`, `jcc`, `call`, `loop` and `jcxz` with a
+ *         relative operand, the displacement from the end of the instruction.
+ */
+[[nodiscard]] constexpr DecodedInstruction decodeInstruction(const std::uint8_t *code, const std::size_t available) {
+    constexpr std::size_t kMaxLength = 15;
+    constexpr DecodedInstruction undecodable{1, std::nullopt};
+    const std::size_t limit = std::min(available, kMaxLength);
+    std::size_t at = 0;
+    bool operand16 = false;
+    bool address16 = false;
+    std::size_t index = 0;
+    do {
+        if (at >= limit)
+            return undecodable;
+        index = code[at++];
+        operand16 |= index == 0x66;
+        address16 |= index == 0x67;
+    } while (kOpcodeTable[index] & kOpPrefix);
+    if (index == 0x0F) {
+        if (at >= limit)
+            return undecodable;
+        index = 0x100 + code[at++];
+        // 0F 38 and 0F 3A are followed by a third opcode byte.
+        if (index == 0x138 || index == 0x13A)
+            ++at;
+    } else if ((index == 0xC4 || index == 0xC5) && at + 2 < limit && (code[at] & 0xC0) == 0xC0) {
+        // LES and LDS with a register operand are VEX prefixes; C4 selects the opcode map.
+        const int map = index == 0xC5 ? 1 : code[at] & 0x1F;
+        at += index == 0xC5 ? 1 : 2;
+        index = map == 2 ? 0x138 : map == 3 ? 0x13A : 0x100 + code[at];
+        ++at;
+    }
+
+    const std::uint8_t flags = kOpcodeTable[index];
+    std::uint8_t modrm = 0;
+    if (flags & kOpModRm) {
+        if (at >= limit)
+            return undecodable;
+        modrm = code[at++];
+        const int mod = modrm >> 6;
+        const int rm = modrm & 7;
+        if (address16) {
+            at += mod == 1 ? 1 : mod == 2 || (mod == 0 && rm == 6) ? 2 : 0;
+        } else {
+            if (mod != 3 && rm == 4) {
+                if (at >= limit)
+                    return undecodable;
+                if (mod == 0 && (code[at] & 7) == 5)
+                    at += 4;
+                ++at;
+            }
+            at += mod == 1 ? 1 : mod == 2 || (mod == 0 && rm == 5) ? 4 : 0;
+        }
+    }
+
+    const std::size_t full = operand16 ? 2 : 4;
+    std::size_t immediate = 0;
+    switch (static_cast<ImmediateKind>(flags >> kOpImmShift)) {
+        case kImmNone: break;
+        case kImmByte: immediate = 1; break;
+        case kImmWord: immediate = 2; break;
+        case kImmFull: immediate = full; break;
+        case kImmEnter: immediate = 3; break;
+        case kImmFar: immediate = full + 2; break;
+        case kImmOffset: immediate = address16 ? 2 : 4; break;
+        case kImmGroup3:
+            if (((modrm >> 3) & 7) < 2)
+                immediate = index == 0xF6 ? 1 : full;
+            break;
+    }
+    at += immediate;
+    if (at > limit)
+        return undecodable;
+
+    DecodedInstruction decoded{static_cast<std::uint32_t>(at), std::nullopt};
+    if (flags & kOpBranch) {
+        const std::uint8_t *value = code + at - immediate;
+        decoded.displacement = immediate == 1
+                                   ? static_cast<std::int8_t>(value[0])
+                                   : immediate == 2
+                                         ? static_cast<std::int16_t>(value[0] | value[1] << 8)
+                                         : static_cast<std::int32_t>(value[0] | value[1] << 8 | value[2] << 16 |
+                                                                     static_cast<std::uint32_t>(value[3]) << 24);
+    }
+    return decoded;
+}
+
+// A truncated tail and a run of prefixes longer than any instruction still advance by one byte.
+constexpr std::array<std::uint8_t, 1> kTruncatedTail{0x00};
+constexpr std::array<std::uint8_t, 16> kPrefixRun{0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+                                                  0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66};
+constexpr std::array<std::uint8_t, 5> kRelativeCall{0xE8, 0x10, 0x00, 0x00, 0x00};
+static_assert(decodeInstruction(kTruncatedTail.data(), kTruncatedTail.size()).length == 1);
+static_assert(decodeInstruction(kPrefixRun.data(), kPrefixRun.size()).length == 1);
+static_assert(decodeInstruction(kRelativeCall.data(), 3).length == 1);
+static_assert(decodeInstruction(kRelativeCall.data(), kRelativeCall.size()).length == 5 &&
+              decodeInstruction(kRelativeCall.data(), kRelativeCall.size()).displacement == 0x10);
+
+/**
+ * @brief A direct branch: the instruction at file offset `source` jumps to or calls `target`.
+ */
+struct BranchXref {
+    std::uint32_t target = 0;
+    std::uint32_t source = 0;
+
+    auto operator<=>(const BranchXref &) const = default;
+};
+
+/**
+ * @brief Header of a cached branch index file, followed by `count` BranchXref entries.
+ */
+struct XrefFileHeader {
+    char magic[8] = {'W', '3', 'X', 'R', 'E', 'F', '0', '1'};
+    Digest image{};
+    std::uint64_t count = 0;
+};
+
+static_assert(sizeof(XrefFileHeader) == 48 && sizeof(BranchXref) == 8);
+
+/** The IMAGE_SCN_MEM_EXECUTE section characteristic. */
+constexpr std::uint32_t kSectionExecutable = 0x20000000;
+
+/**
+ * Builds the branch index of an image by a linear sweep of its executable sections.
+ *
+ * Each section is split into one slice per hardware thread and every slice is swept from
+ * its first byte. A slice that does not start on an instruction boundary of the sweep
+ * before it is then re-swept from the correct boundary until it falls back into step
+ * with its own decoding, which x86 does within a few instructions, so the result is
+ * exactly that of one sequential sweep. Only targets inside an executable section are
+ * kept, as file offsets, sorted by target.
+ *
+ * @param filepath The image.
+ * @param image Its PE headers.
+ * @return The branches, or an empty std::optional if a section could not be read.
+ */
+[[nodiscard]] std::optional<std::vector<BranchXref> > buildXrefIndex(const std::string &filepath,
+                                                                    const PeImage &image) {
+    const auto codeSize = [](const PeSection &section) {
+        return section.virtualSize == 0 ? section.rawSize : std::min(section.rawSize, section.virtualSize);
+    };
+    const auto targetOffset = [&](const std::uint32_t rva) -> std::optional<std::uint32_t> {
+        for (const auto &section: image.sections) {
+            if ((section.characteristics & kSectionExecutable) && rva >= section.virtualAddress &&
+                rva - section.virtualAddress < codeSize(section))
+                return section.rawPointer + (rva - section.virtualAddress);
+        }
+        return std::nullopt;
+    };
+
+    struct SliceSweep {
+        std::size_t begin = 0;
+        std::size_t end = 0;
+        /** Where the last instruction of the slice ends; may lie past `end`. */
+        std::size_t stop = 0;
+        std::vector<std::uint32_t> starts;
+        std::vector<BranchXref> xrefs;
+    };
+
+    std::vector<BranchXref> index;
+    for (const auto &section: image.sections) {
+        if (!(section.characteristics & kSectionExecutable) || codeSize(section) == 0)
+            continue;
+        const auto code = readBytesAt(filepath, section.rawPointer, codeSize(section));
+        if (!code) {
+            std::cerr << "Failed to read section " << section.name << " of " << filepath << ".\n";
+            return std::nullopt;
+        }
+
+        // Sweeps [from, to) of the section, stopping early at an instruction start of `sync`.
+        const auto sweep = [&](SliceSweep &out, std::size_t from, const std::size_t to,
+                               const std::vector<std::uint32_t> *sync) {
+            while (from < to) {
+                if (sync && std::ranges::binary_search(*sync, static_cast<std::uint32_t>(from)))
+                    break;
+                const auto decoded = decodeInstruction(code->data() + from, code->size() - from);
+                out.starts.push_back(static_cast<std::uint32_t>(from));
+                if (decoded.displacement) {
+                    const std::uint32_t next =
+                            section.virtualAddress + static_cast<std::uint32_t>(from) + decoded.length;
+                    if (const auto target = targetOffset(next + static_cast<std::uint32_t>(*decoded.displacement)))
+                        out.xrefs.push_back({*target, section.rawPointer + static_cast<std::uint32_t>(from)});
+                }
+                from += decoded.length;
+            }
+            return from;
+        };
+
+        std::mutex slicesMutex;
+        std::vector<SliceSweep> slices;
+        parallelFor(code->size(), [&](const std::size_t begin, const std::size_t end) {
+            SliceSweep slice{begin, end, 0, {}, {}};
+            slice.stop = sweep(slice, begin, end, nullptr);
+            std::lock_guard lock(slicesMutex);
+            slices.push_back(std::move(slice));
+        });
+        std::ranges::sort(slices, {}, &SliceSweep::begin);
+
+        for (std::size_t i = 1; i < slices.size(); ++i) {
+            auto &slice = slices[i];
+            const std::size_t from = slices[i - 1].stop;
+            if (from == slice.begin)
+                continue;
+            SliceSweep head;
+            const std::size_t synced = sweep(head, from, slice.end, &slice.starts);
+            if (synced >= slice.end)
+                slice.stop = synced;
+            // Keep the slice's own decoding from the point where the two sweeps agree.
+            std::erase_if(slice.xrefs, [&](const BranchXref &xref) {
+                return xref.source < section.rawPointer + synced;
+            });
+            slice.xrefs.insert(slice.xrefs.begin(), head.xrefs.begin(), head.xrefs.end());
+            std::erase_if(slice.starts, [&](const std::uint32_t start) { return start < synced; });
+            slice.starts.insert(slice.starts.begin(), head.starts.begin(), head.starts.end());
+        }
+        for (const auto &slice: slices)
+            index.insert(index.end(), slice.xrefs.begin(), slice.xrefs.end());
+    }
+    std::ranges::sort(index);
+    return index;
+}
+
+/**
+ * Returns the branch index of an image, from the cache if possible.
+ *
+ * Indexes are cached under cacheDirectory() by image digest; an image whose digest is
+ * not known yet (a zero digest) is indexed without caching.
+ *
+ * @param filepath The image.
+ * @param image Its PE headers.
+ * @param imageDigest The digest of the image.
+ * @return The branches sorted by target, or an empty std::optional if they could not be built.
+ */
+[[nodiscard]] std::optional<std::vector<BranchXref> > loadXrefIndex(const std::string &filepath, const PeImage &image,
+                                                                   const Digest &imageDigest) {
+    const bool cacheable = imageDigest != Digest{};
+    const fs::path path = cacheDirectory() / "xrefs" / (toHex(imageDigest) + ".xref");
+    if (cacheable) {
+        std::ifstream file(path, std::ios::binary);
+        XrefFileHeader header;
+        if (file.read(reinterpret_cast<char *>(&header), sizeof(header)) &&
+            std::memcmp(header.magic, XrefFileHeader{}.magic, sizeof(header.magic)) == 0 &&
+            header.image == imageDigest && header.count <= kExpectedSize) {
+            std::vector<BranchXref> index(static_cast<std::size_t>(header.count));
+            if (file.read(reinterpret_cast<char *>(index.data()),
+                          static_cast<std::streamsize>(index.size() * sizeof(BranchXref))))
+                return index;
+        }
+    }
+
+    auto index = buildXrefIndex(filepath, image);
+    if (index && cacheable) {
+        XrefFileHeader header;
+        header.image = imageDigest;
+        header.count = index->size();
+        std::vector<std::uint8_t> bytes(sizeof(header) + index->size() * sizeof(BranchXref));
+        std::memcpy(bytes.data(), &header, sizeof(header));
+        std::memcpy(bytes.data() + sizeof(header), index->data(), index->size() * sizeof(BranchXref));
+        // A failed store only costs rebuilding the index next time.
+        std::error_code ec;
+        fs::create_directories(path.parent_path(), ec);
+        const fs::path tempPath = path.string() + ".tmp" + std::to_string(std::hash<std::thread::id>{}(
+                                                              std::this_thread::get_id()));
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+        file.close();
+        if (file)
+            fs::rename(tempPath, path, ec);
+        else
+            fs::remove(tempPath, ec);
+    }
+    return index;
+}
+
+/**
+ * Compiles the selected patches into a plan for one image.
+ *
+ * Every write must map into the PE image, and no branch elsewhere in the code may land
+ * strictly inside a patched range (see loadXrefIndex): that branch would jump into the
+ * middle of the new bytes. Branches to a patch's first byte, and branches from inside
+ * any selected patch, are fine. Writes are ordered by dependency wave and offset, and
+ * adjacent or overlapping writes of the same wave are coalesced. Overlapping writes that
+ * disagree on a byte are rejected.
+ *
+ * @param filepath The image the plan is for.
+ * @param imageDigest The digest of the image.
+ * @param table The patch table.
+ * @param selection The patches to apply.
+ * @return The plan, or an empty std::optional if the selection cannot be applied to the image.
+ */
+[[nodiscard]] std::optional<PatchPlan> compilePlan(const std::string &filepath, const Digest &imageDigest,
+                                                   const PatchTable &table, const PatchSelection selection) {
+    const auto image = readPeHeaders(filepath);
+    if (!image)
+        return std::nullopt;
+
+    std::vector<const Patch *> selected;
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        if (!isSelected(selection, i))
+            continue;
+        const auto offset = static_cast<std::streamoff>(table[i].pos);
+        const auto length = static_cast<std::uint32_t>(table[i].data.size());
+        if (offset < 0 || offset + length > kExpectedSize ||
+            !fileOffsetToRva(*image, static_cast<std::uint32_t>(offset), length)) {
+            std::cerr << "Patch '" << table[i].name << "' does not map into the image.\n";
+            return std::nullopt;
+        }
+        selected.push_back(&table[i]);
+    }
+
+    const auto xrefs = loadXrefIndex(filepath, *image, imageDigest);
+    if (!xrefs)
+        return std::nullopt;
+    // A branch written by the selection itself (e.g. a cave jumping back into its trampoline
+    // on an image that is already patched) is part of the fix, not code the fix breaks.
+    const auto insideSelection = [&](const std::uint32_t offset) {
+        return std::ranges::any_of(selected, [&](const Patch *patch) {
+            const auto begin = static_cast<std::uint32_t>(static_cast<std::streamoff>(patch->pos));
+            return offset >= begin && offset - begin < patch->data.size();
+        });
+    };
+    for (const Patch *patch: selected) {
+        const auto begin = static_cast<std::uint32_t>(static_cast<std::streamoff>(patch->pos));
+        const auto end = begin + static_cast<std::uint32_t>(patch->data.size());
+        for (auto it = std::ranges::upper_bound(*xrefs, begin, {}, &BranchXref::target);
+             it != xrefs->end() && it->target < end; ++it) {
+            if (insideSelection(it->source))
+                continue;
+            std::cerr << "Patch '" << patch->name << "' overwrites 0x" << std::hex << it->target
+                    << ", the target of a branch at 0x" << it->source << std::dec << ".\n";
+            return std::nullopt;
+        }
+    }
+
+    const auto waves = patchWaves(table, selection);
+    if (!waves)
+        return std::nullopt;
+    const auto waveOf = [&](const Patch *patch) { return (*waves)[static_cast<std::size_t>(patch - table.data())]; };
+    std::ranges::sort(selected, {}, [&](const Patch *patch) {
+        return std::pair{waveOf(patch), static_cast<std::streamoff>(patch->pos)};
+    });
+
+    PatchPlan plan{imageDigest, catalogVersion(table), selection, {}};
+    for (const Patch *patch: selected) {
+        const auto offset = static_cast<std::uint32_t>(static_cast<std::streamoff>(patch->pos));
+        if (plan.writes.empty() || plan.writes.back().wave != waveOf(patch) ||
+            offset > plan.writes.back().offset + plan.writes.back().data.size()) {
+            plan.writes.push_back({offset, patch->data, waveOf(patch)});
+            continue;
+        }
+        auto &[mergedOffset, merged, wave] = plan.writes.back();
+        for (std::size_t j = 0; j < patch->data.size(); ++j) {
+            const std::size_t at = offset - mergedOffset + j;
+            if (at == merged.size()) {
+                merged.push_back(patch->data[j]);
+            } else if (merged[at] != patch->data[j]) {
+                std::cerr << "Patch '" << patch->name << "' conflicts with an overlapping patch.\n";
+                return std::nullopt;
+            }
+        }
+    }
+    return plan;
+}
+
+/**
+ * Returns the path of the cache file for a plan key.
+ *
+ * @param imageDigest The digest of the image.
+ * @param catalog The version of the catalog.
+ * @param selection The patch selection.
+ * @return The cache file path under cacheDirectory().
+ */
+[[nodiscard]] fs::path planCachePath(const Digest &imageDigest, const Digest &catalog,
+                                     const PatchSelection selection) {
+    Sha256 key;
+    key.update(imageDigest.data(), imageDigest.size());
+    key.update(catalog.data(), catalog.size());
+    key.update(reinterpret_cast<const std::uint8_t *>(&selection), sizeof(selection));
+    return cacheDirectory() / "plans" / (toHex(key.finish()).substr(0, 32) + ".plan");
+}
+
+/**
+ * Looks up a compiled plan in the on-disk cache.
+ *
+ * @param imageDigest The digest of the image.
+ * @param catalog The version of the catalog.
+ * @param selection The patch selection.
+ * @return The cached plan, or an empty std::optional on a miss or a damaged entry.
+ */
+[[nodiscard]] std::optional<PatchPlan> loadCachedPlan(const Digest &imageDigest, const Digest &catalog,
+                                                      const PatchSelection selection) {
+    std::ifstream file(planCachePath(imageDigest, catalog, selection), std::ios::binary);
+    PlanFileHeader header;
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, "W3PLAN02", sizeof(header.magic)) != 0 || header.image != imageDigest ||
+        header.catalog != catalog || header.selection != selection)
+        return std::nullopt;
+
+    std::vector<PlanFileWrite> entries(header.writeCount);
+    std::vector<std::uint8_t> bytes(header.byteCount);
+    file.read(reinterpret_cast<char *>(entries.data()),
+              static_cast<std::streamsize>(entries.size() * sizeof(PlanFileWrite)));
+    file.read(reinterpret_cast<char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    if (!file)
+        return std::nullopt;
+
+    PatchPlan plan{imageDigest, catalog, selection, {}};
+    for (const auto &entry: entries) {
+        if (entry.dataOffset > bytes.size() || bytes.size() - entry.dataOffset < entry.length)
+            return std::nullopt;
+        const auto begin = bytes.begin() + entry.dataOffset;
+        plan.writes.push_back({entry.offset, {begin, begin + entry.length}, entry.wave});
+    }
+    return plan;
+}
+
+/**
+ * Stores a compiled plan in the on-disk cache. Failures only cost a later recompilation.
+ *
+ * @param plan The plan to store.
+ */
+void storeCachedPlan(const PatchPlan &plan) {
+    PlanFileHeader header;
+    header.image = plan.image;
+    header.catalog = plan.catalog;
+    header.selection = plan.selection;
+    std::vector<PlanFileWrite> entries;
+    std::vector<std::uint8_t> bytes;
+    for (const auto &[offset, data, wave]: plan.writes) {
+        entries.push_back({offset, static_cast<std::uint32_t>(data.size()), static_cast<std::uint32_t>(bytes.size()), wave});
+        bytes.insert(bytes.end(), data.begin(), data.end());
+    }
+    header.writeCount = static_cast<std::uint32_t>(entries.size());
+    header.byteCount = static_cast<std::uint32_t>(bytes.size());
+
+    const fs::path path = planCachePath(plan.image, plan.catalog, plan.selection);
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    const fs::path tempPath = path.string() + ".tmp" + std::to_string(std::hash<std::thread::id>{}(
+                                                          std::this_thread::get_id()));
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(entries.data()),
+                   static_cast<std::streamsize>(entries.size() * sizeof(PlanFileWrite)));
+        file.write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+        if (!file) {
+            fs::remove(tempPath, ec);
+            return;
+        }
+    }
+    fs::rename(tempPath, path, ec);
+}
+
+/**
+ * Returns the plan for applying a selection to an image, from the cache if possible.
+ *
+ * @param filepath The image to patch.
+ * @param imageDigest The digest of the image.
+ * @param table The patch table.
+ * @param selection The patches to apply.
+ * @return The plan, or an empty std::optional if it cannot be compiled.
+ */
+[[nodiscard]] std::optional<PatchPlan> resolvePlan(const std::string &filepath, const Digest &imageDigest,
+                                                   const PatchTable &table, const PatchSelection selection) {
+    const Digest catalog = catalogVersion(table);
+    if (auto cached = loadCachedPlan(imageDigest, catalog, selection))
+        return cached;
+    auto plan = compilePlan(filepath, imageDigest, table, selection);
+    if (plan)
+        storeCachedPlan(*plan);
+    return plan;
+}
+
+[[nodiscard]] bool syncFile(const fs::path &path);
+
+/**
+ * Records the pre-patch digest of an executable next to its backup and flushes it.
+ *
+ * @param backupPath The backup; the record is written to `<backupPath>.digest`.
+ * @param digest The digest of the executable before patching.
+ * @param flush Whether to flush the record; a group commit leaves it to its filesystem flush.
+ * @return true if the record was written (and flushed, if asked), false otherwise.
+ */
+[[nodiscard]] bool recordBackupDigest(const std::string &backupPath, const Digest &digest, const bool flush = true) {
+    const std::string recordPath = backupPath + ".digest";
+    {
+        std::ofstream record(recordPath, std::ios::trunc);
+        record << toHex(digest) << "\n";
+        record.close();
+        if (!record) {
+            std::cerr << "Failed to record the digest of " << backupPath << ".\n";
+            return false;
+        }
+    }
+    return !flush || syncFile(recordPath);
+}
+
+/**
+ * Parses a digest written by toHex().
+ *
+ * @param hex 64 hex digits.
+ * @return The digest, or an empty std::optional if the text is not a digest.
+ */
+[[nodiscard]] std::optional<Digest> parseDigest(const std::string_view hex) {
+    if (hex.size() != 2 * sizeof(Digest))
+        return std::nullopt;
+    Digest digest{};
+    for (std::size_t i = 0; i < digest.size(); ++i) {
+        const auto byte = parseHex(hex.substr(2 * i, 2));
+        if (!byte)
+            return std::nullopt;
+        digest[i] = static_cast<std::uint8_t>(*byte);
+    }
+    return digest;
+}
+
+/**
+ * Reads the pre-patch digest recorded by recordBackupDigest().
+ *
+ * @param backupPath The backup.
+ * @return The recorded digest, or an empty std::optional if none was recorded.
+ */
+[[nodiscard]] std::optional<Digest> readBackupDigest(const std::string &backupPath) {
+    std::ifstream record(backupPath + ".digest");
+    std::string hex;
+    if (!(record >> hex))
+        return std::nullopt;
+    return parseDigest(hex);
+}
+
+/**
+ * @brief How patchExecutable produces the patched executable.
+ */
+enum class PatchEngine {
+    /** One streaming pass that hashes the original, writes the backup and a patched copy, then renames it over the original. */
+    Fused,
+    /** Copy the original to the backup, then write the patches into the original in place. */
+    InPlace,
+};
+
+/**
+ * @brief The size of the blocks the fused engine streams the image in.
+ *
+ * A multiple of `kHashChunkSize`, so every block holds whole leaves of the tree hash.
+ */
+constexpr std::size_t kStreamBlockSize = 16 * kHashChunkSize;
+
+/**
+ * @brief A page-aligned I/O buffer of `kStreamBlockSize` bytes.
+ */
+struct alignas(4096) StreamBlock {
+    std::array<std::uint8_t, kStreamBlockSize> bytes;
+};
+
+/**
+ * Flushes a file's data to stable storage.
+ *
+ * @param path The file to flush.
+ * @return true if the file was flushed (or the platform offers no way to do so), false on errors.
+ */
+[[nodiscard]] bool syncFile(const fs::path &path) {
+#if defined(__linux__)
+    PATCHER_PROBE(fsync__start, path.c_str());
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    const bool synced = fd >= 0 && fsync(fd) == 0;
+    PATCHER_PROBE(fsync__done, path.c_str(), synced ? 0 : errno);
+    if (!synced)
+        std::cerr << "Failed to flush " << path.string() << ": " << std::strerror(errno) << "\n";
+    if (fd >= 0)
+        close(fd);
+    return synced;
+#else
+    (void) path;
+    return true;
+#endif
+}
+
+/**
+ * Flushes the directory entry of a path, so a rename or creation of it survives a crash.
+ *
+ * @param path The file whose parent directory is flushed.
+ * @return true if the directory was flushed, false otherwise.
+ */
+[[nodiscard]] bool syncDirectory(const fs::path &path) {
+#if defined(__linux__)
+    const fs::path directory = path.has_parent_path() ? path.parent_path() : fs::path(".");
+    PATCHER_PROBE(fsync__start, directory.c_str());
+    const int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    const bool synced = fd >= 0 && fsync(fd) == 0;
+    PATCHER_PROBE(fsync__done, directory.c_str(), synced ? 0 : errno);
+    if (!synced)
+        std::cerr << "Failed to flush " << directory.string() << ": " << std::strerror(errno) << "\n";
+    if (fd >= 0)
+        close(fd);
+    return synced;
+#else
+    (void) path;
+    return true;
+#endif
+}
+
+/**
+ * Creates an empty temporary file next to a path, under a name no concurrent run can pick.
+ *
+ * @param path The file the temporary file stands in for.
+ * @param tag A word naming what the file is for; it becomes part of the name.
+ * @return The temporary file's path, or an empty std::optional if it could not be created.
+ */
+[[nodiscard]] std::optional<std::string> createTempSibling(const std::string &path, const std::string_view tag) {
+#if defined(__linux__)
+    std::string name = path + "." + std::string(tag) + ".XXXXXX";
+    const int fd = mkostemp(name.data(), O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Failed to create a temporary file next to " << path << ": " << std::strerror(errno) << "\n";
+        return std::nullopt;
+    }
+    close(fd);
+    return name;
+#else
+    return path + "." + std::string(tag) + ".tmp";
+#endif
+}
+
+/**
+ * Gives a file the owner, group, mode and extended attributes of another, so a file
+ * renamed over the other keeps them. ACLs and security labels are extended attributes
+ * and are copied with them.
+ *
+ * @param from The file whose metadata is copied.
+ * @param to The file that receives it.
+ * @return true if everything was copied, false otherwise.
+ */
+[[nodiscard]] bool copyFileMetadata(const std::string &from, const std::string &to) {
+#if defined(__linux__)
+    const int source = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    const int target = open(to.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info {};
+    // The mode goes after the owner, since changing the owner clears the set-id bits.
+    bool copied = source >= 0 && target >= 0 && fstat(source, &info) == 0 &&
+                  fchown(target, info.st_uid, info.st_gid) == 0 && fchmod(target, info.st_mode & 07777) == 0;
+    if (copied) {
+        const ssize_t listed = flistxattr(source, nullptr, 0);
+        std::string names(static_cast<std::size_t>(std::max<ssize_t>(listed, 0)), '\0');
+        const ssize_t got = names.empty() ? 0 : flistxattr(source, names.data(), names.size());
+        copied = got >= 0;
+        for (const char *name = names.data(); copied && name < names.data() + got; name += std::strlen(name) + 1) {
+            const ssize_t length = fgetxattr(source, name, nullptr, 0);
+            std::string value(static_cast<std::size_t>(std::max<ssize_t>(length, 0)), '\0');
+            copied = length >= 0 && fgetxattr(source, name, value.data(), value.size()) == length &&
+                     fsetxattr(target, name, value.data(), value.size(), 0) == 0;
+        }
+    }
+    if (!copied)
+        std::cerr << "Failed to copy the owner, mode and attributes of " << from << " to " << to << ": "
+                << std::strerror(errno) << "\n";
+    if (source >= 0)
+        close(source);
+    if (target >= 0)
+        close(target);
+    return copied;
+#else
+    std::error_code ec;
+    fs::permissions(to, fs::status(from, ec).permissions(), ec);
+    return !ec;
+#endif
+}
+
+/**
+ * Identifies the filesystem device a path lives on.
+ *
+ * @param path The path; if it does not exist its parent directory is used.
+ * @return The device number, or 0 where the platform does not expose one.
+ */
+[[nodiscard]] std::uint64_t deviceOf(const fs::path &path) {
+#if defined(__linux__)
+    struct stat info {};
+    const fs::path parent = path.parent_path().empty() ? fs::path(".") : path.parent_path();
+    if (stat(path.c_str(), &info) == 0 || stat(parent.c_str(), &info) == 0)
+        return info.st_dev;
+#else
+    (void) path;
+#endif
+    return 0;
+}
+
+/**
+ * Flushes whole filesystems to stable storage with one syncfs each.
+ *
+ * @param paths Files on the filesystems to flush; each filesystem is flushed once however
+ *              many of its files are listed.
+ * @return true if every filesystem was flushed (or the platform offers no way to do so), false on errors.
+ */
+[[nodiscard]] bool syncFilesystems(const std::vector<fs::path> &paths) {
+#if defined(__linux__)
+    std::map<std::uint64_t, fs::path> filesystems;
+    for (const auto &path: paths)
+        filesystems.try_emplace(deviceOf(path), path);
+    bool synced = true;
+    for (const auto &path: filesystems | std::views::values) {
+        PATCHER_PROBE(syncfs__start, path.c_str());
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        const bool flushed = fd >= 0 && syncfs(fd) == 0;
+        PATCHER_PROBE(syncfs__done, path.c_str(), flushed ? 0 : errno);
+        if (!flushed)
+            std::cerr << "Failed to flush the filesystem of " << path.string() << ": " << std::strerror(errno) << "\n";
+        if (fd >= 0)
+            close(fd);
+        synced = synced && flushed;
+    }
+    return synced;
+#else
+    (void) paths;
+    return true;
+#endif
+}
+
+/**
+ * @brief How the files of a batch are made durable.
+ */
+enum class Durability {
+    /** Every file is flushed with its own fsync before it replaces the original. */
+    PerFile,
+    /** Files are staged unflushed and committed together by a GroupCommit. */
+    Group,
+};
+
+/**
+ * Parses a durability mode as given on the command line.
+ *
+ * @param name `file` or `group`.
+ * @return The mode, or an empty std::optional if the name is unknown.
+ */
+[[nodiscard]] std::optional<Durability> parseDurability(const std::string_view name) {
+    if (name == "file")
+        return Durability::PerFile;
+    if (name == "group")
+        return Durability::Group;
+    std::cerr << "Unknown durability mode: " << name << " (expected file or group)\n";
+    return std::nullopt;
+}
+
+/**
+ * @brief Makes the jobs of a batch durable with one flush per filesystem instead of one per file.
+ *
+ * Jobs stage their output in temporary files without flushing them and hand over a commit
+ * step that moves the files into place. flush() then issues one syncfs per filesystem,
+ * runs the commit steps, and issues a second syncfs to persist the renames and the files
+ * the commit steps wrote, such as backup digest records, so a crash
+ * still leaves either the original or the complete patched file at every path: nothing
+ * is renamed over an original before its replacement is on disk. Files are reported
+ * durable only after the second flush, and if a journal is given each one is appended to
+ * it as `durable <path> <digest of the original>`, matching its backup.
+ */
+class GroupCommit {
+public:
+    /** @param journal The journal to append durable files to, if any. */
+    explicit GroupCommit(std::optional<fs::path> journal) : journal(std::move(journal)) {}
+
+    /**
+     * Registers a staged job. Safe to call from several jobs at once.
+     *
+     * @param path The file the job produces.
+     * @param digest The digest of the original, recorded for it in the journal.
+     * @param files The unflushed files the job wrote.
+     * @param commit Moves the files into place once they are flushed; returns whether it succeeded.
+     * @param written The files the commit step writes without flushing them.
+     */
+    void stage(const std::string &path, const Digest &digest, std::vector<fs::path> files,
+               std::function<bool()> commit, std::vector<fs::path> written) {
+        std::lock_guard lock(mutex);
+        staged.push_back({path, digest, std::move(files), std::move(commit), std::move(written)});
+    }
+
+    /**
+     * Flushes and commits every staged job.
+     *
+     * @return The paths whose jobs could not be made durable; the originals are left in place.
+     */
+    [[nodiscard]] std::vector<std::string> flush() {
+        std::lock_guard lock(mutex);
+        std::vector<fs::path> files;
+        for (const auto &job: staged)
+            files.insert(files.end(), job.files.begin(), job.files.end());
+
+        std::vector<std::string> failed;
+        std::vector<const Staged *> committed;
+        if (!syncFilesystems(files)) {
+            for (const auto &job: staged) {
+                for (const auto &file: job.files) {
+                    std::error_code ec;
+                    fs::remove(file, ec);
+                }
+                // The job's commit step never runs, so its backup is reported failed here.
+                PATCHER_PROBE(backup__done, job.path.c_str(), std::uint64_t{0}, -1);
+                failed.push_back(job.path);
+            }
+            staged.clear();
+            return failed;
+        }
+        for (const auto &job: staged) {
+            if (job.commit())
+                committed.push_back(&job);
+            else
+                failed.push_back(job.path);
+        }
+
+        std::vector<fs::path> paths;
+        for (const Staged *job: committed) {
+            paths.emplace_back(job->path);
+            paths.insert(paths.end(), job->written.begin(), job->written.end());
+        }
+        std::string entries;
+        if (syncFilesystems(paths)) {
+            for (const Staged *job: committed)
+                entries += "durable " + job->path + " " + toHex(job->digest) + "\n";
+        } else {
+            for (const Staged *job: committed)
+                failed.push_back(job->path);
+        }
+        if (journal && !entries.empty() && !appendJournal(entries))
+            std::cerr << "Failed to record durable files in " << journal->string() << "\n";
+        staged.clear();
+        return failed;
+    }
+
+private:
+    struct Staged {
+        std::string path;
+        Digest digest;
+        std::vector<fs::path> files;
+        std::function<bool()> commit;
+        std::vector<fs::path> written;
+    };
+
+    /** Appends entries to the journal and flushes it. */
+    [[nodiscard]] bool appendJournal(const std::string &entries) const {
+        {
+            std::ofstream stream(*journal, std::ios::binary | std::ios::app);
+            stream << entries;
+            if (!stream.flush())
+                return false;
+        }
+        return syncFile(*journal);
+    }
+
+    std::optional<fs::path> journal;
+    std::mutex mutex;
+    std::vector<Staged> staged;
+};
+
+/**
+ * @brief The phases a patch job passes through, in the order they usually run.
+ */
+enum class Phase {
+    Backup,
+    Validate,
+    Plan,
+    Write,
+    Sync,
+    Commit,
+    Count,
+};
+
+/** The names of the phases, indexed by `Phase`, as they appear in run reports. */
+constexpr std::array<std::string_view, static_cast<std::size_t>(Phase::Count)> kPhaseNames = {
+    "backup", "validate", "plan", "write", "sync", "commit",
+};
+
+/**
+ * @brief The wall-clock seconds a job spent in each phase.
+ */
+struct PhaseTimings {
+    std::array<double, static_cast<std::size_t>(Phase::Count)> seconds{};
+};
+
+/**
+ * @brief Charges the time between phase transitions to a PhaseTimings record.
+ *
+ * `enter` closes the current phase and starts the next one; the destructor closes the last.
+ * A null record makes every call a no-op, so the engines can be timed without callers
+ * having to ask for it.
+ */
+class PhaseClock {
+public:
+    explicit PhaseClock(PhaseTimings *timings) : timings(timings), start(std::chrono::steady_clock::now()) {}
+    PhaseClock(const PhaseClock &) = delete;
+    PhaseClock &operator=(const PhaseClock &) = delete;
+    ~PhaseClock() { enter(Phase::Count); }
+
+    /** Starts `phase`, charging the time since the last transition to the previous phase. */
+    void enter(const Phase phase) {
+        if (!timings)
+            return;
+        const auto now = std::chrono::steady_clock::now();
+        if (current != Phase::Count)
+            timings->seconds[static_cast<std::size_t>(current)] += std::chrono::duration<double>(now - start).count();
+        current = phase;
+        start = now;
+    }
+
+private:
+    PhaseTimings *timings;
+    Phase current = Phase::Count;
+    std::chrono::steady_clock::time_point start;
+};
+
+/**
+ * @brief Patches the executable in place after copying it to the backup.
+ *
+ * The executable is validated and planned first, then backed up; patching is aborted if
+ * any step fails. Writes are issued wave by wave with an fsync after each wave (see patchWaves),
+ * so if the process dies midway the file holds a subset of complete fixes and never a
+ * jump into code that has not been written. The writes come from the compiled plan for the image's digest, which is reused
+ * from the plan cache when the same build was patched with the same catalog and
+ * selection before. The file is written through its own stream, so several executables
+ * can be patched concurrently.
+ *
+ * @param wowPath The path to the executable.
+ * @param table The patch table.
+ * @param selection The patches to apply.
+ * @param timings Receives the time spent in each phase, if not null.
+ * @param backupPath Where the backup is kept.
+ * @return true if every selected patch was written, false otherwise.
+ */
+[[nodiscard]] bool patchInPlace(const std::string &wowPath, const PatchTable &table,
+                                const PatchSelection selection, PhaseTimings *timings, const std::string &backupPath) {
+    PhaseClock clock(timings);
+    clock.enter(Phase::Validate);
+    if (!validateExecutable(wowPath)) {
+        std::cerr << "Executable validation failed. Aborting.\n";
+        return false;
+    }
+
+    // Planning comes first so a selection that cannot be applied never replaces the backup.
+    clock.enter(Phase::Plan);
+    PATCHER_PROBE(plan__start, wowPath.c_str());
+    const auto leaves = loadImageLeaves(wowPath);
+    const auto plan = leaves ? resolvePlan(wowPath, combineLeaves(*leaves), table, selection) : std::nullopt;
+    PATCHER_PROBE(plan__done, wowPath.c_str(), plan ? plan->writes.size() : std::size_t{0}, plan ? 0 : -1);
+    if (!plan) {
+        std::cerr << "Failed to plan patches for " << wowPath << ". Aborting.\n";
+        return false;
+    }
+
+    clock.enter(Phase::Backup);
+    if (!createBackup(wowPath, backupPath)) {
+        std::cerr << "Backup creation failed. Aborting.\n";
+        return false;
+    }
+    if (!recordBackupDigest(backupPath, plan->image))
+        return false;
+    clock.enter(Phase::Sync);
+    if (!syncFile(backupPath))
+        return false;
+
+    clock.enter(Phase::Write);
+    std::fstream stream(wowPath, std::ios::in | std::ios::out | std::ios::binary);
+    if (!stream) {
+        std::cerr << "Failed to open executable for patching.\n";
+        return false;
+    }
+
+    // Each wave is flushed before the next one starts, so a crash leaves a valid image.
+    PATCHER_PROBE(write__start, wowPath.c_str());
+    std::uint64_t written = 0;
+    bool synced = true;
+    for (std::size_t i = 0; i < plan->writes.size(); ++i) {
+        written += plan->writes[i].data.size();
+        writeBytesAt(plan->writes[i].offset, plan->writes[i].data, stream);
+        if (i + 1 < plan->writes.size() && plan->writes[i + 1].wave == plan->writes[i].wave)
+            continue;
+        stream.flush();
+        clock.enter(Phase::Sync);
+        synced = stream && syncFile(wowPath);
+        if (!synced)
+            break;
+        clock.enter(Phase::Write);
+    }
+
+    stream.close();
+    PATCHER_PROBE(write__done, wowPath.c_str(), written, stream && synced ? 0 : -1);
+    if (!stream || !synced) {
+        std::cerr << "Failed to write patches to " << wowPath << ".\n";
+        return false;
+    }
+    std::cout << "Patching completed successfully.\n";
+    return true;
+}
+
+struct Injection;
+[[nodiscard]] bool injectImage(const std::string &imagePath, const std::vector<Injection> &injections);
+
+/**
+ * @brief Patches the executable with a single streaming pass over the original.
+ *
+ * Every block of the original is read once into an aligned buffer, hashed into the
+ * image's tree digest, written unchanged to a temporary backup, patched with the plan
+ * writes that fall inside it and written to a temporary output. Both files are flushed,
+ * the backup is moved into place next to a record of the pre-patch digest, and the
+ * output is renamed over the original. A crash at any point leaves either the original
+ * or the fully patched file at `wowPath`. Injections are added to the output before it
+ * is flushed (see injectImage), so they are committed with the patches. With a group
+ * commit the two files are neither flushed nor moved into place here; the group does
+ * both once the whole batch is staged.
+ *
+ * @param wowPath The path to the executable.
+ * @param table The patch table.
+ * @param selection The patches to apply.
+ * @param timings Receives the time spent in each phase, if not null.
+ * @param group The group commit to stage the files with, or null to commit them now.
+ * @param injections The injections to grow the patched image with, or null for none.
+ * @return true if the patched executable replaced the original (or was staged), false otherwise.
+ */
+[[nodiscard]] bool patchFused(const std::string &wowPath, const PatchTable &table, const PatchSelection selection,
+                              PhaseTimings *timings = nullptr, GroupCommit *group = nullptr,
+                              const std::vector<Injection> *injections = nullptr) {
+    PhaseClock clock(timings);
+    clock.enter(Phase::Validate);
+    if (!validateExecutable(wowPath)) {
+        std::cerr << "Executable validation failed. Aborting.\n";
+        return false;
+    }
+
+    clock.enter(Phase::Plan);
+    PATCHER_PROBE(plan__start, wowPath.c_str());
+    const auto cachedLeaves = lookupImageLeaves(wowPath);
+    auto plan = cachedLeaves
+                    ? resolvePlan(wowPath, combineLeaves(*cachedLeaves), table, selection)
+                    : compilePlan(wowPath, Digest{}, table, selection);
+    PATCHER_PROBE(plan__done, wowPath.c_str(), plan ? plan->writes.size() : std::size_t{0}, plan ? 0 : -1);
+    if (!plan) {
+        std::cerr << "Failed to plan patches for " << wowPath << ". Aborting.\n";
+        return false;
+    }
+
+    const std::string backupPath = wowPath + ".backup";
+    const auto backupName = createTempSibling(backupPath, "tmp");
+    const auto outputName = createTempSibling(wowPath, "patching");
+    const std::string backupTemp = backupName.value_or("");
+    const std::string outputTemp = outputName.value_or("");
+    const auto cleanup = [&] {
+        std::error_code ec;
+        if (!backupTemp.empty())
+            fs::remove(backupTemp, ec);
+        if (!outputTemp.empty())
+            fs::remove(outputTemp, ec);
+    };
+    if (!backupName || !outputName) {
+        cleanup();
+        return false;
+    }
+    std::ifstream input(wowPath, std::ios::binary);
+    std::ofstream backup(backupTemp, std::ios::binary | std::ios::trunc);
+    std::ofstream output(outputTemp, std::ios::binary | std::ios::trunc);
+    if (!input || !backup || !output) {
+        std::cerr << "Failed to open " << wowPath << " or its temporary files for patching.\n";
+        cleanup();
+        return false;
+    }
+
+    clock.enter(Phase::Write);
+    PATCHER_PROBE(backup__start, wowPath.c_str());
+    PATCHER_PROBE(write__start, wowPath.c_str());
+    ImageLeaves leaves;
+    // Every failure from here on reports the backup as failed, so each start has a done.
+    const auto abandon = [&] {
+        PATCHER_PROBE(backup__done, wowPath.c_str(), leaves.size, -1);
+        cleanup();
+        return false;
+    };
+    const auto block = std::make_unique<StreamBlock>();
+    while (input) {
+        input.read(reinterpret_cast<char *>(block->bytes.data()), static_cast<std::streamsize>(kStreamBlockSize));
+        const auto got = static_cast<std::size_t>(input.gcount());
+        if (got == 0)
+            break;
+        for (std::size_t chunk = 0; chunk < got; chunk += kHashChunkSize)
+            leaves.leaves.push_back(hashLeaf(block->bytes.data() + chunk, std::min(kHashChunkSize, got - chunk)));
+        backup.write(reinterpret_cast<const char *>(block->bytes.data()), static_cast<std::streamsize>(got));
+
+        const std::uint64_t blockBegin = leaves.size;
+        for (const auto &[offset, data, wave]: plan->writes) {
+            const std::uint64_t begin = std::max<std::uint64_t>(offset, blockBegin);
+            const std::uint64_t end = std::min<std::uint64_t>(offset + data.size(), blockBegin + got);
+            for (std::uint64_t at = begin; at < end; ++at)
+                block->bytes[at - blockBegin] = data[at - offset];
+        }
+        output.write(reinterpret_cast<const char *>(block->bytes.data()), static_cast<std::streamsize>(got));
+        leaves.size += got;
+    }
+    const bool readFailed = input.bad();
+    input.close();
+    backup.close();
+    output.close();
+    PATCHER_PROBE(write__done, wowPath.c_str(), leaves.size, readFailed || !output ? -1 : 0);
+    if (injections && !readFailed && output && !injectImage(outputTemp, *injections)) {
+        return abandon();
+    }
+    clock.enter(Phase::Sync);
+    if (readFailed || !backup || !output || (!group && (!syncFile(backupTemp) || !syncFile(outputTemp)))) {
+        std::cerr << "Failed to stream " << wowPath << " into its backup and patched copy.\n";
+        return abandon();
+    }
+
+    const Digest digest = combineLeaves(leaves);
+    PATCHER_PROBE(verify__start, wowPath.c_str());
+    const bool unchanged = !cachedLeaves || combineLeaves(*cachedLeaves) == digest;
+    PATCHER_PROBE(verify__done, wowPath.c_str(), unchanged ? 0 : -1);
+    if (!unchanged) {
+        std::cerr << wowPath << " changed while it was being patched. Aborting.\n";
+        return abandon();
+    }
+    if (!cachedLeaves) {
+        plan->image = digest;
+        storeCachedPlan(*plan);
+    }
+    if (!copyFileMetadata(wowPath, backupTemp) || !copyFileMetadata(wowPath, outputTemp)) {
+        return abandon();
+    }
+
+    const auto commit = [=] {
+        std::error_code ec;
+        fs::rename(backupTemp, backupPath, ec);
+        if (!ec && !recordBackupDigest(backupPath, digest, !group))
+            ec = std::make_error_code(std::errc::io_error);
+        PATCHER_PROBE(backup__done, wowPath.c_str(), leaves.size, ec.value());
+        if (!ec)
+            fs::rename(outputTemp, wowPath, ec);
+        // A group flushes the renames with its second syncfs.
+        if (!ec && !group && !syncDirectory(wowPath))
+            ec = std::make_error_code(std::errc::io_error);
+        if (ec) {
+            std::cerr << "Failed to replace " << wowPath << ": " << ec.message() << "\n";
+            // Not cleanup(): this may run after patchFused has returned.
+            fs::remove(backupTemp, ec);
+            fs::remove(outputTemp, ec);
+            return false;
+        }
+        storeImageLeaves(backupPath, leaves);
+        std::cout << "Backup created at: " << backupPath << "\n";
+        std::cout << "Patching completed successfully.\n";
+        return true;
+    };
+    if (group) {
+        group->stage(wowPath, digest, {backupTemp, outputTemp}, commit, {backupPath + ".digest"});
+        return true;
+    }
+    clock.enter(Phase::Commit);
+    return commit();
+}
+
+/**
+ * Parses the name of a patch engine as given on the command line.
+ *
+ * @param name `fused` or `inplace`.
+ * @return The engine, or an empty std::optional if the name is unknown.
+ */
+[[nodiscard]] std::optional<PatchEngine> parsePatchEngine(const std::string_view name) {
+    if (name == "fused")
+        return PatchEngine::Fused;
+    if (name == "inplace")
+        return PatchEngine::InPlace;
+    std::cerr << "Unknown patch engine: " << name << " (expected fused or inplace)\n";
+    return std::nullopt;
+}
+
+/**
+ * @brief Patches the executable on disk with the selected entries of a patch table.
+ *
+ * @param wowPath The path to the executable.
+ * @param table The patch table.
+ * @param selection The patches to apply.
+ * @param engine How the patched executable is produced.
+ * @param timings Receives the time spent in each phase, if not null.
+ * @param group The group commit to stage the result with; only the fused engine supports one.
+ * @param injections The injections to add; only the fused engine supports them.
+ * @param backupPath Where the in-place engine keeps the backup instead of `<wowPath>.backup`;
+ *        the fused engine always renames its backup into place next to the executable.
+ * @return true if every selected patch was written, false otherwise.
+ */
+[[nodiscard]] bool patchExecutable(const std::string &wowPath, const PatchTable &table,
+                                   const PatchSelection selection, const PatchEngine engine = PatchEngine::Fused,
+                                   PhaseTimings *timings = nullptr, GroupCommit *group = nullptr,
+                                   const std::vector<Injection> *injections = nullptr,
+                                   const std::optional<std::string> &backupPath = std::nullopt) {
+    if (!fs::exists(wowPath)) {
+        std::cerr << "Executable not found at: " << wowPath << "\n";
+        return false;
+    }
+    PATCHER_PROBE(file__start, wowPath.c_str());
+    const bool patched = engine == PatchEngine::Fused
+                             ? patchFused(wowPath, table, selection, timings, group, injections)
+                             : patchInPlace(wowPath, table, selection, timings,
+                                            backupPath.value_or(wowPath + ".backup"));
+    PATCHER_PROBE(file__done, wowPath.c_str(), patched ? 0 : -1);
+    return patched;
+}
+
+/** The worker count that selects the adaptive concurrency tuner (see runBatch). */
+constexpr unsigned kAdaptiveJobs = 0;
+
+/**
+ * Parses a worker count given on the command line.
+ *
+ * @param text The count; must be a positive integer, or `auto` for `kAdaptiveJobs`.
+ * @return The count, or an empty std::optional if it is invalid.
+ */
+[[nodiscard]] std::optional<unsigned> parseJobCount(const std::string_view text) {
+    if (text == "auto")
+        return kAdaptiveJobs;
+    unsigned count = 0;
+    const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), count);
+    if (ec != std::errc{} || ptr != text.data() + text.size() || count == 0) {
+        std::cerr << "Invalid worker count: " << text << "\n";
+        return std::nullopt;
+    }
+    return count;
+}
+
+/**
+ * @brief The outcome of one job in a batch run.
+ *
+ * `size` and `digest` describe the unpatched image, where the job knows them.
+ */
+struct JobResult {
+    std::string path;
+    bool succeeded = false;
+    double seconds = 0;
+    PhaseTimings phases;
+    std::uint64_t size = 0;
+    Digest digest{};
+};
+
+/**
+ * @brief The outcome of a batch run: one result per path, in input order, and the
+ * decisions the concurrency tuner took along the way.
+ */
+struct BatchReport {
+    std::vector<JobResult> jobs;
+    std::vector<std::string> decisions;
+
+    /** The number of jobs that failed. */
+    [[nodiscard]] std::size_t failures() const {
+        return static_cast<std::size_t>(std::ranges::count(jobs, false, &JobResult::succeeded));
+    }
+};
+
+/**
+ * @brief Hands out batch jobs under an AIMD concurrency limit kept per device.
+ *
+ * Paths are queued by the device they live on, and each device starts with two jobs in
+ * flight. Whenever a device completes a window of jobs (at least four, or two per slot,
+ * spanning at least a quarter second) the tuner compares the window's throughput in
+ * files per second and its mean job latency with the previous window: if throughput
+ * rose by more than 5% the limit grows by one, if it fell by more than 10% or latency
+ * rose by half while throughput stayed flat the limit is halved, and otherwise it is
+ * held. Every decision is recorded with the window's per-phase latencies, so a run
+ * report shows why the batch ran as wide as it did.
+ */
+class AdaptiveScheduler {
+public:
+    AdaptiveScheduler(const std::vector<std::string> &paths, const unsigned maxLimit)
+        : maxLimit(maxLimit), started(std::chrono::steady_clock::now()) {
+        for (std::size_t i = 0; i < paths.size(); ++i)
+            devices[deviceOf(paths[i])].pending.push_back(i);
+        for (auto &[id, device]: devices)
+            device.windowStart = started;
+    }
+
+    /** The number of devices the paths are spread over. */
+    [[nodiscard]] std::size_t deviceCount() const { return devices.size(); }
+
+    /**
+     * Waits for a device with queued work and a free slot, and takes its next path.
+     *
+     * @return The index of the path and its device, or an empty std::optional once the queues are empty.
+     */
+    [[nodiscard]] std::optional<std::pair<std::size_t, std::uint64_t>> acquire() {
+        std::unique_lock lock(mutex);
+        while (true) {
+            bool queued = false;
+            // Rotate through the devices so that one busy device cannot starve the others.
+            auto it = devices.upper_bound(lastDevice);
+            for (std::size_t n = 0; n < devices.size(); ++n, ++it) {
+                if (it == devices.end())
+                    it = devices.begin();
+                auto &[id, device] = *it;
+                if (device.pending.empty())
+                    continue;
+                queued = true;
+                if (device.active >= device.limit)
+                    continue;
+                const std::size_t index = device.pending.front();
+                device.pending.pop_front();
+                ++device.active;
+                lastDevice = id;
+                return std::pair{index, id};
+            }
+            if (!queued)
+                return std::nullopt;
+            changed.wait(lock);
+        }
+    }
+
+    /**
+     * Returns a slot taken by acquire and feeds the job's latency to the device's tuner.
+     *
+     * @param deviceId The device the job ran on.
+     * @param result The job's outcome.
+     */
+    void release(const std::uint64_t deviceId, const JobResult &result) {
+        {
+            std::lock_guard lock(mutex);
+            auto &device = devices[deviceId];
+            --device.active;
+            ++device.windowJobs;
+            device.windowSeconds += result.seconds;
+            for (std::size_t p = 0; p < device.windowPhases.seconds.size(); ++p)
+                device.windowPhases.seconds[p] += result.phases.seconds[p];
+            tune(deviceId, device);
+        }
+        changed.notify_all();
+    }
+
+    /** Takes the decisions recorded so far. */
+    [[nodiscard]] std::vector<std::string> takeDecisions() {
+        std::lock_guard lock(mutex);
+        return std::move(decisions);
+    }
+
+private:
+    struct Device {
+        std::deque<std::size_t> pending;
+        unsigned limit = 2;
+        unsigned active = 0;
+        std::chrono::steady_clock::time_point windowStart;
+        std::size_t windowJobs = 0;
+        double windowSeconds = 0;
+        PhaseTimings windowPhases;
+        double lastRate = 0;
+        double lastLatency = 0;
+    };
+
+    void tune(const std::uint64_t deviceId, Device &device) {
+        const auto now = std::chrono::steady_clock::now();
+        const double elapsed = std::chrono::duration<double>(now - device.windowStart).count();
+        if (device.windowJobs < std::max<std::size_t>(4, 2 * device.limit) || elapsed < 0.25)
+            return;
+
+        const double rate = static_cast<double>(device.windowJobs) / elapsed;
+        const double latency = device.windowSeconds / static_cast<double>(device.windowJobs);
+        const unsigned previous = device.limit;
+        const char *verdict = "hold";
+        if (device.lastRate == 0 || rate > device.lastRate * 1.05) {
+            if (device.limit < maxLimit) {
+                ++device.limit;
+                verdict = "increase";
+            }
+        } else if (rate < device.lastRate * 0.90 || latency > device.lastLatency * 1.5) {
+            device.limit = std::max(1u, device.limit / 2);
+            verdict = "decrease";
+        }
+
+        std::ostringstream line;
+        line.setf(std::ios::fixed);
+        line.precision(3);
+        line << "+" << std::chrono::duration<double>(now - started).count() << "s device ";
+#if defined(__linux__)
+        line << major(deviceId) << ":" << minor(deviceId);
+#else
+        line << deviceId;
+#endif
+        line << ": " << rate << " files/s, mean " << latency << "s (";
+        for (std::size_t p = 0; p < kPhaseNames.size(); ++p)
+            line << (p ? " " : "") << kPhaseNames[p] << " "
+                    << device.windowPhases.seconds[p] / static_cast<double>(device.windowJobs);
+        line << "), limit " << previous << " -> " << device.limit << " (" << verdict << ")";
+        decisions.push_back(line.str());
+
+        device.lastRate = rate;
+        device.lastLatency = latency;
+        device.windowStart = now;
+        device.windowJobs = 0;
+        device.windowSeconds = 0;
+        device.windowPhases = {};
+    }
+
+    const unsigned maxLimit;
+    const std::chrono::steady_clock::time_point started;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<std::uint64_t, Device> devices;
+    std::uint64_t lastDevice = 0;
+    std::vector<std::string> decisions;
+};
+
+/**
+ * Runs a job for every path on a pool of worker threads.
+ *
+ * With a fixed worker count the paths are handed out in order to that many threads.
+ * With `kAdaptiveJobs` the width of the run is tuned per device while it runs (see
+ * AdaptiveScheduler), up to twice the number of cores (at least four) per device.
+ *
+ * @tparam Job A callable taking `(const std::string &path, JobResult &result)`, filling in
+ *             the phase timings, size and digest it knows, and returning true on success.
+ * @param paths The paths to process.
+ * @param jobs The number of worker threads, or `kAdaptiveJobs`.
+ * @param job The work for one path.
+ * @return The outcome of every job and the tuner's decisions.
+ */
+template<typename Job>
+[[nodiscard]] BatchReport runBatch(const std::vector<std::string> &paths, const unsigned jobs, Job &&job) {
+    BatchReport report;
+    report.jobs.resize(paths.size());
+    const auto run = [&](const std::size_t index) -> const JobResult & {
+        auto &result = report.jobs[index];
+        const auto start = std::chrono::steady_clock::now();
+        result.path = paths[index];
+        result.succeeded = job(paths[index], result);
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    };
+
+    if (jobs != kAdaptiveJobs) {
+        std::atomic<std::size_t> next = 0;
+        {
+            std::vector<std::jthread> workers;
+            for (unsigned i = 0; i < std::min<std::size_t>(jobs, paths.size()); ++i) {
+                workers.emplace_back([&] {
+                    for (std::size_t index; (index = next++) < paths.size();)
+                        run(index);
+                });
+            }
+        }
+        return report;
+    }
+
+    const unsigned maxLimit = std::max(4u, 2 * std::thread::hardware_concurrency());
+    AdaptiveScheduler scheduler(paths, maxLimit);
+    {
+        std::vector<std::jthread> workers;
+        const std::size_t width = std::min<std::size_t>(paths.size(), maxLimit * scheduler.deviceCount());
+        for (std::size_t i = 0; i < width; ++i) {
+            workers.emplace_back([&] {
+                while (const auto next = scheduler.acquire())
+                    scheduler.release(next->second, run(next->first));
+            });
+        }
+    }
+    report.decisions = scheduler.takeDecisions();
+    return report;
+}
+
+/**
+ * Appends a string to a JSON document as a quoted, escaped string literal.
+ *
+ * @param out The document.
+ * @param text The string.
+ */
+void appendJsonString(std::string &out, const std::string_view text) {
+    out += '"';
+    for (const char c: text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", static_cast<unsigned>(c));
+            out += escape;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+/**
+ * @brief Writes a batch run report as JSON.
+ *
+ * The report lists every path with its result, its total time, the time spent in each
+ * phase and the size and digest of the unpatched image, followed by the concurrency
+ * tuner's decisions.
+ *
+ * @param path The report file.
+ * @param report The batch outcome.
+ * @return true if the report was written, false otherwise.
+ */
+[[nodiscard]] bool writeJsonReport(const fs::path &path, const BatchReport &report) {
+    std::string out = "{\n  \"files\": [";
+    for (std::size_t i = 0; i < report.jobs.size(); ++i) {
+        const auto &[file, succeeded, seconds, phases, size, digest] = report.jobs[i];
+        out += i ? ",\n    {\"path\": " : "\n    {\"path\": ";
+        appendJsonString(out, file);
+        out += succeeded ? ", \"ok\": true" : ", \"ok\": false";
+        out += ", \"size\": " + std::to_string(size) + ", \"digest\": \"" + toHex(digest) + "\"";
+        out += ", \"seconds\": " + std::to_string(seconds) + ", \"phases\": {";
+        for (std::size_t p = 0; p < kPhaseNames.size(); ++p) {
+            out += p ? ", " : "";
+            appendJsonString(out, kPhaseNames[p]);
+            out += ": " + std::to_string(phases.seconds[p]);
+        }
+        out += "}}";
+    }
+    out += "\n  ],\n  \"tuner\": [";
+    for (std::size_t i = 0; i < report.decisions.size(); ++i) {
+        out += i ? ",\n    " : "\n    ";
+        appendJsonString(out, report.decisions[i]);
+    }
+    out += "\n  ]\n}\n";
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(out.data(), static_cast<std::streamsize>(out.size()));
+    if (!file) {
+        std::cerr << "Failed to write run report " << path.string() << "\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Header of a columnar run report.
+ *
+ * A columnar report is a flat little-endian file meant to be mapped directly: this
+ * header, then `recordCount` fixed-width ReportRecord entries in input order, then a heap
+ * of `heapSize` bytes at `heapOffset` holding the paths (referenced by the records) and
+ * the tuner's decisions as newline-separated text. It is written in one sequential pass,
+ * and reading a field of every record touches nothing but the record table, so reports
+ * for millions of paths are aggregated without parsing.
+ */
+struct ReportHeader {
+    char magic[8] = {'W', '3', 'R', 'P', 'T', '0', '0', '1'};
+    std::uint64_t recordCount = 0;
+    std::uint64_t heapOffset = 0;
+    std::uint64_t heapSize = 0;
+    std::uint64_t decisionsOffset = 0;
+    std::uint64_t decisionsLength = 0;
+};
+
+/**
+ * @brief One job of a columnar run report. Times are in microseconds.
+ */
+struct ReportRecord {
+    std::uint64_t pathOffset = 0;
+    std::uint64_t size = 0;
+    std::uint32_t pathLength = 0;
+    std::uint32_t micros = 0;
+    std::array<std::uint32_t, static_cast<std::size_t>(Phase::Count)> phaseMicros{};
+    Digest digest{};
+    std::uint8_t succeeded = 0;
+    std::uint8_t reserved[7] = {};
+};
+
+static_assert(sizeof(ReportHeader) == 48 && sizeof(ReportRecord) == 88);
+
+/**
+ * @brief Writes a batch run report in the columnar format (see ReportHeader).
+ *
+ * @param path The report file.
+ * @param report The batch outcome.
+ * @return true if the report was written, false otherwise.
+ */
+[[nodiscard]] bool writeColumnarReport(const fs::path &path, const BatchReport &report) {
+    const auto toMicros = [](const double seconds) {
+        return static_cast<std::uint32_t>(std::clamp(seconds * 1e6, 0.0, 4294967295.0));
+    };
+    std::string decisions;
+    for (const auto &decision: report.decisions)
+        decisions += decision + "\n";
+
+    ReportHeader header;
+    header.recordCount = report.jobs.size();
+    header.heapOffset = sizeof(ReportHeader) + report.jobs.size() * sizeof(ReportRecord);
+    for (const auto &job: report.jobs)
+        header.heapSize += job.path.size();
+    header.decisionsOffset = header.heapSize;
+    header.decisionsLength = decisions.size();
+    header.heapSize += decisions.size();
+
+    const fs::path tempPath = path.string() + ".tmp";
+    std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    std::uint64_t pathOffset = 0;
+    for (const auto &job: report.jobs) {
+        ReportRecord record;
+        record.pathOffset = pathOffset;
+        record.pathLength = static_cast<std::uint32_t>(job.path.size());
+        record.size = job.size;
+        record.micros = toMicros(job.seconds);
+        for (std::size_t p = 0; p < record.phaseMicros.size(); ++p)
+            record.phaseMicros[p] = toMicros(job.phases.seconds[p]);
+        record.digest = job.digest;
+        record.succeeded = job.succeeded ? 1 : 0;
+        file.write(reinterpret_cast<const char *>(&record), sizeof(record));
+        pathOffset += job.path.size();
+    }
+    for (const auto &job: report.jobs)
+        file.write(job.path.data(), static_cast<std::streamsize>(job.path.size()));
+    file.write(decisions.data(), static_cast<std::streamsize>(decisions.size()));
+    file.close();
+
+    std::error_code ec;
+    if (file)
+        fs::rename(tempPath, path, ec);
+    if (!file || ec) {
+        fs::remove(tempPath, ec);
+        std::cerr << "Failed to write run report " << path.string() << "\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief The formats of batch run reports.
+ */
+enum class ReportFormat {
+    /** A JSON document (see writeJsonReport). */
+    Json,
+    /** A mappable record table with a string heap (see ReportHeader). */
+    Columnar,
+};
+
+/**
+ * Parses the name of a report format as given on the command line.
+ *
+ * @param name `json` or `columnar`.
+ * @return The format, or an empty std::optional if the name is unknown.
+ */
+[[nodiscard]] std::optional<ReportFormat> parseReportFormat(const std::string_view name) {
+    if (name == "json")
+        return ReportFormat::Json;
+    if (name == "columnar")
+        return ReportFormat::Columnar;
+    std::cerr << "Unknown report format: " << name << " (expected json or columnar)\n";
+    return std::nullopt;
+}
+
+/**
+ * Writes a batch run report.
+ *
+ * @param path The report file.
+ * @param report The batch outcome.
+ * @param format The report format.
+ * @return true if the report was written, false otherwise.
+ */
+[[nodiscard]] bool writeRunReport(const fs::path &path, const BatchReport &report, const ReportFormat format) {
+    return format == ReportFormat::Columnar ? writeColumnarReport(path, report) : writeJsonReport(path, report);
+}
+
+/**
+ * @brief An immutable compiled patch catalog: the patch table together with its version.
+ *
+ * Catalogs are shared through `std::shared_ptr<const Catalog>`; a job keeps the snapshot
+ * it started with alive until it finishes, however often the catalog is replaced.
+ */
+struct Catalog {
+    PatchTable patches;
+    Digest version{};
+};
+
+/**
+ * Compiles a patch table into an immutable catalog snapshot.
+ *
+ * @param patches The patch table.
+ * @return The catalog.
+ */
+[[nodiscard]] std::shared_ptr<const Catalog> compileCatalog(PatchTable patches) {
+    auto catalog = std::make_shared<Catalog>();
+    catalog->version = catalogVersion(patches);
+    catalog->patches = std::move(patches);
+    return catalog;
+}
+
+/**
+ * Loads a patch table from a text file.
+ *
+ * Every non-empty line that does not start with `#` describes one entry as
+ * `<fix name> <file offset> <byte> <byte>...`, with the offset and bytes in hex. An
+ * `after=<offset>,...` field lists the entries that must be written first:
+ *
+ *     rce-exploit 0x2A7 C0
+ *     my-fix 0x1000 E9 00 01 00 00 after=0x1105
+ *
+ * @param filepath The catalog file.
+ * @return The patch table, or an empty std::optional if the file is missing or malformed.
+ */
+[[nodiscard]] std::optional<PatchTable> loadPatchTableFile(const std::string &filepath) {
+    std::ifstream file(filepath);
+    if (!file) {
+        std::cerr << "Failed to open catalog " << filepath << ".\n";
+        return std::nullopt;
+    }
+    PatchTable table;
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+        std::istringstream fields(line);
+        std::string name, offset, byte;
+        if (!(fields >> name) || name.starts_with('#'))
+            continue;
+        Patch patch{name, 0, {}};
+        const auto pos = (fields >> offset) ? parseHex(offset) : std::nullopt;
+        bool valid = pos.has_value();
+        while (valid && fields >> byte) {
+            if (byte.starts_with("after=")) {
+                std::istringstream offsets(byte.substr(6));
+                for (std::string dependency; valid && std::getline(offsets, dependency, ',');) {
+                    const auto value = parseHex(dependency);
+                    valid = value.has_value();
+                    if (valid)
+                        patch.after.push_back(static_cast<std::streamoff>(*value));
+                }
+                continue;
+            }
+            const auto value = parseHex(byte);
+            valid = value && *value <= 0xFF;
+            if (valid)
+                patch.data.push_back(static_cast<std::uint8_t>(*value));
+        }
+        if (!valid || patch.data.empty()) {
+            std::cerr << filepath << ":" << lineNumber << ": expected '<name> <offset> <bytes...>' in hex.\n";
+            return std::nullopt;
+        }
+        patch.pos = static_cast<std::streamoff>(*pos);
+        table.push_back(std::move(patch));
+    }
+    if (table.size() > 64) {
+        std::cerr << "Catalog " << filepath << " has more than 64 entries.\n";
+        return std::nullopt;
+    }
+    return table;
+}
+
+/**
+ * @brief Holds the current catalog snapshot and lets it be replaced while jobs are running.
+ *
+ * Readers take a reference-counted snapshot with a single atomic load and never wait for a
+ * reload, since a catalog is loaded and compiled before it is published; publishing swaps
+ * the pointer atomically. A replaced snapshot is freed when the last job holding it finishes.
+ *
+ * The swap is not lock-free: `std::atomic<std::shared_ptr>` is not lock-free in libstdc++,
+ * which guards the pointer with an internal lock bit. A load or store holds it only long
+ * enough to copy the pointer and adjust its reference count, so readers briefly
+ * serialize with each other and with publish(), but never with a reload.
+ */
+class CatalogRegistry {
+public:
+    explicit CatalogRegistry(std::shared_ptr<const Catalog> initial) : current_(std::move(initial)) {
+    }
+
+    /**
+     * @return The catalog new jobs should use.
+     */
+    [[nodiscard]] std::shared_ptr<const Catalog> snapshot() const {
+        return current_.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Makes a new catalog current. Jobs already running keep their old snapshot.
+     *
+     * @param next The new catalog.
+     */
+    void publish(std::shared_ptr<const Catalog> next) {
+        current_.store(std::move(next), std::memory_order_release);
+    }
+
+private:
+    std::atomic<std::shared_ptr<const Catalog> > current_;
+};
+
+/**
+ * @brief The header of a compiled catalog as shared between processes (see loadSharedCatalog).
+ *
+ * It is followed by `count` entries, each a SharedPatchEntry and then its name, its bytes
+ * and its `after` offsets.
+ */
+struct SharedCatalogHeader {
+    char magic[8];
+    Digest version;
+    std::uint32_t count;
+    std::uint32_t reserved;
+};
+
+/**
+ * @brief One patch table entry in a shared catalog.
+ */
+struct SharedPatchEntry {
+    std::uint64_t pos;
+    std::uint32_t dataLength;
+    std::uint16_t nameLength;
+    std::uint16_t afterCount;
+};
+
+static_assert(sizeof(SharedCatalogHeader) == 48 && sizeof(SharedPatchEntry) == 16);
+
+/**
+ * Flattens a catalog into the shared catalog layout.
+ *
+ * @param catalog The catalog.
+ * @return The serialized catalog.
+ */
+[[nodiscard]] std::vector<std::uint8_t> serializeCatalog(const Catalog &catalog) {
+    std::vector<std::uint8_t> bytes(sizeof(SharedCatalogHeader));
+    SharedCatalogHeader header{{'W', '3', 'C', 'A', 'T', '0', '0', '1'}, catalog.version,
+                               static_cast<std::uint32_t>(catalog.patches.size()), 0};
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    const auto append = [&](const void *data, const std::size_t size) {
+        const auto *begin = static_cast<const std::uint8_t *>(data);
+        bytes.insert(bytes.end(), begin, begin + size);
+    };
+    for (const auto &[name, pos, data, after]: catalog.patches) {
+        const SharedPatchEntry entry{static_cast<std::uint64_t>(static_cast<std::streamoff>(pos)),
+                                     static_cast<std::uint32_t>(data.size()),
+                                     static_cast<std::uint16_t>(name.size()),
+                                     static_cast<std::uint16_t>(after.size())};
+        append(&entry, sizeof(entry));
+        append(name.data(), name.size());
+        append(data.data(), data.size());
+        append(after.data(), after.size() * sizeof(std::streamoff));
+    }
+    return bytes;
+}
+
+/**
+ * Rebuilds a catalog from the shared catalog layout.
+ *
+ * @param bytes The serialized catalog.
+ * @param size Its size in bytes.
+ * @return The catalog, or null if the bytes are not a well-formed shared catalog.
+ */
+[[nodiscard]] std::shared_ptr<const Catalog> deserializeCatalog(const std::uint8_t *bytes, const std::size_t size) {
+    SharedCatalogHeader header{};
+    if (size < sizeof(header))
+        return nullptr;
+    std::memcpy(&header, bytes, sizeof(header));
+    if (std::string_view(header.magic, sizeof(header.magic)) != "W3CAT001" || header.count > 64)
+        return nullptr;
+
+    auto catalog = std::make_shared<Catalog>();
+    catalog->version = header.version;
+    std::size_t at = sizeof(header);
+    for (std::uint32_t i = 0; i < header.count; ++i) {
+        SharedPatchEntry entry{};
+        if (size - at < sizeof(entry))
+            return nullptr;
+        std::memcpy(&entry, bytes + at, sizeof(entry));
+        at += sizeof(entry);
+        const std::size_t afterBytes = std::size_t{entry.afterCount} * sizeof(std::streamoff);
+        if (size - at < std::size_t{entry.nameLength} + entry.dataLength + afterBytes)
+            return nullptr;
+        Patch patch{std::string(reinterpret_cast<const char *>(bytes + at), entry.nameLength),
+                    static_cast<std::streamoff>(entry.pos), {}};
+        at += entry.nameLength;
+        patch.data.assign(bytes + at, bytes + at + entry.dataLength);
+        at += entry.dataLength;
+        patch.after.resize(entry.afterCount);
+        std::memcpy(patch.after.data(), bytes + at, afterBytes);
+        at += afterBytes;
+        catalog->patches.push_back(std::move(patch));
+    }
+    return at == size ? catalog : nullptr;
+}
+
+/**
+ * Derives the name a catalog is shared under from the identity of its source: the catalog
+ * file, or for the built-in table the patcher executable itself.
+ *
+ * @param catalogPath The catalog file, or empty for the built-in table.
+ * @return The key, or an empty std::optional if the source cannot be identified.
+ */
+[[nodiscard]] std::optional<std::string> sharedCatalogKey(const std::optional<std::string> &catalogPath) {
+#if defined(__linux__)
+    std::error_code ec;
+    const fs::path source = catalogPath ? fs::canonical(*catalogPath, ec) : fs::read_symlink("/proc/self/exe", ec);
+    struct stat info {};
+    if (ec || stat(source.c_str(), &info) != 0)
+        return std::nullopt;
+    const std::string identity = source.string() + '\0' + std::to_string(info.st_dev) + '\0' +
+                                 std::to_string(info.st_ino) + '\0' + std::to_string(info.st_size) + '\0' +
+                                 std::to_string(info.st_mtim.tv_sec) + '.' + std::to_string(info.st_mtim.tv_nsec);
+    Sha256 sha;
+    sha.update(reinterpret_cast<const std::uint8_t *>(identity.data()), identity.size());
+    return toHex(sha.finish()).substr(0, 32);
+#else
+    (void) catalogPath;
+    return std::nullopt;
+#endif
+}
+
+#if defined(__linux__)
+/**
+ * @brief Hands the sealed memfd of a compiled catalog to every process that connects to
+ * its abstract socket, for as long as this process runs.
+ */
+class CatalogPublisher {
+public:
+    /**
+     * Starts serving a sealed catalog memfd on a listening socket; takes ownership of both.
+     */
+    CatalogPublisher(const int memfd, const int listener) : memfd(memfd), listener(listener) {
+        server = std::jthread([this](const std::stop_token &stop) {
+            while (!stop.stop_requested()) {
+                const int client = accept4(this->listener, nullptr, nullptr, SOCK_CLOEXEC);
+                if (client >= 0) {
+                    sendCatalog(client);
+                    close(client);
+                } else if (errno != EINTR && errno != ECONNABORTED) {
+                    // Out of descriptors or memory: back off instead of giving the socket up,
+                    // since the name stays bound and clients would queue on it unserved.
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                }
+            }
+        });
+    }
+
+    CatalogPublisher(const CatalogPublisher &) = delete;
+    CatalogPublisher &operator=(const CatalogPublisher &) = delete;
+
+    ~CatalogPublisher() {
+        // Shutting the listener down makes the blocked accept fail, and the server then sees the stop.
+        server.request_stop();
+        shutdown(listener, SHUT_RDWR);
+        server.join();
+        close(listener);
+        close(memfd);
+    }
+
+private:
+    void sendCatalog(const int client) const {
+        char payload = 'C';
+        iovec data{&payload, 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+        msghdr message{};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr *rights = CMSG_FIRSTHDR(&message);
+        rights->cmsg_level = SOL_SOCKET;
+        rights->cmsg_type = SCM_RIGHTS;
+        rights->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(rights), &memfd, sizeof(int));
+        static_cast<void>(sendmsg(client, &message, MSG_NOSIGNAL));
+    }
+
+    int memfd;
+    int listener;
+    std::jthread server;
+};
+
+/**
+ * Builds the abstract socket address a catalog is shared under. The user id is part of
+ * the name, and peers are checked to be the same user as well.
+ *
+ * @param key The catalog key (see sharedCatalogKey).
+ * @param length Receives the length of the address.
+ * @return The address.
+ */
+[[nodiscard]] sockaddr_un sharedCatalogAddress(const std::string &key, socklen_t &length) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    const std::string name = "wow_patcher/catalog/" + std::to_string(getuid()) + "/" + key;
+    std::memcpy(address.sun_path + 1, name.data(), std::min(name.size(), sizeof(address.sun_path) - 1));
+    length = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 +
+                                    std::min(name.size(), sizeof(address.sun_path) - 1));
+    return address;
+}
+
+/**
+ * Fetches a catalog another process shares under the given key.
+ *
+ * @param key The catalog key.
+ * @return The catalog, or null if nobody shares it, the publisher does not answer in time, or
+ *         the peer or its memfd cannot be trusted.
+ */
+[[nodiscard]] std::shared_ptr<const Catalog> fetchSharedCatalog(const std::string &key) {
+    socklen_t length = 0;
+    const sockaddr_un address = sharedCatalogAddress(key, length);
+    const int socketFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socketFd < 0)
+        return nullptr;
+    // A publisher that is stopped or wedged must not hang us; past the deadline the catalog
+    // is compiled locally instead. The send timeout also bounds connect on a full backlog.
+    const timeval deadline{0, 500'000};
+    setsockopt(socketFd, SOL_SOCKET, SO_SNDTIMEO, &deadline, sizeof(deadline));
+    setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &deadline, sizeof(deadline));
+    int memfd = -1;
+    ucred peer{};
+    socklen_t peerLength = sizeof(peer);
+    if (connect(socketFd, reinterpret_cast<const sockaddr *>(&address), length) == 0 &&
+        getsockopt(socketFd, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) == 0 && peer.uid == getuid()) {
+        char payload = 0;
+        iovec data{&payload, 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+        msghdr message{};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(socketFd, &message, MSG_CMSG_CLOEXEC) == 1) {
+            if (const cmsghdr *rights = CMSG_FIRSTHDR(&message);
+                rights && rights->cmsg_level == SOL_SOCKET && rights->cmsg_type == SCM_RIGHTS)
+                std::memcpy(&memfd, CMSG_DATA(rights), sizeof(int));
+        }
+    }
+    close(socketFd);
+    if (memfd < 0)
+        return nullptr;
+
+    // Only a fully sealed memfd is immutable; anything else could change under the mapping.
+    constexpr int kRequiredSeals = F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+    std::shared_ptr<const Catalog> catalog;
+    struct stat info {};
+    if ((fcntl(memfd, F_GET_SEALS) & kRequiredSeals) == kRequiredSeals && fstat(memfd, &info) == 0) {
+        const auto size = static_cast<std::size_t>(info.st_size);
+        if (void *mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, memfd, 0); mapped != MAP_FAILED) {
+            catalog = deserializeCatalog(static_cast<const std::uint8_t *>(mapped), size);
+            munmap(mapped, size);
+        }
+    }
+    close(memfd);
+    return catalog;
+}
+
+/**
+ * Shares a compiled catalog under the given key for the rest of this process's life.
+ *
+ * @param key The catalog key.
+ * @param catalog The catalog.
+ * @return The publisher, or null if the catalog could not be shared (e.g. another process
+ *         started sharing the same key first).
+ */
+[[nodiscard]] std::unique_ptr<CatalogPublisher> publishSharedCatalog(const std::string &key, const Catalog &catalog) {
+    const auto bytes = serializeCatalog(catalog);
+    const int memfd = memfd_create("wow_patcher_catalog", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0)
+        return nullptr;
+    constexpr int kSeals = F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+    if (write(memfd, bytes.data(), bytes.size()) != static_cast<ssize_t>(bytes.size()) ||
+        fcntl(memfd, F_ADD_SEALS, kSeals) != 0) {
+        close(memfd);
+        return nullptr;
+    }
+    socklen_t length = 0;
+    const sockaddr_un address = sharedCatalogAddress(key, length);
+    const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<const sockaddr *>(&address), length) != 0 ||
+        listen(listener, 64) != 0) {
+        if (listener >= 0)
+            close(listener);
+        close(memfd);
+        return nullptr;
+    }
+    return std::make_unique<CatalogPublisher>(memfd, listener);
+}
+#endif
+
+/**
+ * @brief Loads a compiled catalog shared by a concurrently running patcher, or compiles it
+ * and shares it.
+ *
+ * The first process to compile a catalog writes it into a sealed memfd and hands that to
+ * every later process through an abstract unix socket named after the catalog's source
+ * (see sharedCatalogKey) and the user. Later processes receive the memfd, check its seals,
+ * map it read-only and rebuild the table from it, so they neither parse the catalog nor
+ * hash it for its version. The catalog stays shared while the publishing process runs;
+ * after that the next process to start publishes it again.
+ *
+ * @param catalogPath The catalog file, or empty for the built-in table.
+ * @return The catalog, or null if it could not be loaded.
+ */
+[[nodiscard]] std::shared_ptr<const Catalog> loadSharedCatalog(const std::optional<std::string> &catalogPath) {
+    const auto compile = [&]() -> std::shared_ptr<const Catalog> {
+        auto table = catalogPath ? loadPatchTableFile(*catalogPath) : std::optional(buildPatchTable());
+        return table ? compileCatalog(std::move(*table)) : nullptr;
+    };
+#if defined(__linux__)
+    static std::unique_ptr<CatalogPublisher> publisher;
+    const auto key = sharedCatalogKey(catalogPath);
+    if (!key)
+        return compile();
+    if (auto shared = fetchSharedCatalog(*key))
+        return shared;
+    auto catalog = compile();
+    if (catalog && !publisher)
+        publisher = publishSharedCatalog(*key, *catalog);
+    return catalog;
+#else
+    return compile();
+#endif
+}
+
+/**
+ * @brief The priority classes of queued jobs.
+ */
+enum class JobClass {
+    /** A player waiting on a launcher; served first, earliest deadline first. */
+    Interactive,
+    /** Fleet rollouts and other background work; served in arrival order. */
+    Bulk,
+};
+
+/**
+ * @brief A blocking multi-producer, multi-consumer queue of jobs with an interactive lane.
+ *
+ * Interactive jobs are kept apart from bulk jobs and ordered by deadline. Every pop
+ * takes an interactive job if there is one, so interactive work overtakes queued bulk
+ * work at the next file boundary of any worker; workers that pop with `interactiveOnly`
+ * never take bulk jobs and act as reserved capacity.
+ *
+ * @tparam Job The job type.
+ */
+template<typename Job>
+class WorkQueue {
+public:
+    using Deadline = std::chrono::steady_clock::time_point;
+
+    /**
+     * Adds a job to its lane.
+     *
+     * @param job The job.
+     * @param jobClass The lane: interactive jobs go by deadline, bulk jobs to the back.
+     * @param deadline When an interactive job is due.
+     */
+    void push(Job job, const JobClass jobClass = JobClass::Bulk, const Deadline deadline = Deadline::max()) {
+        {
+            std::lock_guard lock(mutex_);
+            if (jobClass == JobClass::Interactive)
+                interactive_.emplace(deadline, std::move(job));
+            else
+                jobs_.push_back(std::move(job));
+        }
+        ready_.notify_all();
+    }
+
+    /**
+     * Waits for the next job.
+     *
+     * @param interactiveOnly Only take interactive jobs.
+     * @return The next job, or an empty std::optional once the queue is closed and drained.
+     */
+    [[nodiscard]] std::optional<Job> pop(const bool interactiveOnly = false) {
+        std::unique_lock lock(mutex_);
+        ready_.wait(lock, [&] { return closed_ || !interactive_.empty() || (!interactiveOnly && !jobs_.empty()); });
+        if (!interactive_.empty()) {
+            Job job = std::move(interactive_.begin()->second);
+            interactive_.erase(interactive_.begin());
+            return job;
+        }
+        if (interactiveOnly || jobs_.empty())
+            return std::nullopt;
+        Job job = std::move(jobs_.front());
+        jobs_.pop_front();
+        return job;
+    }
+
+    /**
+     * Stops accepting jobs; workers finish the remaining ones and then see the end of the queue.
+     */
+    void close() {
+        {
+            std::lock_guard lock(mutex_);
+            closed_ = true;
+        }
+        ready_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::multimap<Deadline, Job> interactive_;
+    std::deque<Job> jobs_;
+    bool closed_ = false;
+};
+
+/**
+ * @brief A job queued by the service.
+ */
+struct ServeJob {
+    std::string path;
+    JobClass jobClass = JobClass::Bulk;
+    std::chrono::steady_clock::time_point queued;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+};
+
+/**
+ * @brief Counters the service keeps per job class.
+ */
+struct LaneMetrics {
+    std::atomic<std::uint64_t> completed = 0;
+    std::atomic<std::uint64_t> failed = 0;
+    std::atomic<std::uint64_t> deadlineMisses = 0;
+    std::atomic<std::uint64_t> totalWaitMicros = 0;
+    std::atomic<std::uint64_t> maxWaitMicros = 0;
+
+    /** Accounts for a finished job. */
+    void record(const ServeJob &job, const bool succeeded, const std::chrono::steady_clock::time_point started) {
+        const auto finished = std::chrono::steady_clock::now();
+        const auto wait = static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(started - job.queued).count());
+        ++(succeeded ? completed : failed);
+        if (finished > job.deadline)
+            ++deadlineMisses;
+        totalWaitMicros += wait;
+        for (auto seen = maxWaitMicros.load(); wait > seen && !maxWaitMicros.compare_exchange_weak(seen, wait);) {
+        }
+    }
+
+    /** Prints the counters as one line. */
+    void print(std::ostream &out, const std::string_view name) const {
+        const std::uint64_t jobs = completed + failed;
+        out << name << ": " << completed << " done, " << failed << " failed, " << deadlineMisses
+                << " deadline misses, mean wait " << (jobs ? totalWaitMicros / jobs / 1000 : 0) << " ms, max wait "
+                << maxWaitMicros / 1000 << " ms\n";
+    }
+};
+
+/**
+ * @brief Loads an executable the way the client's loader would and waits, as a stand-in
+ * for a running client that `--live` can be tried against.
+ *
+ * The headers are mapped from the file at offset 0, so findModuleBase finds the module in
+ * `/proc/<pid>/maps` by inode, and every section is copied into its place at base + RVA.
+ * Executable sections are then made read-only, which exercises the ptrace fallback. Any
+ * process may trace the stand-in. Its process id and image base are printed, and it runs
+ * until it is killed.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments: `--live-standin <path to Wow.exe>`.
+ * @return `EXIT_FAILURE` if the image could not be loaded; otherwise it does not return.
+ */
+int runLiveStandIn(const int argc, char **argv) {
+#if defined(__linux__)
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " --live-standin <path to Wow.exe>\n";
+        return EXIT_FAILURE;
+    }
+    const std::string wowPath = argv[2];
+    const auto image = readPeHeaders(wowPath);
+    const auto bytes = readWholeFile(wowPath);
+    if (!image || !bytes)
+        return EXIT_FAILURE;
+    const auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    const auto pageAlign = [&](const std::size_t value) { return (value + page - 1) / page * page; };
+    std::size_t imageSize = pageAlign(image->sizeOfHeaders);
+    for (const auto &section: image->sections)
+        imageSize = std::max(imageSize, pageAlign(section.virtualAddress +
+                                                  std::max(section.virtualSize, section.rawSize)));
+
+    const int fd = open(wowPath.c_str(), O_RDONLY | O_CLOEXEC);
+    void *reserved = mmap(nullptr, imageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    auto *base = static_cast<std::uint8_t *>(reserved);
+    if (fd < 0 || reserved == MAP_FAILED ||
+        mmap(base, pageAlign(image->sizeOfHeaders), PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        std::cerr << "Failed to map " << wowPath << ": " << std::strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    for (const auto &section: image->sections) {
+        const std::size_t begin = section.virtualAddress / page * page;
+        const std::size_t end = pageAlign(section.virtualAddress + std::max(section.virtualSize, section.rawSize));
+        if (begin < pageAlign(image->sizeOfHeaders) ||
+            mprotect(base + begin, end - begin, PROT_READ | PROT_WRITE) != 0) {
+            std::cerr << "Section " << section.name << " overlaps the headers or cannot be mapped.\n";
+            return EXIT_FAILURE;
+        }
+        const std::size_t mapped = section.virtualSize == 0 ? section.rawSize
+                                                            : std::min(section.rawSize, section.virtualSize);
+        if (section.rawPointer + mapped <= bytes->size())
+            std::memcpy(base + section.virtualAddress, bytes->data() + section.rawPointer, mapped);
+        if ((section.characteristics & kSectionExecutable) != 0)
+            mprotect(base + begin, end - begin, PROT_READ | PROT_EXEC);
+    }
+    prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY);
+
+    std::cout << "Stand-in for " << wowPath << " is process " << getpid() << " with the image at 0x" << std::hex
+            << reinterpret_cast<std::uintptr_t>(base) << std::dec << "." << std::endl;
+    for (;;)
+        pause();
+#else
+    (void) argc;
+    (void) argv;
+    std::cerr << "The live stand-in is only supported on Linux.\n";
+    return EXIT_FAILURE;
+#endif
+}
+
+/**
+ * @brief Runs the patcher as a long-lived service that patches the paths it reads from stdin.
+ *
+ * Each line on stdin is the path of an executable to patch as a bulk job. A line
+ * `interactive <path>` queues an interactive job due within the default deadline, and
+ * `interactive:<ms> <path>` one due within `<ms>` milliseconds; interactive jobs jump the
+ * bulk queue at the next file boundary and have `--reserved` workers to themselves (see
+ * WorkQueue). The line `stats` prints the per-class counters, including deadline misses,
+ * which are also printed on exit. The line `reload` reloads the catalog file immediately,
+ * and end of input drains the queue and exits. With `--catalog` the patch table is read
+ * from a file (see loadPatchTableFile), which is also polled for changes. A new catalog is
+ * published atomically: jobs in flight finish on the snapshot they started with, jobs
+ * started afterwards use the new one, and the queue never pauses. With `--shared-catalog`
+ * the initial catalog is taken from, or shared with, concurrently running patchers (see
+ * loadSharedCatalog); reloads are compiled locally.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments:
+ *             `--serve [--catalog <file>] [--shared-catalog] [--workers <n>] [--reserved <n>]
+ *             [--deadline <ms>] [--profile <profile>] [--engine <engine>]`.
+ * @return `EXIT_SUCCESS` if every job succeeded, `EXIT_FAILURE` otherwise.
+ */
+int runServe(const int argc, char **argv) {
+    std::optional<std::string> catalogPath;
+    std::string profile = "all";
+    PatchEngine engine = PatchEngine::Fused;
+    unsigned workerCount = std::max(1u, std::thread::hardware_concurrency());
+    std::optional<unsigned> reservedCount;
+    std::chrono::milliseconds defaultDeadline(2000);
+    bool shareCatalog = false;
+    for (int i = 2; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--catalog" && i + 1 < argc) {
+            catalogPath = argv[++i];
+        } else if (arg == "--shared-catalog") {
+            shareCatalog = true;
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (arg == "--engine" && i + 1 < argc) {
+            const auto parsed = parsePatchEngine(argv[++i]);
+            if (!parsed)
+                return EXIT_FAILURE;
+            engine = *parsed;
+        } else if (arg == "--workers" && i + 1 < argc) {
+            const auto count = parseJobCount(argv[++i]);
+            if (!count || *count == kAdaptiveJobs) {
+                if (count)
+                    std::cerr << "--workers needs a fixed worker count.\n";
+                return EXIT_FAILURE;
+            }
+            workerCount = *count;
+        } else if (arg == "--reserved" && i + 1 < argc) {
+            const std::string_view text = argv[++i];
+            unsigned count = 0;
+            if (const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), count);
+                ec != std::errc{} || ptr != text.data() + text.size()) {
+                std::cerr << "Invalid reserved worker count: " << text << "\n";
+                return EXIT_FAILURE;
+            }
+            reservedCount = count;
+        } else if (arg == "--deadline" && i + 1 < argc) {
+            const auto ms = parseJobCount(argv[++i]);
+            if (!ms || *ms == kAdaptiveJobs) {
+                std::cerr << "Invalid deadline.\n";
+                return EXIT_FAILURE;
+            }
+            defaultDeadline = std::chrono::milliseconds(*ms);
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                    << " --serve [--catalog <file>] [--shared-catalog] [--workers <n>] [--reserved <n>]"
+                    << " [--deadline <ms>] [--profile <profile>] [--engine <engine>]\n";
+            return EXIT_FAILURE;
+        }
+    }
+    // One worker is kept for interactive jobs by default, as long as bulk jobs keep one too.
+    const unsigned reserved = reservedCount.value_or(workerCount > 1 ? 1 : 0);
+    if (reserved >= workerCount) {
+        std::cerr << "--reserved must leave at least one worker for bulk jobs.\n";
+        return EXIT_FAILURE;
+    }
+
+    std::shared_ptr<const Catalog> initial;
+    if (shareCatalog) {
+        initial = loadSharedCatalog(catalogPath);
+    } else if (auto table = catalogPath ? loadPatchTableFile(*catalogPath) : buildPatchTable()) {
+        initial = compileCatalog(std::move(*table));
+    }
+    if (!initial)
+        return EXIT_FAILURE;
+    CatalogRegistry registry(std::move(initial));
+    std::cout << "Catalog " << toHex(registry.snapshot()->version).substr(0, 16) << " published.\n";
+
+    std::mutex reloadMutex;
+    std::optional<fs::file_time_type> loadedTime;
+    const auto reload = [&](const bool onlyIfChanged) {
+        std::lock_guard lock(reloadMutex);
+        std::error_code ec;
+        const auto modified = fs::last_write_time(*catalogPath, ec);
+        if (ec || (onlyIfChanged && loadedTime == modified))
+            return;
+        loadedTime = modified;
+        if (auto table = loadPatchTableFile(*catalogPath)) {
+            auto next = compileCatalog(std::move(*table));
+            if (next->version == registry.snapshot()->version)
+                return;
+            std::cout << "Catalog " << toHex(next->version).substr(0, 16) << " published.\n";
+            registry.publish(std::move(next));
+        }
+    };
+    if (catalogPath) {
+        std::error_code ec;
+        loadedTime = fs::last_write_time(*catalogPath, ec);
+    }
+
+    WorkQueue<ServeJob> queue;
+    LaneMetrics interactiveMetrics;
+    LaneMetrics bulkMetrics;
+    std::vector<std::jthread> workers;
+    for (unsigned i = 0; i < workerCount; ++i) {
+        workers.emplace_back([&, interactiveOnly = i < reserved] {
+            while (auto job = queue.pop(interactiveOnly)) {
+                const auto started = std::chrono::steady_clock::now();
+                const std::shared_ptr<const Catalog> catalog = registry.snapshot();
+                const auto selection = parseProfile(catalog->patches, profile);
+                const bool succeeded = selection && patchExecutable(job->path, catalog->patches, *selection, engine);
+                if (!succeeded)
+                    std::cerr << "Job failed: " << job->path << "\n";
+                (job->jobClass == JobClass::Interactive ? interactiveMetrics : bulkMetrics)
+                        .record(*job, succeeded, started);
+                if (job->jobClass == JobClass::Interactive && std::chrono::steady_clock::now() > job->deadline)
+                    std::cerr << "Deadline missed: " << job->path << "\n";
+            }
+        });
+    }
+    const auto printMetrics = [&] {
+        interactiveMetrics.print(std::cout, "interactive");
+        bulkMetrics.print(std::cout, "bulk");
+    };
+
+    std::mutex stopMutex;
+    std::condition_variable stopSignal;
+    bool stopping = false;
+    std::jthread watcher;
+    if (catalogPath) {
+        watcher = std::jthread([&] {
+            std::unique_lock lock(stopMutex);
+            while (!stopSignal.wait_for(lock, std::chrono::milliseconds(500), [&] { return stopping; })) {
+                lock.unlock();
+                reload(true);
+                lock.lock();
+            }
+        });
+    }
+
+    for (std::string line; std::getline(std::cin, line);) {
+        if (line.empty())
+            continue;
+        if (line == "reload") {
+            if (catalogPath)
+                reload(false);
+            continue;
+        }
+        if (line == "stats") {
+            printMetrics();
+            continue;
+        }
+
+        ServeJob job{line, JobClass::Bulk, std::chrono::steady_clock::now()};
+        if (line.starts_with("interactive ") || line.starts_with("interactive:")) {
+            const std::size_t space = line.find(' ');
+            auto deadline = defaultDeadline;
+            if (line[11] == ':') {
+                const std::string_view text = std::string_view(line).substr(12, space - 12);
+                unsigned ms = 0;
+                if (const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), ms);
+                    space == std::string::npos || ec != std::errc{} || ptr != text.data() + text.size()) {
+                    std::cerr << "Invalid interactive request: " << line << "\n";
+                    continue;
+                }
+                deadline = std::chrono::milliseconds(ms);
+            }
+            job.path = line.substr(space + 1);
+            job.jobClass = JobClass::Interactive;
+            job.deadline = job.queued + deadline;
+        }
+        const auto [jobClass, deadline] = std::pair{job.jobClass, job.deadline};
+        queue.push(std::move(job), jobClass, deadline);
+    }
+
+    queue.close();
+    workers.clear();
+    {
+        std::lock_guard lock(stopMutex);
+        stopping = true;
+    }
+    stopSignal.notify_all();
+    printMetrics();
+    return interactiveMetrics.failed + bulkMetrics.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Expands path arguments, replacing every `@file` argument with the non-empty lines of that file.
+ *
+ * @param begin The first argument.
+ * @param end One past the last argument.
+ * @return The paths, or an empty std::optional if a list file could not be read.
+ */
+[[nodiscard]] std::optional<std::vector<std::string> > expandPathArguments(char **begin, char **end) {
+    std::vector<std::string> paths;
+    for (; begin != end; ++begin) {
+        const std::string_view arg = *begin;
+        if (!arg.starts_with('@')) {
+            paths.emplace_back(arg);
+            continue;
+        }
+        std::ifstream list{std::string(arg.substr(1))};
+        if (!list) {
+            std::cerr << "Failed to open path list " << arg.substr(1) << ".\n";
+            return std::nullopt;
+        }
+        for (std::string line; std::getline(list, line);) {
+            if (!line.empty())
+                paths.push_back(std::move(line));
+        }
+    }
+    return paths;
+}
+
+#if defined(__linux__)
+/**
+ * @brief A file taking part in a deduplication pass.
+ */
+struct DedupeFile {
+    std::string path;
+    dev_t device = 0;
+    std::uint64_t size = 0;
+    Digest digest{};
+};
+
+/**
+ * @brief Largest range a single FIDEDUPERANGE call is asked to share; btrfs caps requests at 16 MiB.
+ */
+constexpr std::uint64_t kDedupeRangeSize = 16 * 1024 * 1024;
+
+/**
+ * @brief Most destinations per FIDEDUPERANGE call; the kernel limits the request to one page.
+ */
+constexpr std::size_t kDedupeBatchSize = (4096 - sizeof(file_dedupe_range)) / sizeof(file_dedupe_range_info);
+
+/**
+ * Shares the extents of a source file with identical target files using FIDEDUPERANGE.
+ *
+ * Targets are submitted in batches, one ioctl per batch and range. The kernel compares the
+ * bytes before sharing, so a target whose contents differ is left untouched.
+ *
+ * @param source The file whose extents are kept.
+ * @param targets Files with the same size and digest as the source, on the same filesystem.
+ * @return The number of bytes now shared with the source.
+ */
+[[nodiscard]] std::uint64_t dedupeFiles(const DedupeFile &source, const std::vector<const DedupeFile *> &targets) {
+    const int sourceFd = open(source.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (sourceFd < 0) {
+        std::cerr << "Failed to open " << source.path << ": " << std::strerror(errno) << "\n";
+        return 0;
+    }
+
+    std::uint64_t shared = 0;
+    for (std::size_t first = 0; first < targets.size(); first += kDedupeBatchSize) {
+        std::vector<const DedupeFile *> batch;
+        std::vector<int> fds;
+        for (std::size_t i = first; i < std::min(targets.size(), first + kDedupeBatchSize); ++i) {
+            int fd = open(targets[i]->path.c_str(), O_RDWR | O_CLOEXEC);
+            if (fd < 0)
+                fd = open(targets[i]->path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                std::cerr << "Failed to open " << targets[i]->path << ": " << std::strerror(errno) << "\n";
+                continue;
+            }
+            batch.push_back(targets[i]);
+            fds.push_back(fd);
+        }
+
+        std::vector<std::uint8_t> storage(sizeof(file_dedupe_range) + fds.size() * sizeof(file_dedupe_range_info));
+        auto *request = reinterpret_cast<file_dedupe_range *>(storage.data());
+        std::vector active(fds.size(), true);
+        for (std::uint64_t offset = 0; offset < source.size && std::ranges::find(active, true) != active.end();
+             offset += kDedupeRangeSize) {
+            std::ranges::fill(storage, 0);
+            request->src_offset = offset;
+            request->src_length = std::min(kDedupeRangeSize, source.size - offset);
+            std::vector<std::size_t> submitted;
+            for (std::size_t i = 0; i < fds.size(); ++i) {
+                if (!active[i])
+                    continue;
+                request->info[submitted.size()].dest_fd = fds[i];
+                request->info[submitted.size()].dest_offset = offset;
+                submitted.push_back(i);
+            }
+            request->dest_count = static_cast<std::uint16_t>(submitted.size());
+            if (ioctl(sourceFd, FIDEDUPERANGE, request) != 0) {
+                std::cerr << "FIDEDUPERANGE failed for " << source.path << ": " << std::strerror(errno) << "\n";
+                break;
+            }
+            for (std::size_t j = 0; j < submitted.size(); ++j) {
+                const auto &info = request->info[j];
+                if (info.status == FILE_DEDUPE_RANGE_SAME) {
+                    shared += info.bytes_deduped;
+                    continue;
+                }
+                active[submitted[j]] = false;
+                if (info.status == FILE_DEDUPE_RANGE_DIFFERS)
+                    std::cerr << batch[submitted[j]]->path << " differs from " << source.path << ", skipped.\n";
+                else
+                    std::cerr << "Failed to deduplicate " << batch[submitted[j]]->path << ": "
+                            << std::strerror(-info.status) << "\n";
+            }
+        }
+        for (const int fd: fds)
+            close(fd);
+    }
+    close(sourceFd);
+    return shared;
+}
+#endif
+
+/**
+ * @brief Shares the extents of byte-identical patched executables and backups.
+ *
+ * Every given executable and its `.backup` are hashed (reusing cached leaf hashes) and
+ * grouped by filesystem, size and digest. Within each group the first file is kept and
+ * the others are deduplicated against it with FIDEDUPERANGE, which only shares ranges
+ * the kernel has verified to be identical.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments: `--dedupe <path or @list>...`.
+ * @return `EXIT_SUCCESS` if every group was processed, `EXIT_FAILURE` otherwise.
+ */
+int runDedupe(const int argc, char **argv) {
+#if defined(__linux__)
+    const auto paths = expandPathArguments(argv + 2, argv + argc);
+    if (!paths || paths->empty()) {
+        std::cerr << "Usage: " << argv[0] << " --dedupe <path or @list>...\n";
+        return EXIT_FAILURE;
+    }
+
+    std::vector<DedupeFile> files;
+    for (const auto &path: *paths) {
+        for (const std::string &candidate: {path, path + ".backup"}) {
+            struct stat info{};
+            if (stat(candidate.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+                continue;
+            const auto leaves = loadImageLeaves(candidate);
+            if (!leaves)
+                return EXIT_FAILURE;
+            files.push_back({candidate, info.st_dev, leaves->size, combineLeaves(*leaves)});
+        }
+    }
+
+    std::map<std::tuple<dev_t, std::uint64_t, Digest>, std::vector<const DedupeFile *> > groups;
+    for (const auto &file: files)
+        groups[{file.device, file.size, file.digest}].push_back(&file);
+
+    std::uint64_t shared = 0;
+    std::size_t duplicates = 0;
+    for (const auto &members: groups | std::views::values) {
+        if (members.size() < 2 || members.front()->size == 0)
+            continue;
+        duplicates += members.size() - 1;
+        shared += dedupeFiles(*members.front(), {members.begin() + 1, members.end()});
+    }
+    std::cout << "Deduplicated " << shared << " bytes across " << duplicates << " duplicate file(s) in "
+            << groups.size() << " group(s).\n";
+    return EXIT_SUCCESS;
+#else
+    (void) argc;
+    (void) argv;
+    std::cerr << "Deduplication is only supported on Linux.\n";
+    return EXIT_FAILURE;
+#endif
+}
+
+/**
+ * @brief Computes the tree digest of a stream whose pieces do not line up with leaf chunks.
+ */
+class TreeHasher {
+public:
+    /**
+     * Feeds the next bytes of the stream.
+     *
+     * @param data The bytes.
+     * @param size The number of bytes.
+     */
+    void update(const std::uint8_t *data, std::size_t size) {
+        while (size > 0) {
+            const std::size_t take = std::min(size, kHashChunkSize - pending_.size());
+            pending_.insert(pending_.end(), data, data + take);
+            data += take;
+            size -= take;
+            image_.size += take;
+            if (pending_.size() == kHashChunkSize) {
+                image_.leaves.push_back(hashLeaf(pending_.data(), pending_.size()));
+                pending_.clear();
+            }
+        }
+    }
+
+    /**
+     * Hashes the final partial chunk. The object must not be used afterwards.
+     *
+     * @return The leaf hashes of the whole stream.
+     */
+    [[nodiscard]] ImageLeaves finish() {
+        if (!pending_.empty())
+            image_.leaves.push_back(hashLeaf(pending_.data(), pending_.size()));
+        return std::move(image_);
+    }
+
+private:
+    ImageLeaves image_;
+    std::vector<std::uint8_t> pending_;
+};
+
+/**
+ * @brief A read-only view of a whole file, memory-mapped where the platform allows it.
+ */
+class MappedFile {
+public:
+    /**
+     * Maps the file at the given path. Check valid() before use.
+     *
+     * @param path The file to map.
+     */
+    explicit MappedFile(const fs::path &path) {
+#if defined(__linux__)
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info{};
+        if (fd >= 0 && fstat(fd, &info) == 0) {
+            size_ = static_cast<std::size_t>(info.st_size);
+            if (size_ == 0) {
+                valid_ = true;
+            } else if (void *mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0); mapped != MAP_FAILED) {
+                data_ = static_cast<const std::uint8_t *>(mapped);
+                valid_ = true;
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+#else
+        if (auto bytes = readWholeFile(path.string())) {
+            fallback_ = std::move(*bytes);
+            data_ = fallback_.data();
+            size_ = fallback_.size();
+            valid_ = true;
+        }
+#endif
+    }
+
+    ~MappedFile() {
+#if defined(__linux__)
+        if (data_ != nullptr)
+            munmap(const_cast<std::uint8_t *>(data_), size_);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    [[nodiscard]] bool valid() const { return valid_; }
+    [[nodiscard]] const std::uint8_t *data() const { return data_; }
+    [[nodiscard]] std::size_t size() const { return size_; }
+
+private:
+    const std::uint8_t *data_ = nullptr;
+    std::size_t size_ = 0;
+    bool valid_ = false;
+#if !defined(__linux__)
+    std::vector<std::uint8_t> fallback_;
+#endif
+};
+
+/**
+ * @brief The gear table of the content-defined chunker: 256 pseudo-random 64-bit values.
+ *
+ * Generated with SplitMix64 from a fixed seed, so chunk boundaries are stable across builds.
+ */
+constexpr std::array<std::uint64_t, 256> kGearTable = [] {
+    std::array<std::uint64_t, 256> table{};
+    std::uint64_t state = 0x3335A12340ULL;
+    for (auto &entry: table) {
+        state += 0x9E3779B97F4A7C15ULL;
+        std::uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        entry = z ^ (z >> 31);
+    }
+    return table;
+}();
+
+/**
+ * @brief Chunk size bounds of the content-defined chunker.
+ */
+constexpr std::size_t kCdcMinSize = 2 * 1024;
+constexpr std::size_t kCdcAverageSize = 8 * 1024;
+constexpr std::size_t kCdcMaxSize = 64 * 1024;
+
+/**
+ * Finds the length of the next content-defined chunk with FastCDC.
+ *
+ * A gear rolling hash is tested against a stricter mask before the average size and a
+ * looser one after it (normalized chunking), which keeps chunk sizes close to the average
+ * while boundaries still depend only on local content. An edit therefore only changes
+ * the chunks around it.
+ *
+ * @param data The remaining bytes.
+ * @param size The number of remaining bytes.
+ * @return The length of the next chunk.
+ */
+[[nodiscard]] std::size_t nextCdcChunk(const std::uint8_t *data, const std::size_t size) {
+    constexpr std::uint64_t strictMask = 0x0003590703530000ULL;
+    constexpr std::uint64_t looseMask = 0x0000D90003530000ULL;
+    if (size <= kCdcMinSize)
+        return size;
+    const std::size_t limit = std::min(size, kCdcMaxSize);
+    const std::size_t normal = std::min(limit, kCdcAverageSize);
+    std::uint64_t fingerprint = 0;
+    std::size_t i = kCdcMinSize;
+    for (; i < normal; ++i) {
+        fingerprint = (fingerprint << 1) + kGearTable[data[i]];
+        if ((fingerprint & strictMask) == 0)
+            return i + 1;
+    }
+    for (; i < limit; ++i) {
+        fingerprint = (fingerprint << 1) + kGearTable[data[i]];
+        if ((fingerprint & looseMask) == 0)
+            return i + 1;
+    }
+    return limit;
+}
+
+/**
+ * @brief Header of an image recipe in the chunk store.
+ *
+ * Followed by `count` RecipeEntry records listing the chunks in image order.
+ */
+struct RecipeHeader {
+    char magic[8] = {'W', '3', 'R', 'C', 'P', '0', '0', '1'};
+    Digest image{};
+    std::uint64_t size = 0;
+    std::uint64_t count = 0;
+};
+
+/**
+ * @brief One chunk of an image recipe.
+ */
+struct RecipeEntry {
+    Digest chunk{};
+    std::uint32_t length = 0;
+    std::uint32_t reserved = 0;
+};
+
+static_assert(sizeof(RecipeHeader) == 56 && sizeof(RecipeEntry) == 40);
+
+/**
+ * Returns the path of a chunk in the store, fanned out by the first digest byte.
+ *
+ * @param store The store directory.
+ * @param chunk The chunk digest.
+ * @return The chunk file path.
+ */
+[[nodiscard]] fs::path chunkPath(const fs::path &store, const Digest &chunk) {
+    const std::string hex = toHex(chunk);
+    return store / "chunks" / hex.substr(0, 2) / hex;
+}
+
+/**
+ * Writes a file atomically by writing a temporary sibling and renaming it into place.
+ *
+ * @param path The destination.
+ * @param data The contents.
+ * @param size The number of bytes.
+ * @return true if the file was written, false otherwise.
+ */
+[[nodiscard]] bool writeFileAtomically(const fs::path &path, const std::uint8_t *data, const std::size_t size) {
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    const fs::path tempPath = path.string() + ".tmp" + std::to_string(std::hash<std::thread::id>{}(
+                                                           std::this_thread::get_id()));
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(size));
+        if (!file) {
+            fs::remove(tempPath, ec);
+            std::cerr << "Failed to write " << path.string() << ".\n";
+            return false;
+        }
+    }
+    fs::rename(tempPath, path, ec);
+    if (ec)
+        std::cerr << "Failed to write " << path.string() << ": " << ec.message() << "\n";
+    return !ec;
+}
+
+/**
+ * Adds an image to the chunk store.
+ *
+ * The image is split with the content-defined chunker; chunks already present are
+ * reused and only new ones are written. The recipe is stored under the image digest.
+ *
+ * @param store The store directory.
+ * @param filepath The image to add.
+ * @param storedBytes Incremented by the number of bytes of newly written chunks.
+ * @return The image digest, or an empty std::optional on errors.
+ */
+[[nodiscard]] std::optional<Digest> putIntoChunkStore(const fs::path &store, const std::string &filepath,
+                                                      std::uint64_t &storedBytes) {
+    const MappedFile file(filepath);
+    if (!file.valid()) {
+        std::cerr << "Failed to map " << filepath << ".\n";
+        return std::nullopt;
+    }
+    TreeHasher tree;
+    std::vector<RecipeEntry> entries;
+    for (std::size_t offset = 0; offset < file.size();) {
+        const std::size_t length = nextCdcChunk(file.data() + offset, file.size() - offset);
+        Sha256 sha;
+        sha.update(file.data() + offset, length);
+        const RecipeEntry entry{sha.finish(), static_cast<std::uint32_t>(length), 0};
+        if (const fs::path path = chunkPath(store, entry.chunk); !fs::exists(path)) {
+            if (!writeFileAtomically(path, file.data() + offset, length))
+                return std::nullopt;
+            storedBytes += length;
+        }
+        tree.update(file.data() + offset, length);
+        entries.push_back(entry);
+        offset += length;
+    }
+
+    RecipeHeader header;
+    header.image = combineLeaves(tree.finish());
+    header.size = file.size();
+    header.count = entries.size();
+    std::vector<std::uint8_t> recipe(sizeof(header) + entries.size() * sizeof(RecipeEntry));
+    std::memcpy(recipe.data(), &header, sizeof(header));
+    std::memcpy(recipe.data() + sizeof(header), entries.data(), entries.size() * sizeof(RecipeEntry));
+    if (!writeFileAtomically(store / "recipes" / (toHex(header.image) + ".recipe"), recipe.data(), recipe.size()))
+        return std::nullopt;
+    return header.image;
+}
+
+/**
+ * Reassembles an image from the chunk store and verifies it against its digest.
+ *
+ * @param store The store directory.
+ * @param digestHex The hexadecimal image digest the recipe is stored under.
+ * @param outputPath Where to write the image; it is replaced atomically.
+ * @return true if the image was restored and verified, false otherwise.
+ */
+[[nodiscard]] bool getFromChunkStore(const fs::path &store, const std::string &digestHex,
+                                     const std::string &outputPath) {
+    const MappedFile recipe(store / "recipes" / (digestHex + ".recipe"));
+    RecipeHeader header;
+    if (!recipe.valid() || recipe.size() < sizeof(header)) {
+        std::cerr << "No recipe for " << digestHex << " in " << store.string() << ".\n";
+        return false;
+    }
+    std::memcpy(&header, recipe.data(), sizeof(header));
+    if (std::memcmp(header.magic, "W3RCP001", sizeof(header.magic)) != 0 ||
+        (recipe.size() - sizeof(header)) / sizeof(RecipeEntry) < header.count) {
+        std::cerr << "Recipe for " << digestHex << " is damaged.\n";
+        return false;
+    }
+
+    const auto tempName = createTempSibling(outputPath, "restore");
+    if (!tempName)
+        return false;
+    const std::string &tempPath = *tempName;
+    std::ofstream output(tempPath, std::ios::binary | std::ios::trunc);
+    TreeHasher tree;
+    for (std::uint64_t i = 0; i < header.count; ++i) {
+        RecipeEntry entry;
+        std::memcpy(&entry, recipe.data() + sizeof(header) + i * sizeof(RecipeEntry), sizeof(entry));
+        const MappedFile chunk(chunkPath(store, entry.chunk));
+        if (!chunk.valid() || chunk.size() != entry.length) {
+            std::cerr << "Chunk " << toHex(entry.chunk) << " is missing from the store.\n";
+            output.close();
+            fs::remove(tempPath);
+            return false;
+        }
+        tree.update(chunk.data(), chunk.size());
+        output.write(reinterpret_cast<const char *>(chunk.data()), static_cast<std::streamsize>(chunk.size()));
+    }
+    output.close();
+    std::error_code ec;
+    if (!output || combineLeaves(tree.finish()) != header.image) {
+        std::cerr << "Restored image does not match " << digestHex << ".\n";
+        fs::remove(tempPath, ec);
+        return false;
+    }
+    fs::rename(tempPath, outputPath, ec);
+    if (ec) {
+        std::cerr << "Failed to replace " << outputPath << ": " << ec.message() << "\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Adds images to, or restores one from, the content-defined chunk store.
+ *
+ * `--store-put` splits each image into content-defined chunks and stores only the chunks
+ * the store does not have yet, so near-identical repacks cost just their differing chunks.
+ * `--store-get` reassembles an image from its recipe and verifies its digest. A patch run
+ * with `--backup-store` deposits every backup it makes, and `--rollback --backup-store`
+ * reassembles a missing or damaged backup from the store by its recorded digest.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments: `--store-put <store> <path or @list>...` or
+ *             `--store-get <store> <digest> <output>`.
+ * @return `EXIT_SUCCESS` on success, `EXIT_FAILURE` otherwise.
+ */
+int runChunkStore(const int argc, char **argv) {
+    const std::string_view mode = argv[1];
+    if (mode == "--store-get") {
+        if (argc != 5) {
+            std::cerr << "Usage: " << argv[0] << " --store-get <store> <digest> <output>\n";
+            return EXIT_FAILURE;
+        }
+        if (!getFromChunkStore(argv[2], argv[3], argv[4]))
+            return EXIT_FAILURE;
+        std::cout << "Restored " << argv[4] << " from " << argv[2] << ".\n";
+        return EXIT_SUCCESS;
+    }
+
+    const auto paths = argc >= 4 ? expandPathArguments(argv + 3, argv + argc) : std::nullopt;
+    if (!paths) {
+        std::cerr << "Usage: " << argv[0] << " --store-put <store> <path or @list>...\n";
+        return EXIT_FAILURE;
+    }
+    for (const auto &path: *paths) {
+        std::uint64_t storedBytes = 0;
+        const auto digest = putIntoChunkStore(argv[2], path, storedBytes);
+        if (!digest)
+            return EXIT_FAILURE;
+        std::cout << toHex(*digest) << "  " << path << " (" << storedBytes << " new bytes)\n";
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief The block size of delta sync signatures.
+ *
+ * One page: a 7.7 MB image has about 1,900 blocks, so its signature is under 40 KB,
+ * and a one-byte patch rewrites a single page of the destination.
+ */
+constexpr std::size_t kSyncBlockSize = 4096;
+
+/**
+ * @brief The rsync weak checksum of a window, maintained as the window slides.
+ */
+struct RollingChecksum {
+    std::uint32_t a = 0;
+    std::uint32_t b = 0;
+    std::size_t length = 0;
+
+    /**
+     * Initializes the checksum over a window.
+     */
+    void reset(const std::uint8_t *data, const std::size_t size) {
+        a = b = 0;
+        length = size;
+        for (std::size_t i = 0; i < size; ++i) {
+            a += data[i];
+            b += static_cast<std::uint32_t>(size - i) * data[i];
+        }
+    }
+
+    /**
+     * Slides the window one byte forward.
+     */
+    void roll(const std::uint8_t out, const std::uint8_t in) {
+        a += static_cast<std::uint32_t>(in) - out;
+        b += a - static_cast<std::uint32_t>(length) * out;
+    }
+
+    [[nodiscard]] std::uint32_t value() const { return (a & 0xFFFF) | (b << 16); }
+};
+
+/**
+ * @brief The signature of one destination block: weak rolling checksum plus strong hash.
+ */
+struct BlockSignature {
+    std::uint32_t weak = 0;
+    std::array<std::uint8_t, 16> strong{};
+};
+
+/**
+ * Computes the strong hash of a block (SHA-256 truncated to 128 bits).
+ */
+[[nodiscard]] std::array<std::uint8_t, 16> strongBlockHash(const std::uint8_t *data, const std::size_t size) {
+    Sha256 sha;
+    sha.update(data, size);
+    const Digest digest = sha.finish();
+    std::array<std::uint8_t, 16> strong{};
+    std::copy_n(digest.begin(), strong.size(), strong.begin());
+    return strong;
+}
+
+/**
+ * Computes the signature of every full block of an image, in parallel across cores.
+ *
+ * @param data The image bytes.
+ * @param size The image size.
+ * @return One signature per full block; a trailing partial block is not included.
+ */
+[[nodiscard]] std::vector<BlockSignature> computeBlockSignatures(const std::uint8_t *data, const std::size_t size) {
+    std::vector<BlockSignature> signatures(size / kSyncBlockSize);
+    parallelFor(signatures.size(), [&](const std::size_t begin, const std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            RollingChecksum weak;
+            weak.reset(data + i * kSyncBlockSize, kSyncBlockSize);
+            signatures[i] = {weak.value(), strongBlockHash(data + i * kSyncBlockSize, kSyncBlockSize)};
+        }
+    });
+    return signatures;
+}
+
+/**
+ * @brief One instruction for rebuilding the destination: reuse one of its blocks or take source bytes.
+ */
+struct SyncOp {
+    std::uint64_t offset = 0;
+    std::uint64_t length = 0;
+    std::optional<std::uint64_t> reuse;
+};
+
+/**
+ * Computes the delta that turns the destination into the source.
+ *
+ * Source blocks at aligned offsets are first compared with the destination block at the
+ * same offset, in parallel. Only the runs that differ are then scanned with the rolling
+ * checksum, which finds destination blocks that moved, e.g. in an older repack.
+ *
+ * @param source The source image.
+ * @param sourceSize The source size.
+ * @param signatures The block signatures of the destination.
+ * @return The ops in source order; ops that reuse a block at its own offset need no I/O.
+ */
+[[nodiscard]] std::vector<SyncOp> computeSyncDelta(const std::uint8_t *source, const std::size_t sourceSize,
+                                                   const std::vector<BlockSignature> &signatures) {
+    const std::size_t alignedBlocks = std::min(sourceSize / kSyncBlockSize, signatures.size());
+    std::vector<std::uint8_t> same(alignedBlocks, 0);
+    parallelFor(alignedBlocks, [&](const std::size_t begin, const std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            const std::uint8_t *block = source + i * kSyncBlockSize;
+            RollingChecksum weak;
+            weak.reset(block, kSyncBlockSize);
+            same[i] = weak.value() == signatures[i].weak &&
+                      strongBlockHash(block, kSyncBlockSize) == signatures[i].strong;
+        }
+    });
+
+    std::multimap<std::uint32_t, std::size_t> byWeak;
+    for (std::size_t i = 0; i < signatures.size(); ++i)
+        byWeak.emplace(signatures[i].weak, i);
+
+    std::vector<SyncOp> ops;
+    const auto literal = [&](const std::uint64_t offset, const std::uint64_t length) {
+        if (length == 0)
+            return;
+        if (!ops.empty() && !ops.back().reuse && ops.back().offset + ops.back().length == offset)
+            ops.back().length += length;
+        else
+            ops.push_back({offset, length, std::nullopt});
+    };
+
+    std::size_t pos = 0;
+    while (pos < sourceSize) {
+        if (pos % kSyncBlockSize == 0 && pos / kSyncBlockSize < alignedBlocks && same[pos / kSyncBlockSize]) {
+            ops.push_back({pos, kSyncBlockSize, pos});
+            pos += kSyncBlockSize;
+            continue;
+        }
+        // Rolling search up to the next aligned block that is known to match.
+        std::size_t regionEnd = (pos / kSyncBlockSize + 1) * kSyncBlockSize;
+        while (regionEnd / kSyncBlockSize < alignedBlocks && !same[regionEnd / kSyncBlockSize])
+            regionEnd += kSyncBlockSize;
+        regionEnd = std::min(regionEnd, sourceSize);
+
+        std::size_t literalStart = pos;
+        RollingChecksum weak;
+        bool primed = false;
+        while (pos + kSyncBlockSize <= regionEnd) {
+            if (!primed) {
+                weak.reset(source + pos, kSyncBlockSize);
+                primed = true;
+            }
+            std::optional<std::size_t> match;
+            for (auto [it, end] = byWeak.equal_range(weak.value()); it != end && !match; ++it) {
+                if (strongBlockHash(source + pos, kSyncBlockSize) == signatures[it->second].strong)
+                    match = it->second;
+            }
+            if (match) {
+                literal(literalStart, pos - literalStart);
+                ops.push_back({pos, kSyncBlockSize, *match * kSyncBlockSize});
+                pos += kSyncBlockSize;
+                literalStart = pos;
+                primed = false;
+                continue;
+            }
+            if (pos + kSyncBlockSize < regionEnd)
+                weak.roll(source[pos], source[pos + kSyncBlockSize]);
+            ++pos;
+        }
+        literal(literalStart, regionEnd - literalStart);
+        pos = regionEnd;
+    }
+    return ops;
+}
+
+/**
+ * Brings one destination up to date with the source using the rsync algorithm.
+ *
+ * When every reused block stays at its offset, only the differing bytes are written
+ * in place. Otherwise the destination is rebuilt into a temporary file from its own
+ * blocks and the source's literal bytes, flushed, given the original's owner, mode and
+ * extended attributes, and renamed over it, as patchFused() replaces an executable. A new
+ * destination is written the same way and takes the source's mode.
+ *
+ * @param sourcePath The source image's path.
+ * @param source The mapped source image.
+ * @param destPath The destination path.
+ * @param written Set to the number of bytes written to the destination.
+ * @return true if the destination now equals the source, false otherwise.
+ */
+[[nodiscard]] bool syncDestination(const std::string &sourcePath, const MappedFile &source, const std::string &destPath,
+                                   std::uint64_t &written) {
+    written = 0;
+    // Writes a flushed temporary sibling and renames it over the destination.
+    const auto replace = [&](const std::uint8_t *data, const std::size_t size, const bool existing) {
+        std::error_code ec;
+        fs::create_directories(fs::path(destPath).parent_path(), ec);
+        const auto tempName = createTempSibling(destPath, "sync");
+        if (!tempName)
+            return false;
+        std::ofstream file(*tempName, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(size));
+        file.close();
+        if (!file)
+            std::cerr << "Failed to write " << *tempName << ".\n";
+        if (!existing)
+            fs::permissions(*tempName, fs::status(sourcePath, ec).permissions(), ec);
+        if (!file || ec || !syncFile(*tempName) || (existing && !copyFileMetadata(destPath, *tempName))) {
+            fs::remove(*tempName, ec);
+            return false;
+        }
+        fs::rename(*tempName, destPath, ec);
+        if (ec) {
+            std::cerr << "Failed to replace " << destPath << ": " << ec.message() << "\n";
+            fs::remove(*tempName, ec);
+            return false;
+        }
+        written = size;
+        return syncDirectory(destPath);
+    };
+    if (!fs::exists(destPath))
+        return replace(source.data(), source.size(), false);
+    const MappedFile dest(destPath);
+    if (!dest.valid()) {
+        std::cerr << "Failed to map " << destPath << ".\n";
+        return false;
+    }
+    const auto signatures = computeBlockSignatures(dest.data(), dest.size());
+    const auto ops = computeSyncDelta(source.data(), source.size(), signatures);
+
+    const bool inPlace = source.size() == dest.size() &&
+                         std::ranges::all_of(ops, [](const SyncOp &op) { return !op.reuse || *op.reuse == op.offset; });
+    if (inPlace) {
+        std::fstream stream(destPath, std::ios::in | std::ios::out | std::ios::binary);
+        for (const auto &op: ops) {
+            // Literal ranges are block-granular; only the bytes that really differ are written.
+            for (std::uint64_t at = op.offset; !op.reuse && at < op.offset + op.length;) {
+                if (source.data()[at] == dest.data()[at]) {
+                    ++at;
+                    continue;
+                }
+                std::uint64_t end = at;
+                while (end < op.offset + op.length && source.data()[end] != dest.data()[end])
+                    ++end;
+                stream.seekp(static_cast<std::streamoff>(at));
+                stream.write(reinterpret_cast<const char *>(source.data() + at), static_cast<std::streamsize>(end - at));
+                written += end - at;
+                at = end;
+            }
+        }
+        stream.close();
+        if (!stream) {
+            std::cerr << "Failed to update " << destPath << " in place.\n";
+            return false;
+        }
+        return syncFile(destPath);
+    }
+
+    std::vector<std::uint8_t> rebuilt;
+    rebuilt.reserve(source.size());
+    for (const auto &op: ops) {
+        const std::uint8_t *from = op.reuse ? dest.data() + *op.reuse : source.data() + op.offset;
+        rebuilt.insert(rebuilt.end(), from, from + op.length);
+    }
+    return replace(rebuilt.data(), rebuilt.size(), true);
+}
+
+/**
+ * @brief Mirrors a golden executable to other locations, writing only the blocks that differ.
+ *
+ * Each destination's block signatures are computed in parallel, the source is matched
+ * against them, and only differing ranges are written. A destination that is an older
+ * patched or unpatched copy therefore only has its patched regions rewritten. Every
+ * destination is verified against the source digest afterwards.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments: `--sync <source> <destination or @list>...`.
+ * @return `EXIT_SUCCESS` if every destination matches the source, `EXIT_FAILURE` otherwise.
+ */
+int runSync(const int argc, char **argv) {
+    const auto destinations = argc >= 4 ? expandPathArguments(argv + 3, argv + argc) : std::nullopt;
+    if (!destinations) {
+        std::cerr << "Usage: " << argv[0] << " --sync <source> <destination or @list>...\n";
+        return EXIT_FAILURE;
+    }
+    const MappedFile source(argv[2]);
+    const auto sourceLeaves = loadImageLeaves(argv[2]);
+    if (!source.valid() || !sourceLeaves) {
+        std::cerr << "Failed to read sync source " << argv[2] << ".\n";
+        return EXIT_FAILURE;
+    }
+    const Digest expected = combineLeaves(*sourceLeaves);
+
+    bool success = true;
+    for (const auto &dest: *destinations) {
+        std::uint64_t written = 0;
+        const bool synced = syncDestination(argv[2], source, dest, written);
+        const auto leaves = synced ? computeImageLeaves(dest) : std::nullopt;
+        if (!leaves || combineLeaves(*leaves) != expected) {
+            std::cerr << dest << ": sync failed.\n";
+            success = false;
+            continue;
+        }
+        storeImageLeaves(dest, *leaves);
+        std::cout << dest << ": " << written << " bytes written.\n";
+    }
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief How runRollback puts the original executable back.
+ */
+enum class RestoreMethod {
+    /** Pick per file: rename-over, or reflink then sparse rewrite when the backup is kept. */
+    Auto,
+    /** Atomically rename the backup over the executable; the backup is consumed. */
+    Rename,
+    /** Clone the backup's extents into a temporary file and rename it over the executable. */
+    Reflink,
+    /** Copy back only the bytes the patch table overwrote, in place. */
+    Rewrite,
+};
+
+/**
+ * Restores an executable by cloning its backup with FICLONE into a temporary file.
+ *
+ * @param wowPath The executable.
+ * @param backupPath Its backup.
+ * @return true if the clone replaced the executable, false if reflinks are unavailable or failed.
+ */
+[[nodiscard]] bool restoreByReflink(const std::string &wowPath, const std::string &backupPath) {
+#if defined(__linux__)
+    const auto tempName = createTempSibling(wowPath, "restore");
+    if (!tempName)
+        return false;
+    const std::string &tempPath = *tempName;
+    const int source = open(backupPath.c_str(), O_RDONLY | O_CLOEXEC);
+    const int target = open(tempPath.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+    const bool cloned = source >= 0 && target >= 0 && ioctl(target, FICLONE, source) == 0 && fsync(target) == 0;
+    if (source >= 0)
+        close(source);
+    if (target >= 0)
+        close(target);
+    std::error_code ec;
+    if (cloned && copyFileMetadata(wowPath, tempPath)) {
+        fs::rename(tempPath, wowPath, ec);
+        if (!ec && syncDirectory(wowPath))
+            return true;
+    }
+    fs::remove(tempPath, ec);
+    return false;
+#else
+    (void) wowPath;
+    (void) backupPath;
+    return false;
+#endif
+}
+
+/**
+ * Restores an executable by writing back the original bytes of every patched range from its backup.
+ *
+ * An image grown by injectImage also has rewritten headers and trampolines the table does
+ * not know about, so there every block that differs from the backup is copied back and
+ * the appended section is cut off.
+ *
+ * @param wowPath The executable.
+ * @param backupPath Its backup.
+ * @param table The patch table whose ranges are restored.
+ * @return true if every range was rewritten and flushed, false otherwise.
+ */
+[[nodiscard]] bool restoreByRewrite(const std::string &wowPath, const std::string &backupPath,
+                                    const PatchTable &table) {
+    std::error_code ec;
+    const auto size = fs::file_size(wowPath, ec);
+    if (!ec && isInjectedImage(wowPath, static_cast<std::streamoff>(size))) {
+        const auto current = readWholeFile(wowPath);
+        const auto original = readWholeFile(backupPath);
+        if (!current || !original || current->size() < original->size())
+            return false;
+        std::fstream stream(wowPath, std::ios::in | std::ios::out | std::ios::binary);
+        for (std::size_t at = 0; at < original->size() && stream; at += kHashChunkSize) {
+            const std::size_t length = std::min(kHashChunkSize, original->size() - at);
+            if (std::memcmp(current->data() + at, original->data() + at, length) == 0)
+                continue;
+            stream.seekp(static_cast<std::streamoff>(at));
+            stream.write(reinterpret_cast<const char *>(original->data() + at), static_cast<std::streamsize>(length));
+        }
+        stream.close();
+        if (stream)
+            fs::resize_file(wowPath, original->size(), ec);
+        return stream && !ec && syncFile(wowPath);
+    }
+
+    std::fstream stream(wowPath, std::ios::in | std::ios::out | std::ios::binary);
+    for (const auto &[name, pos, data, after]: table) {
+        const auto original = readBytesAt(backupPath, pos, data.size());
+        if (!original || !stream)
+            return false;
+        writeBytesAt(pos, *original, stream);
+    }
+    stream.close();
+    return stream && syncFile(wowPath);
+}
+
+/**
+ * Rolls one executable back to its backup and verifies it against the recorded pre-patch digest.
+ *
+ * @param wowPath The executable.
+ * @param backupPath Its backup; only `<wowPath>.backup` can be renamed into place.
+ * @param table The patch table, used by the sparse rewrite.
+ * @param method The restore method.
+ * @param store The chunk store to reassemble a missing or damaged backup from, if any.
+ * @return true if the executable now has the recorded pre-patch digest, false otherwise.
+ */
+[[nodiscard]] bool rollbackExecutable(const std::string &wowPath, const std::string &backupPath,
+                                      const PatchTable &table, const RestoreMethod method,
+                                      const std::optional<fs::path> &store) {
+    const auto recorded = readBackupDigest(backupPath);
+    if (!recorded) {
+        std::cerr << wowPath << ": no recorded pre-patch digest, refusing to roll back.\n";
+        return false;
+    }
+    // Hashed afresh: the leaf cache is keyed by size and mtime, which do not prove the bytes.
+    PATCHER_PROBE(verify__start, backupPath.c_str());
+    auto backupLeaves = computeImageLeaves(backupPath);
+    bool backupIntact = backupLeaves && combineLeaves(*backupLeaves) == *recorded;
+    if (!backupIntact && store && getFromChunkStore(*store, toHex(*recorded), backupPath)) {
+        std::cout << wowPath << ": backup reassembled from " << store->string() << ".\n";
+        backupLeaves = computeImageLeaves(backupPath);
+        backupIntact = backupLeaves && combineLeaves(*backupLeaves) == *recorded;
+    }
+    PATCHER_PROBE(verify__done, backupPath.c_str(), backupIntact ? 0 : -1);
+    if (!backupIntact) {
+        std::cerr << wowPath << ": backup is missing or does not match the recorded digest.\n";
+        return false;
+    }
+
+    if (method == RestoreMethod::Rename || method == RestoreMethod::Auto) {
+        if (!restoreBackup(wowPath))
+            return false;
+        std::error_code ec;
+        fs::remove(backupPath + ".digest", ec);
+    } else if (!(method == RestoreMethod::Reflink && restoreByReflink(wowPath, backupPath)) &&
+               !restoreByRewrite(wowPath, backupPath, table)) {
+        std::cerr << wowPath << ": failed to rewrite original bytes.\n";
+        return false;
+    }
+    PATCHER_PROBE(verify__start, wowPath.c_str());
+    const auto restored = computeImageLeaves(wowPath);
+    const bool matches = restored && combineLeaves(*restored) == *recorded;
+    PATCHER_PROBE(verify__done, wowPath.c_str(), matches ? 0 : -1);
+    if (!matches) {
+        std::cerr << wowPath << ": restored file does not match the recorded digest.\n";
+        return false;
+    }
+    storeImageLeaves(wowPath, *restored);
+    return true;
+}
+
+[[nodiscard]] std::optional<fs::path> resolveLowerPath(const fs::path &path);
+
+/**
+ * Returns where the backup of a lower-layer file is kept: in cacheDirectory(), named
+ * after the file's path, since a file next to it would appear in every container that
+ * stacks the layer.
+ *
+ * @param lowerPath The lower-layer file.
+ * @return The backup path.
+ */
+[[nodiscard]] fs::path lowerBackupPath(const fs::path &lowerPath) {
+    std::error_code ec;
+    const std::string absolute = fs::absolute(lowerPath, ec).lexically_normal().string();
+    Sha256 sha;
+    sha.update(reinterpret_cast<const std::uint8_t *>(absolute.data()), absolute.size());
+    return cacheDirectory() / "lower-backups" /
+           (toHex(sha.finish()).substr(0, 16) + "-" + lowerPath.filename().string() + ".backup");
+}
+
+/**
+ * @brief Rolls a batch of executables back to their backups in parallel.
+ *
+ * Takes the same paths as a batch patch run. Each backup is first hashed and checked
+ * against the pre-patch digest recorded when it was made. By default the backup is then
+ * renamed over the executable, which is atomic and O(1). With `--keep-backup` the backup
+ * stays: its extents are reflinked into place where the filesystem supports it, otherwise
+ * only the patched ranges are rewritten in place. Whatever the method, the restored file
+ * is hashed and verified as well. With `--backup-store` a backup that is missing or does
+ * not match is first reassembled from that chunk store (see runChunkStore). `--lower`
+ * restores the lower-layer file behind an overlayfs path from the backup a `--lower`
+ * patch run kept in the cache directory (see lowerBackupPath), rewriting it in place so
+ * the shared file keeps its inode.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments:
+ *             `--rollback [--jobs <n>|auto] [--report <file>] [--report-format json|columnar] [--keep-backup]
+ *             [--method <method>] [--backup-store <store>] [--lower] <path or @list>...`.
+ * @return `EXIT_SUCCESS` if every executable was restored and verified, `EXIT_FAILURE` otherwise.
+ */
+int runRollback(const int argc, char **argv) {
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    RestoreMethod method = RestoreMethod::Auto;
+    bool keepBackup = false;
+    std::optional<std::string> reportPath;
+    ReportFormat reportFormat = ReportFormat::Json;
+    std::optional<fs::path> backupStore;
+    bool restoreLower = false;
+    std::vector<char *> inputs;
+    for (int i = 2; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--jobs" && i + 1 < argc) {
+            const auto count = parseJobCount(argv[++i]);
+            if (!count)
+                return EXIT_FAILURE;
+            jobs = *count;
+        } else if (arg == "--report" && i + 1 < argc) {
+            reportPath = argv[++i];
+        } else if (arg == "--report-format" && i + 1 < argc) {
+            const auto parsed = parseReportFormat(argv[++i]);
+            if (!parsed)
+                return EXIT_FAILURE;
+            reportFormat = *parsed;
+        } else if (arg == "--keep-backup") {
+            keepBackup = true;
+        } else if (arg == "--backup-store" && i + 1 < argc) {
+            backupStore = argv[++i];
+        } else if (arg == "--lower") {
+            restoreLower = true;
+        } else if (arg == "--method" && i + 1 < argc) {
+            const std::string_view name = argv[++i];
+            if (name == "rename")
+                method = RestoreMethod::Rename;
+            else if (name == "reflink")
+                method = RestoreMethod::Reflink;
+            else if (name == "rewrite")
+                method = RestoreMethod::Rewrite;
+            else if (name != "auto") {
+                std::cerr << "Unknown restore method: " << name << " (expected auto, rename, reflink or rewrite)\n";
+                return EXIT_FAILURE;
+            }
+        } else {
+            inputs.push_back(argv[i]);
+        }
+    }
+    if (restoreLower && method != RestoreMethod::Auto && method != RestoreMethod::Rewrite) {
+        std::cerr << "--lower restores the shared file in place and only supports --method rewrite.\n";
+        return EXIT_FAILURE;
+    }
+    if (restoreLower)
+        method = RestoreMethod::Rewrite;
+    if (keepBackup && method == RestoreMethod::Auto)
+        method = RestoreMethod::Reflink;
+    if (keepBackup && method == RestoreMethod::Rename) {
+        std::cerr << "--keep-backup cannot be combined with --method rename.\n";
+        return EXIT_FAILURE;
+    }
+    auto paths = expandPathArguments(inputs.data(), inputs.data() + inputs.size());
+    if (!paths || paths->empty()) {
+        std::cerr << "Usage: " << argv[0]
+                << " --rollback [--jobs <n>|auto] [--report <file>] [--report-format json|columnar]"
+                << " [--keep-backup] [--method <method>] [--backup-store <store>] [--lower]"
+                << " <path or @list>...\n";
+        return EXIT_FAILURE;
+    }
+    for (auto &path: *paths) {
+        if (!restoreLower)
+            continue;
+        const auto lower = resolveLowerPath(path);
+        if (!lower)
+            return EXIT_FAILURE;
+        path = lower->string();
+    }
+    const auto backupOf = [&](const std::string &path) {
+        return restoreLower ? lowerBackupPath(path).string() : path + ".backup";
+    };
+
+    const PatchTable table = buildPatchTable();
+    const auto report = runBatch(*paths, jobs, [&](const std::string &path, JobResult &result) {
+        const std::string backupPath = backupOf(path);
+        if (const auto recorded = readBackupDigest(backupPath))
+            result.digest = *recorded;
+        PhaseClock clock(&result.phases);
+        clock.enter(Phase::Commit);
+        PATCHER_PROBE(file__start, path.c_str());
+        const bool restored = rollbackExecutable(path, backupPath, table, method, backupStore);
+        PATCHER_PROBE(file__done, path.c_str(), restored ? 0 : -1);
+        std::error_code ec;
+        result.size = fs::file_size(path, ec);
+        return restored;
+    });
+    const std::size_t failures = report.failures();
+    std::cout << "Rolled back " << paths->size() - failures << " of " << paths->size() << " executable(s).\n";
+    if (reportPath && !writeRunReport(*reportPath, report, reportFormat))
+        return EXIT_FAILURE;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief Where a path on an overlayfs mount comes from.
+ */
+struct OverlayLocation {
+    /** The path relative to the overlay's mount point. */
+    fs::path relative;
+    /** The lower layers, topmost first. */
+    std::vector<fs::path> lowerDirs;
+    /** The writable layer, if the overlay has one. */
+    std::optional<fs::path> upperDir;
+};
+
+/**
+ * Undoes the octal escaping of spaces, tabs, newlines and backslashes in /proc/self/mountinfo.
+ *
+ * @param field The escaped field.
+ * @return The field as the kernel saw it.
+ */
+[[nodiscard]] std::string unescapeMountField(const std::string_view field) {
+    std::string out;
+    for (std::size_t i = 0; i < field.size(); ++i) {
+        if (field[i] == '\\' && i + 3 < field.size() &&
+            std::ranges::all_of(field.substr(i + 1, 3), [](const char c) { return c >= '0' && c <= '7'; })) {
+            out += static_cast<char>((field[i + 1] - '0') * 64 + (field[i + 2] - '0') * 8 + (field[i + 3] - '0'));
+            i += 3;
+        } else {
+            out += field[i];
+        }
+    }
+    return out;
+}
+
+/**
+ * Finds the overlayfs mount a path lives on and its layers.
+ *
+ * The layers are read from the mount's `lowerdir=` and `upperdir=` options in
+ * /proc/self/mountinfo. They name directories as the process that mounted the overlay saw
+ * them, which inside a container are usually host paths.
+ *
+ * @param path The path.
+ * @return Its location, or an empty std::optional if it is not on overlayfs (or the
+ *         platform has no overlayfs).
+ */
+[[nodiscard]] std::optional<OverlayLocation> findOverlay(const fs::path &path) {
+#if defined(__linux__)
+    constexpr decltype(statfs::f_type) kOverlayMagic = 0x794c7630;
+    struct statfs info {};
+    if (statfs(path.c_str(), &info) != 0 || info.f_type != kOverlayMagic)
+        return std::nullopt;
+
+    std::error_code ec;
+    const fs::path canonical = fs::canonical(path, ec);
+    std::ifstream mountinfo("/proc/self/mountinfo");
+    if (ec || !mountinfo)
+        return std::nullopt;
+
+    // The deepest overlay mount point above the path is the one that holds it.
+    std::optional<OverlayLocation> best;
+    std::size_t bestDepth = 0;
+    for (std::string line; std::getline(mountinfo, line);) {
+        std::istringstream fields(line);
+        std::string id, parent, device, root, mountPoint, options, field;
+        fields >> id >> parent >> device >> root >> mountPoint >> options;
+        while (fields >> field && field != "-") {
+        }
+        std::string type, source, superOptions;
+        fields >> type >> source >> superOptions;
+        if (type != "overlay")
+            continue;
+
+        const fs::path mount = unescapeMountField(mountPoint);
+        const auto relative = canonical.lexically_relative(mount);
+        if (relative.empty() || *relative.begin() == "..")
+            continue;
+        const std::size_t depth = static_cast<std::size_t>(std::distance(mount.begin(), mount.end()));
+        if (best && depth < bestDepth)
+            continue;
+
+        OverlayLocation location{relative == "." ? fs::path{} : relative, {}, std::nullopt};
+        // Options are separated by commas and lower layers by colons; both may be escaped.
+        const auto option = [&](const std::string_view key) -> std::optional<std::string> {
+            for (std::size_t at = 0; at < superOptions.size();) {
+                std::size_t end = at;
+                while (end < superOptions.size() &&
+                       (superOptions[end] != ',' || (end > at && superOptions[end - 1] == '\\')))
+                    ++end;
+                const std::string_view item = std::string_view(superOptions).substr(at, end - at);
+                if (item.starts_with(key) && item.size() > key.size() && item[key.size()] == '=')
+                    return std::string(item.substr(key.size() + 1));
+                at = end + 1;
+            }
+            return std::nullopt;
+        };
+        if (const auto lower = option("lowerdir")) {
+            std::string layer;
+            for (std::size_t i = 0; i < lower->size(); ++i) {
+                if ((*lower)[i] == '\\' && i + 1 < lower->size() && (*lower)[i + 1] == ':') {
+                    layer += ':';
+                    ++i;
+                } else if ((*lower)[i] == ':') {
+                    location.lowerDirs.emplace_back(unescapeMountField(layer));
+                    layer.clear();
+                } else {
+                    layer += (*lower)[i];
+                }
+            }
+            if (!layer.empty())
+                location.lowerDirs.emplace_back(unescapeMountField(layer));
+        }
+        if (const auto upper = option("upperdir"))
+            location.upperDir = unescapeMountField(*upper);
+        best = std::move(location);
+        bestDepth = depth;
+    }
+    return best;
+#else
+    (void) path;
+    return std::nullopt;
+#endif
+}
+
+/**
+ * Resolves a path on an overlayfs mount to the lower-layer file that backs it.
+ *
+ * @param path The path as seen through the overlay.
+ * @return The topmost lower-layer file with that path, or an empty std::optional (with a
+ *         message) if the file was already copied up or no lower layer is reachable.
+ */
+[[nodiscard]] std::optional<fs::path> resolveLowerPath(const fs::path &path) {
+    const auto overlay = findOverlay(path);
+    if (!overlay)
+        return path;
+    std::error_code ec;
+    if (overlay->upperDir && fs::exists(*overlay->upperDir / overlay->relative, ec)) {
+        std::cerr << path.string() << " was already copied up into " << overlay->upperDir->string()
+                << "; patching the lower layer would not reach it.\n";
+        return std::nullopt;
+    }
+    for (const auto &layer: overlay->lowerDirs) {
+        if (fs::is_regular_file(layer / overlay->relative, ec))
+            return layer / overlay->relative;
+    }
+    std::cerr << "No lower layer of the overlay holding " << path.string()
+            << " is reachable from here; run with access to the image's layer directories.\n";
+    return std::nullopt;
+}
+
+/**
+ * Appends a ustar header block for one archive member.
+ *
+ * @param tar The archive.
+ * @param name The member's path, without a leading slash.
+ * @param mode The permission bits.
+ * @param uid The owning user id.
+ * @param gid The owning group id.
+ * @param size The size of the member's data.
+ * @param type The ustar type flag: `'0'` for files, `'5'` for directories.
+ * @return true if the name fit the header, false otherwise.
+ */
+[[nodiscard]] bool appendTarHeader(std::vector<std::uint8_t> &tar, std::string name, const unsigned mode,
+                                   const unsigned uid, const unsigned gid, const std::uint64_t size, const char type) {
+    std::array<char, 512> header{};
+    if (type == '5')
+        name += '/';
+    // Names longer than the name field are split at a slash into the prefix field.
+    std::string prefix;
+    if (name.size() > 100) {
+        const std::size_t slash = name.rfind('/', name.size() - (type == '5' ? 2 : 1));
+        if (slash == std::string::npos || slash > 155 || name.size() - slash - 1 > 100)
+            return false;
+        prefix = name.substr(0, slash);
+        name.erase(0, slash + 1);
+    }
+    const auto put = [&](const std::size_t offset, const std::string_view text) {
+        std::ranges::copy(text, header.begin() + static_cast<std::ptrdiff_t>(offset));
+    };
+    const auto putOctal = [&](const std::size_t offset, const std::size_t width, const std::uint64_t value) {
+        char digits[24];
+        std::snprintf(digits, sizeof(digits), "%0*llo", static_cast<int>(width - 1),
+                      static_cast<unsigned long long>(value));
+        put(offset, digits);
+    };
+    put(0, name);
+    putOctal(100, 8, mode);
+    putOctal(108, 8, uid);
+    putOctal(116, 8, gid);
+    putOctal(124, 12, size);
+    putOctal(136, 12, 0);
+    put(148, "        ");
+    header[156] = type;
+    put(257, std::string_view("ustar\0" "00", 8));
+    // Extractors map names before ids; only root's name is the same on every host.
+    if (uid == 0)
+        put(265, "root");
+    if (gid == 0)
+        put(297, "root");
+    put(345, prefix);
+    unsigned checksum = 0;
+    for (const char c: header)
+        checksum += static_cast<unsigned char>(c);
+    char digits[8];
+    std::snprintf(digits, sizeof(digits), "%06o", checksum);
+    put(148, std::string_view(digits, 7));
+    tar.insert(tar.end(), header.begin(), header.end());
+    return true;
+}
+
+/**
+ * @brief Writes a container image layer holding only the patched executable.
+ *
+ * The executable is patched in memory and written as an uncompressed tar layer
+ * (`application/vnd.oci.image.layer.v1.tar`) at its path inside the image. A directory
+ * entry in a layer replaces that directory's owner and mode in the merged view, so by
+ * default the parent directories are written with the owner and mode they have where the
+ * executable is seen, as is the executable itself. With `--layer-path` there is nothing
+ * to copy them from: the parents are left out for the base image to provide and the
+ * executable is owned by root. Timestamps are zero, so the same input, catalog and
+ * profile always give the same layer digest. The
+ * digest (`sha256:<hex>`, which is both the layer's digest and its diff ID) is printed
+ * and written next to the layer as `<layer>.digest`. Stacked on the shared base image,
+ * the layer gives every container the patched executable from one read-only file, so
+ * there is no copy-up per container and the page cache is shared.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments:
+ *             `--overlay-layer <path> <layer.tar> [--layer-path <path in image>] [--profile <profile>]`.
+ * @return `EXIT_SUCCESS` if the layer was written, `EXIT_FAILURE` otherwise.
+ */
+int runOverlayLayer(const int argc, char **argv) {
+    std::vector<std::string> positional;
+    std::optional<std::string> layerPath;
+    std::string profile = "all";
+    for (int i = 2; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--layer-path" && i + 1 < argc)
+            layerPath = argv[++i];
+        else if (arg == "--profile" && i + 1 < argc)
+            profile = argv[++i];
+        else
+            positional.emplace_back(arg);
+    }
+    if (positional.size() != 2) {
+        std::cerr << "Usage: " << argv[0]
+                << " --overlay-layer <path> <layer.tar> [--layer-path <path in image>] [--profile <profile>]\n";
+        return EXIT_FAILURE;
+    }
+    const std::string &wowPath = positional[0];
+    const fs::path outPath = positional[1];
+
+    const PatchTable table = buildPatchTable();
+    const auto selection = parseProfile(table, profile);
+    if (!selection || !validateExecutable(wowPath))
+        return EXIT_FAILURE;
+    auto image = readWholeFile(wowPath);
+    if (!image || !applyPatches(*image, table, *selection))
+        return EXIT_FAILURE;
+
+    // By default the member goes where the executable is seen from inside the container.
+    std::error_code ec;
+    const fs::path member = fs::path(layerPath.value_or(fs::absolute(wowPath, ec).string())).lexically_normal();
+    const fs::path relative = member.lexically_relative(member.root_path());
+    if (relative.empty() || *relative.begin() == "..") {
+        std::cerr << "Invalid path inside the image: " << member.string() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    const auto ownerOf = [](const fs::path &path) -> std::optional<std::pair<unsigned, unsigned> > {
+#if defined(__linux__)
+        struct stat info {};
+        if (stat(path.c_str(), &info) != 0)
+            return std::nullopt;
+        return std::pair<unsigned, unsigned>{info.st_uid, info.st_gid};
+#else
+        (void) path;
+        return std::pair<unsigned, unsigned>{0, 0};
+#endif
+    };
+    std::vector<std::uint8_t> tar;
+    fs::path directory;
+    for (auto it = relative.begin(); !layerPath && std::next(it) != relative.end(); ++it) {
+        directory /= *it;
+        const fs::path real = member.root_path() / directory;
+        const auto owner = ownerOf(real);
+        if (!owner) {
+            std::cerr << "Failed to stat " << real.string() << ".\n";
+            return EXIT_FAILURE;
+        }
+        const auto mode = static_cast<unsigned>(fs::status(real, ec).permissions() & fs::perms::mask);
+        if (!appendTarHeader(tar, directory.generic_string(), mode, owner->first, owner->second, 0, '5')) {
+            std::cerr << "Path too long for a tar layer: " << relative.string() << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+    const auto mode = static_cast<unsigned>(fs::status(wowPath, ec).permissions() & fs::perms::mask);
+    const std::pair<unsigned, unsigned> root{0, 0};
+    const auto owner = layerPath ? root : ownerOf(wowPath).value_or(root);
+    if (!appendTarHeader(tar, relative.generic_string(), mode, owner.first, owner.second, image->size(), '0')) {
+        std::cerr << "Path too long for a tar layer: " << relative.string() << "\n";
+        return EXIT_FAILURE;
+    }
+    tar.insert(tar.end(), image->begin(), image->end());
+    tar.resize((tar.size() + 511) / 512 * 512 + 1024, 0);
+
+    Sha256 sha;
+    sha.update(tar.data(), tar.size());
+    const std::string digest = "sha256:" + toHex(sha.finish());
+    const std::string digestLine = digest + "\n";
+    if (!writeFileAtomically(outPath, tar.data(), tar.size()) ||
+        !writeFileAtomically(outPath.string() + ".digest", reinterpret_cast<const std::uint8_t *>(digestLine.data()),
+                             digestLine.size()))
+        return EXIT_FAILURE;
+    std::cout << "Layer " << outPath.string() << " (" << tar.size() << " bytes, /" << relative.generic_string()
+            << "): " << digest << "\n";
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Summarizes or queries a columnar run report.
+ *
+ * The report is mapped and its record table scanned in place; paths are only read from
+ * the heap for records that match `--prefix` or are listed. The summary gives the
+ * number of jobs and failures, percentiles of the job time, the mean time per phase and
+ * the total size. `--failed` lists the paths of failed jobs, `--slowest <n>` the n
+ * slowest jobs, and `--decisions` the concurrency tuner's decisions.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments:
+ *             `--report-query <report> [--prefix <path>] [--failed] [--slowest <n>] [--decisions]`.
+ * @return `EXIT_SUCCESS` if the report was read, `EXIT_FAILURE` otherwise.
+ */
+int runReportQuery(const int argc, char **argv) {
+    std::optional<std::string> reportPath;
+    std::string prefix;
+    bool listFailed = false;
+    bool listDecisions = false;
+    std::size_t slowest = 0;
+    for (int i = 2; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--prefix" && i + 1 < argc) {
+            prefix = argv[++i];
+        } else if (arg == "--failed") {
+            listFailed = true;
+        } else if (arg == "--decisions") {
+            listDecisions = true;
+        } else if (arg == "--slowest" && i + 1 < argc) {
+            const auto count = parseJobCount(argv[++i]);
+            if (!count || *count == kAdaptiveJobs) {
+                std::cerr << "Invalid count for --slowest.\n";
+                return EXIT_FAILURE;
+            }
+            slowest = *count;
+        } else if (!reportPath) {
+            reportPath = arg;
+        } else {
+            reportPath.reset();
+            break;
+        }
+    }
+    if (!reportPath) {
+        std::cerr << "Usage: " << argv[0]
+                << " --report-query <report> [--prefix <path>] [--failed] [--slowest <n>] [--decisions]\n";
+        return EXIT_FAILURE;
+    }
+
+    const MappedFile file(*reportPath);
+    ReportHeader header;
+    if (file.valid() && file.size() >= sizeof(header))
+        std::memcpy(&header, file.data(), sizeof(header));
+    const bool intact = file.valid() && file.size() >= sizeof(header) &&
+                        std::memcmp(header.magic, ReportHeader{}.magic, sizeof(header.magic)) == 0 &&
+                        header.recordCount <= (file.size() - sizeof(header)) / sizeof(ReportRecord) &&
+                        header.heapOffset == sizeof(header) + header.recordCount * sizeof(ReportRecord) &&
+                        header.heapSize <= file.size() - header.heapOffset &&
+                        header.decisionsOffset <= header.heapSize &&
+                        header.decisionsLength <= header.heapSize - header.decisionsOffset;
+    if (!intact) {
+        std::cerr << *reportPath << " is not a columnar run report.\n";
+        return EXIT_FAILURE;
+    }
+
+    const auto *heap = reinterpret_cast<const char *>(file.data() + header.heapOffset);
+    const auto recordAt = [&](const std::uint64_t index) {
+        ReportRecord record;
+        std::memcpy(&record, file.data() + sizeof(header) + index * sizeof(ReportRecord), sizeof(record));
+        // A path that strays out of its part of the heap reads as empty.
+        const bool inHeap = record.pathOffset <= header.decisionsOffset &&
+                            record.pathLength <= header.decisionsOffset - record.pathOffset;
+        if (!inHeap)
+            record.pathLength = 0;
+        return record;
+    };
+    const auto pathOf = [&](const ReportRecord &record) {
+        return std::string_view(heap + record.pathOffset, record.pathLength);
+    };
+
+    std::vector<std::uint32_t> micros;
+    std::vector<std::pair<std::uint32_t, std::uint64_t> > ranked;
+    std::array<std::uint64_t, static_cast<std::size_t>(Phase::Count)> phaseTotals{};
+    std::uint64_t failed = 0;
+    std::uint64_t bytes = 0;
+    for (std::uint64_t i = 0; i < header.recordCount; ++i) {
+        const ReportRecord record = recordAt(i);
+        if (!prefix.empty() && !pathOf(record).starts_with(prefix))
+            continue;
+        micros.push_back(record.micros);
+        for (std::size_t p = 0; p < phaseTotals.size(); ++p)
+            phaseTotals[p] += record.phaseMicros[p];
+        bytes += record.size;
+        if (!record.succeeded) {
+            ++failed;
+            if (listFailed)
+                std::cout << "failed " << pathOf(record) << "\n";
+        }
+        if (slowest != 0)
+            ranked.emplace_back(record.micros, i);
+    }
+
+    const auto percentile = [&](const double fraction) -> double {
+        if (micros.empty())
+            return 0;
+        const auto at = micros.begin() + static_cast<std::ptrdiff_t>(fraction * static_cast<double>(micros.size() - 1));
+        std::ranges::nth_element(micros, at);
+        return *at / 1e6;
+    };
+    const std::uint64_t jobs = micros.size();
+    std::cout << "jobs: " << jobs << " (" << jobs - failed << " succeeded, " << failed << " failed), "
+            << bytes << " bytes\n";
+    std::cout << "seconds: p50 " << percentile(0.50) << ", p95 " << percentile(0.95) << ", p99 "
+            << percentile(0.99) << ", max " << percentile(1.0) << "\n";
+    std::cout << "mean phase seconds:";
+    for (std::size_t p = 0; p < phaseTotals.size(); ++p)
+        std::cout << " " << kPhaseNames[p] << " " << (jobs ? static_cast<double>(phaseTotals[p]) / 1e6 / jobs : 0.0);
+    std::cout << "\n";
+
+    if (slowest != 0) {
+        const auto count = std::min(slowest, ranked.size());
+        std::ranges::partial_sort(ranked, ranked.begin() + static_cast<std::ptrdiff_t>(count), std::greater{});
+        for (std::size_t i = 0; i < count; ++i)
+            std::cout << "slow " << ranked[i].first / 1e6 << "s " << pathOf(recordAt(ranked[i].second)) << "\n";
+    }
+    if (listDecisions)
+        std::cout << std::string_view(heap + header.decisionsOffset, header.decisionsLength);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Measures what the patcher's building blocks cost on the host and recommends settings.
+ *
+ * A scratch directory is created inside `<dir>` and filled with synthetic images of
+ * `kExpectedSize` bytes. The bench times, each as the best of three runs: a plain copy, a
+ * reflink clone, a hard link, a pwritev of the image, a write through a shared mapping,
+ * an fsync of a freshly written image, the tree-hash kernel, and the aggregate rate of
+ * 1, 2, 4, ... concurrent write-and-fsync jobs (up to twice the core count). From those it
+ * models the two engines (fused: read, two image writes and two fsyncs; in-place: a copy,
+ * its fsync, and one fsync per dependency wave) and prints patch and rollback command
+ * lines with the faster `--engine`, the smallest `--jobs` count within 10% of the best
+ * aggregate rate, and `--method reflink` for rollbacks where reflinks work (the backup is
+ * kept at the cost of a clone) or `--method rename` otherwise. The whole run takes a few
+ * seconds and the scratch directory is removed afterwards.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments: `--self-bench <dir>`.
+ * @return `EXIT_SUCCESS` if the bench ran, `EXIT_FAILURE` otherwise.
+ */
+int runSelfBench(const int argc, char **argv) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " --self-bench <dir>\n";
+        return EXIT_FAILURE;
+    }
+#if defined(__linux__)
+    const fs::path scratch = fs::path(argv[2]) / ("wow-patcher-bench-" + std::to_string(getpid()));
+    std::error_code ec;
+    if (!fs::create_directories(scratch, ec) || ec) {
+        std::cerr << "Failed to create " << scratch.string() << ": " << ec.message() << "\n";
+        return EXIT_FAILURE;
+    }
+    struct ScratchGuard {
+        fs::path path;
+        ~ScratchGuard() {
+            std::error_code ignored;
+            fs::remove_all(path, ignored);
+        }
+    } guard{scratch};
+
+    // Incompressible content, so neither the filesystem nor the device can shortcut writes.
+    std::vector<std::uint8_t> image(static_cast<std::size_t>(kExpectedSize));
+    std::uint64_t state = 0x57303335;
+    for (std::size_t i = 0; i + 8 <= image.size(); i += 8) {
+        std::uint64_t z = (state += 0x9E3779B97F4A7C15);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+        z ^= z >> 31;
+        std::memcpy(image.data() + i, &z, sizeof(z));
+    }
+    const double megabytes = static_cast<double>(image.size()) / (1024.0 * 1024.0);
+
+    // Writes the image to a new file with pwritev in stream-sized blocks, optionally flushing it.
+    const auto writeImage = [&](const fs::path &path, const bool flush) {
+        const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+        std::vector<iovec> vectors;
+        for (std::size_t at = 0; at < image.size(); at += kStreamBlockSize)
+            vectors.push_back({image.data() + at, std::min(kStreamBlockSize, image.size() - at)});
+        const bool written = pwritev(fd, vectors.data(), static_cast<int>(vectors.size()), 0) ==
+                             static_cast<ssize_t>(image.size()) && (!flush || fsync(fd) == 0);
+        close(fd);
+        return written;
+    };
+    // Best of three timings of `step`, in seconds; empty if any run fails.
+    const auto timeBest = [](auto &&step) -> std::optional<double> {
+        double best = 1e9;
+        for (int run = 0; run < 3; ++run) {
+            const auto start = std::chrono::steady_clock::now();
+            if (!step(run))
+                return std::nullopt;
+            best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    };
+
+    const fs::path source = scratch / "source.exe";
+    if (!writeImage(source, true)) {
+        std::cerr << "Failed to write a test image to " << scratch.string() << ": " << std::strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+    const auto target = [&](const int run) { return scratch / ("target" + std::to_string(run) + ".exe"); };
+
+    const auto copySeconds = timeBest([&](const int run) {
+        return fs::copy_file(source, target(run), fs::copy_options::overwrite_existing, ec);
+    });
+    const auto reflinkSeconds = timeBest([&](const int run) {
+        const int from = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        const int to = open(target(run).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        const bool cloned = from >= 0 && to >= 0 && ioctl(to, FICLONE, from) == 0;
+        if (from >= 0)
+            close(from);
+        if (to >= 0)
+            close(to);
+        return cloned;
+    });
+    const auto linkSeconds = timeBest([&](const int run) {
+        const fs::path link = scratch / ("link" + std::to_string(run) + ".exe");
+        fs::create_hard_link(source, link, ec);
+        return !ec;
+    });
+    const auto pwritevSeconds = timeBest([&](const int run) { return writeImage(target(run), false); });
+    const auto mmapSeconds = timeBest([&](const int run) {
+        const int fd = open(target(run).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool written = fd >= 0 && ftruncate(fd, static_cast<off_t>(image.size())) == 0;
+        if (written) {
+            void *mapped = mmap(nullptr, image.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            written = mapped != MAP_FAILED;
+            if (written) {
+                std::memcpy(mapped, image.data(), image.size());
+                written = msync(mapped, image.size(), MS_ASYNC) == 0;
+                munmap(mapped, image.size());
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+        return written;
+    });
+    // Only the fsync is timed: the image is written first, outside the measured span.
+    std::optional<double> fsyncSeconds = 1e9;
+    for (int run = 0; run < 3 && fsyncSeconds; ++run) {
+        const int fd = writeImage(target(run), false) ? open(target(run).c_str(), O_WRONLY | O_CLOEXEC) : -1;
+        const auto start = std::chrono::steady_clock::now();
+        if (fd < 0 || fsync(fd) != 0)
+            fsyncSeconds.reset();
+        else
+            fsyncSeconds = std::min(*fsyncSeconds,
+                                    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        if (fd >= 0)
+            close(fd);
+    }
+    const auto hashSeconds = timeBest([&](int) {
+        ImageLeaves leaves;
+        for (std::size_t at = 0; at < image.size(); at += kHashChunkSize)
+            leaves.leaves.push_back(hashLeaf(image.data() + at, std::min(kHashChunkSize, image.size() - at)));
+        leaves.size = image.size();
+        return combineLeaves(leaves) != Digest{};
+    });
+
+    // Aggregate throughput of n concurrent jobs, each writing and flushing its own image.
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::pair<unsigned, double> > scaling;
+    for (unsigned jobs = 1; jobs <= std::min(2 * cores, 16u); jobs *= 2) {
+        std::atomic<bool> failed = false;
+        const auto start = std::chrono::steady_clock::now();
+        {
+            std::vector<std::jthread> workers;
+            for (unsigned j = 0; j < jobs; ++j) {
+                workers.emplace_back([&, j] {
+                    if (!writeImage(scratch / ("job" + std::to_string(j) + ".exe"), true))
+                        failed = true;
+                });
+            }
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (failed)
+            break;
+        scaling.emplace_back(jobs, jobs * megabytes / seconds);
+    }
+
+    const auto rate = [&](const std::optional<double> &seconds) -> std::string {
+        if (!seconds)
+            return "unsupported";
+        std::ostringstream text;
+        text.setf(std::ios::fixed);
+        text.precision(0);
+        text << megabytes / *seconds << " MB/s";
+        return text.str();
+    };
+    const auto latency = [](const std::optional<double> &seconds) -> std::string {
+        if (!seconds)
+            return "unsupported";
+        std::ostringstream text;
+        text.setf(std::ios::fixed);
+        text.precision(2);
+        text << *seconds * 1000 << " ms";
+        return text.str();
+    };
+    std::cout << "copy      " << rate(copySeconds) << "\n"
+            << "reflink   " << (reflinkSeconds ? latency(reflinkSeconds) : "unsupported") << "\n"
+            << "hardlink  " << latency(linkSeconds) << "\n"
+            << "pwritev   " << rate(pwritevSeconds) << "\n"
+            << "mmap      " << rate(mmapSeconds) << "\n"
+            << "fsync     " << latency(fsyncSeconds) << "\n"
+            << "hash      " << rate(hashSeconds) << "\n";
+    for (const auto &[jobs, throughput]: scaling)
+        std::cout << "jobs " << jobs << (jobs < 10 ? "    " : "   ") << static_cast<long>(throughput) << " MB/s\n";
+
+    if (!copySeconds || !pwritevSeconds || !fsyncSeconds || !hashSeconds || scaling.empty()) {
+        std::cerr << "Some measurements failed; no recommendation.\n";
+        return EXIT_FAILURE;
+    }
+    // The in-place engine flushes once per dependency wave of the built-in table; those
+    // flushes carry a few dirty pages each, taken as a quarter of a whole-image flush.
+    const auto waves = patchWaves(buildPatchTable(), ~PatchSelection{0});
+    const std::size_t waveCount = waves && !waves->empty() ? *std::ranges::max_element(*waves) + 1 : 1;
+    const double fused = *hashSeconds + 2 * *pwritevSeconds + 2 * *fsyncSeconds;
+    const double inPlace = (reflinkSeconds ? *reflinkSeconds : *copySeconds) + *fsyncSeconds + *hashSeconds +
+                           static_cast<double>(waveCount) * *fsyncSeconds / 4;
+    const double best = std::ranges::max(scaling | std::views::values);
+    const unsigned jobs = std::ranges::find_if(scaling, [&](const auto &entry) { return entry.second >= 0.9 * best; })
+            ->first;
+    std::cout << "\n# Recommended settings for " << argv[2] << "\n"
+            << argv[0] << " --engine " << (fused <= inPlace ? "fused" : "inplace") << " --jobs " << jobs
+            << " <path>...\n"
+            << argv[0] << " --rollback --jobs " << jobs << " --method " << (reflinkSeconds ? "reflink" : "rename")
+            << " <path>...\n";
+    return EXIT_SUCCESS;
+#else
+    std::cerr << "--self-bench is only available on Linux.\n";
+    return EXIT_FAILURE;
+#endif
+}
+
+/**
+ * @brief One file of a client install as listed in an install manifest.
+ */
+struct InstallEntry {
+    /** The path relative to the install root, with `/` separators. */
+    std::string path;
+    std::uint64_t size = 0;
+    /** The tree digest of the contents (see combineLeaves). */
+    Digest digest{};
+};
+
+/**
+ * Reads an install manifest.
+ *
+ * Every non-empty line that does not start with `#` lists one file as
+ * `<digest> <size> <relative path>`; the path is the rest of the line.
+ *
+ * @param path The manifest.
+ * @return The entries, or an empty std::optional if the manifest is unreadable or malformed.
+ */
+[[nodiscard]] std::optional<std::vector<InstallEntry> > readInstallManifest(const fs::path &path) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Failed to open install manifest " << path.string() << ".\n";
+        return std::nullopt;
+    }
+    std::vector<InstallEntry> entries;
+    std::size_t lineNumber = 0;
+    for (std::string line; std::getline(file, line);) {
+        ++lineNumber;
+        if (line.empty() || line.starts_with('#'))
+            continue;
+        std::istringstream fields(line);
+        std::string hex;
+        InstallEntry entry;
+        fields >> hex >> entry.size;
+        const auto digest = parseDigest(hex);
+        std::getline(fields >> std::ws, entry.path);
+        if (!fields || !digest || entry.path.empty()) {
+            std::cerr << path.string() << ":" << lineNumber << ": malformed manifest line.\n";
+            return std::nullopt;
+        }
+        entry.digest = *digest;
+        entries.push_back(std::move(entry));
+    }
+    return entries;
+}
+
+/**
+ * @brief The stat fields that identify unchanged contents: a file whose tuple matches the
+ * cached one is not read again.
+ *
+ * The change time is included because it cannot be set back, unlike the modification time.
+ */
+struct StatTuple {
+    std::uint64_t size = 0;
+    std::int64_t modifiedNs = 0;
+    std::int64_t changedNs = 0;
+    std::uint64_t inode = 0;
+    std::uint64_t device = 0;
+
+    bool operator==(const StatTuple &) const = default;
+};
+
+/**
+ * @brief One entry of the stat tuple cache: a file's tuple and its digest when it had that tuple.
+ */
+struct StatCacheRecord {
+    std::uint64_t pathKey = 0;
+    StatTuple tuple;
+    Digest digest{};
+};
+
+static_assert(sizeof(StatCacheRecord) == 80);
+
+/**
+ * Stats a file for the stat tuple cache.
+ *
+ * @param path The file.
+ * @return Its tuple, or an empty std::optional if it is missing or not a regular file.
+ */
+[[nodiscard]] std::optional<StatTuple> statTuple(const fs::path &path) {
+#if defined(__linux__)
+    struct stat info {};
+    if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+        return std::nullopt;
+    return StatTuple{
+        static_cast<std::uint64_t>(info.st_size),
+        static_cast<std::int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec,
+        static_cast<std::int64_t>(info.st_ctim.tv_sec) * 1000000000 + info.st_ctim.tv_nsec,
+        info.st_ino, info.st_dev
+    };
+#else
+    std::error_code ec;
+    if (!fs::is_regular_file(path, ec))
+        return std::nullopt;
+    const auto size = fs::file_size(path, ec);
+    const auto modified = fs::last_write_time(path, ec).time_since_epoch().count();
+    if (ec)
+        return std::nullopt;
+    return StatTuple{size, static_cast<std::int64_t>(modified), 0, 0, 0};
+#endif
+}
+
+/**
+ * Derives the stat tuple cache key of a path inside an install.
+ *
+ * @param relative The path relative to the install root.
+ * @return The first eight bytes of its SHA-256.
+ */
+[[nodiscard]] std::uint64_t statCacheKey(const std::string_view relative) {
+    Sha256 sha;
+    sha.update(reinterpret_cast<const std::uint8_t *>(relative.data()), relative.size());
+    const Digest digest = sha.finish();
+    std::uint64_t key = 0;
+    std::memcpy(&key, digest.data(), sizeof(key));
+    return key;
+}
+
+/**
+ * Returns the stat tuple cache file of an install root: one flat file of StatCacheRecord
+ * entries under cacheDirectory(), read and rewritten whole on every run.
+ *
+ * @param root The install root.
+ * @return The cache file path.
+ */
+[[nodiscard]] fs::path statCachePath(const fs::path &root) {
+    std::error_code ec;
+    const std::string canonical = fs::weakly_canonical(root, ec).string();
+    Sha256 sha;
+    sha.update(reinterpret_cast<const std::uint8_t *>(canonical.data()), canonical.size());
+    return cacheDirectory() / "install" / (toHex(sha.finish()).substr(0, 32) + ".stat");
+}
+
+/**
+ * @brief The outcome of hashing one file of an install.
+ */
+struct InstallHash {
+    /** The tree digest, or empty if the file is missing or could not be read. */
+    std::optional<Digest> digest;
+    std::uint64_t size = 0;
+    /** The digest came from the stat tuple cache. */
+    bool cached = false;
+};
+
+/**
+ * @brief The size of the sequential reads of the install hashing pipeline.
+ *
+ * A multiple of `kHashChunkSize`, so every block holds whole leaves of the tree hash.
+ */
+constexpr std::size_t kInstallBlockSize = 64 * kHashChunkSize;
+
+/**
+ * @brief Hashes the files of an install with one reader per device and hashing fanned out
+ * across cores.
+ *
+ * Files are grouped by the device they live on, and each device gets one reader thread
+ * that walks its files in order with large sequential reads, so every disk streams at
+ * full speed without seeking between files. Readers hand out blocks of
+ * `kInstallBlockSize` bytes to one hashing thread per core, which compute the blocks'
+ * tree hash leaves; the last block of a file completes its digest. At most two blocks
+ * per hashing thread are in flight, which bounds memory however large the files are.
+ * Files whose stat tuple matches the stat tuple cache are not read at all, and the cache
+ * is rewritten with the tuples of every file hashed.
+ *
+ * @param root The install root.
+ * @param paths The files to hash, relative to the root.
+ * @param useCache Whether cached digests may be used; the cache is refreshed either way.
+ * @return The outcome for every path, in order.
+ */
+[[nodiscard]] std::vector<InstallHash> hashInstallFiles(const fs::path &root, const std::vector<std::string> &paths,
+                                                        const bool useCache) {
+    std::map<std::uint64_t, StatCacheRecord> cache;
+    const fs::path cachePath = statCachePath(root);
+    if (std::ifstream file(cachePath, std::ios::binary); file) {
+        for (StatCacheRecord record; file.read(reinterpret_cast<char *>(&record), sizeof(record));)
+            cache[record.pathKey] = record;
+    }
+
+    struct FileState {
+        std::optional<StatTuple> tuple;
+        std::vector<Digest> leaves;
+        std::atomic<std::size_t> pendingBlocks = 0;
+    };
+    struct Block {
+        std::size_t file = 0;
+        std::size_t firstLeaf = 0;
+        std::vector<std::uint8_t> bytes;
+    };
+
+    std::vector<InstallHash> results(paths.size());
+    std::vector<FileState> states(paths.size());
+    std::map<std::uint64_t, std::vector<std::size_t> > devices;
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+        auto &state = states[i];
+        state.tuple = statTuple(root / paths[i]);
+        if (!state.tuple)
+            continue;
+        results[i].size = state.tuple->size;
+        const auto hit = cache.find(statCacheKey(paths[i]));
+        if (useCache && hit != cache.end() && hit->second.tuple == *state.tuple) {
+            results[i].digest = hit->second.digest;
+            results[i].cached = true;
+            continue;
+        }
+        devices[state.tuple->device].push_back(i);
+    }
+
+    const unsigned hasherCount = std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t maxInFlight = 2 * static_cast<std::size_t>(hasherCount);
+    std::mutex budgetMutex;
+    std::condition_variable budgetFreed;
+    std::size_t inFlight = 0;
+    WorkQueue<Block> queue;
+
+    const auto finishFile = [&](const std::size_t file) {
+        auto &state = states[file];
+        results[file].digest = combineLeaves({state.tuple->size, std::move(state.leaves)});
+    };
+    {
+        std::vector<std::jthread> hashers;
+        for (unsigned i = 0; i < hasherCount; ++i) {
+            hashers.emplace_back([&] {
+                while (auto block = queue.pop()) {
+                    auto &state = states[block->file];
+                    for (std::size_t at = 0; at < block->bytes.size(); at += kHashChunkSize) {
+                        state.leaves[block->firstLeaf + at / kHashChunkSize] = hashLeaf(
+                            block->bytes.data() + at, std::min(kHashChunkSize, block->bytes.size() - at));
+                    }
+                    if (--state.pendingBlocks == 0)
+                        finishFile(block->file);
+                    {
+                        std::lock_guard lock(budgetMutex);
+                        --inFlight;
+                    }
+                    budgetFreed.notify_one();
+                }
+            });
+        }
+
+        std::vector<std::jthread> readers;
+        for (const auto &[device, files]: devices) {
+            readers.emplace_back([&, &files = files] {
+                for (const std::size_t file: files) {
+                    auto &state = states[file];
+                    const std::uint64_t size = state.tuple->size;
+                    std::ifstream input(root / paths[file], std::ios::binary);
+                    if (!input) {
+                        std::cerr << "Failed to open " << (root / paths[file]).string() << "\n";
+                        continue;
+                    }
+                    const std::size_t blockCount = static_cast<std::size_t>((size + kInstallBlockSize - 1) /
+                                                                            kInstallBlockSize);
+                    state.leaves.resize(static_cast<std::size_t>((size + kHashChunkSize - 1) / kHashChunkSize));
+                    if (blockCount == 0) {
+                        finishFile(file);
+                        continue;
+                    }
+                    state.pendingBlocks = blockCount;
+                    for (std::size_t b = 0; b < blockCount; ++b) {
+                        {
+                            std::unique_lock lock(budgetMutex);
+                            budgetFreed.wait(lock, [&] { return inFlight < maxInFlight; });
+                            ++inFlight;
+                        }
+                        Block block{file, b * (kInstallBlockSize / kHashChunkSize), {}};
+                        block.bytes.resize(static_cast<std::size_t>(
+                            std::min<std::uint64_t>(kInstallBlockSize, size - b * kInstallBlockSize)));
+                        // A short read (the file shrank) still completes the file, with a wrong digest.
+                        input.read(reinterpret_cast<char *>(block.bytes.data()),
+                                   static_cast<std::streamsize>(block.bytes.size()));
+                        queue.push(std::move(block));
+                    }
+                }
+            });
+        }
+        readers.clear();
+        queue.close();
+    }
+
+    std::vector<StatCacheRecord> records;
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+        if (results[i].digest && states[i].tuple)
+            cache[statCacheKey(paths[i])] = {statCacheKey(paths[i]), *states[i].tuple, *results[i].digest};
+    }
+    for (const auto &record: cache | std::views::values)
+        records.push_back(record);
+    if (!writeFileAtomically(cachePath, reinterpret_cast<const std::uint8_t *>(records.data()),
+                             records.size() * sizeof(StatCacheRecord)))
+        std::cerr << "Failed to update the stat cache; the next run will rehash everything.\n";
+    return results;
+}
+
+/**
+ * Lists the regular files below an install root.
+ *
+ * @param root The install root.
+ * @return The paths relative to the root with `/` separators, sorted, or an empty
+ *         std::optional if the tree could not be walked.
+ */
+[[nodiscard]] std::optional<std::vector<std::string> > listInstallFiles(const fs::path &root) {
+    std::vector<std::string> paths;
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(root, ec); !ec && it != fs::recursive_directory_iterator();
+         it.increment(ec)) {
+        if (it->is_regular_file(ec))
+            paths.push_back(it->path().lexically_relative(root).generic_string());
+    }
+    if (ec) {
+        std::cerr << "Failed to walk " << root.string() << ": " << ec.message() << "\n";
+        return std::nullopt;
+    }
+    std::ranges::sort(paths);
+    return paths;
+}
+
+/**
+ * @brief Writes an install manifest for a client tree (see readInstallManifest).
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments: `--install-manifest <root> <manifest>`.
+ * @return `EXIT_SUCCESS` if the manifest was written, `EXIT_FAILURE` otherwise.
+ */
+int runInstallManifest(const int argc, char **argv) {
+    if (argc != 4) {
+        std::cerr << "Usage: " << argv[0] << " --install-manifest <root> <manifest>\n";
+        return EXIT_FAILURE;
+    }
+    const fs::path root = argv[2];
+    const auto paths = listInstallFiles(root);
+    if (!paths)
+        return EXIT_FAILURE;
+    const auto hashes = hashInstallFiles(root, *paths, true);
+    std::string manifest = "# wow-335a-patcher install manifest: <tree digest> <size> <path>\n";
+    for (std::size_t i = 0; i < paths->size(); ++i) {
+        if (!hashes[i].digest) {
+            std::cerr << "Failed to hash " << (*paths)[i] << "\n";
+            return EXIT_FAILURE;
+        }
+        manifest += toHex(*hashes[i].digest) + " " + std::to_string(hashes[i].size) + " " + (*paths)[i] + "\n";
+    }
+    if (!writeFileAtomically(argv[3], reinterpret_cast<const std::uint8_t *>(manifest.data()), manifest.size()))
+        return EXIT_FAILURE;
+    std::cout << "Wrote " << paths->size() << " entries to " << argv[3] << ".\n";
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Verifies every file of a client install against an install manifest.
+ *
+ * Files are hashed by hashInstallFiles, so unchanged files are skipped on repeat runs
+ * unless `--no-cache` is given. Only problems are printed, one line per file: `missing`,
+ * `size` (wrong size, so not read at all) or `corrupt` (wrong digest), followed by a
+ * summary.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments: `--verify-install <root> <manifest> [--no-cache]`.
+ * @return `EXIT_SUCCESS` if every file matches, `EXIT_FAILURE` otherwise.
+ */
+int runVerifyInstall(const int argc, char **argv) {
+    const bool useCache = !(argc == 5 && std::string_view(argv[4]) == "--no-cache");
+    if (argc != 4 && (argc != 5 || useCache)) {
+        std::cerr << "Usage: " << argv[0] << " --verify-install <root> <manifest> [--no-cache]\n";
+        return EXIT_FAILURE;
+    }
+    const fs::path root = argv[2];
+    const auto entries = readInstallManifest(argv[3]);
+    if (!entries)
+        return EXIT_FAILURE;
+
+    const auto start = std::chrono::steady_clock::now();
+    // Files of the wrong size are damaged whatever their contents, so they are not read.
+    std::vector<std::string> paths;
+    std::vector<std::size_t> hashed;
+    std::size_t damaged = 0;
+    for (std::size_t i = 0; i < entries->size(); ++i) {
+        const auto &entry = (*entries)[i];
+        const auto tuple = statTuple(root / entry.path);
+        if (!tuple) {
+            std::cout << "missing " << entry.path << "\n";
+            ++damaged;
+        } else if (tuple->size != entry.size) {
+            std::cout << "size " << entry.path << "\n";
+            ++damaged;
+        } else {
+            paths.push_back(entry.path);
+            hashed.push_back(i);
+        }
+    }
+
+    const auto hashes = hashInstallFiles(root, paths, useCache);
+    std::uint64_t bytesRead = 0;
+    std::size_t fromCache = 0;
+    for (std::size_t i = 0; i < hashes.size(); ++i) {
+        const auto &entry = (*entries)[hashed[i]];
+        if (hashes[i].cached)
+            ++fromCache;
+        else
+            bytesRead += hashes[i].size;
+        if (hashes[i].digest != entry.digest) {
+            std::cout << (hashes[i].digest ? "corrupt " : "missing ") << entry.path << "\n";
+            ++damaged;
+        }
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Verified " << entries->size() << " file(s) in " << seconds << " s (" << fromCache
+            << " unchanged since the last run, " << bytesRead / (1024 * 1024) << " MiB read): " << damaged
+            << " damaged.\n";
+    return damaged == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Continues a CRC-32 (the zlib polynomial, as used by MPQ `(attributes)`).
+ *
+ * @param crc The CRC of the data so far, 0 to start.
+ * @param data The next data.
+ * @param size The size of the data in bytes.
+ * @return The CRC including the data.
+ */
+[[nodiscard]] std::uint32_t crc32Update(std::uint32_t crc, const std::uint8_t *data, std::size_t size) {
+#if defined(PATCHER_HAVE_ZLIB)
+    // zlib's implementation is table-sliced or carry-less-multiply accelerated depending on the build.
+    while (size > 0) {
+        const auto chunk = static_cast<uInt>(std::min<std::size_t>(size, 1u << 30));
+        crc = static_cast<std::uint32_t>(crc32(crc, data, chunk));
+        data += chunk;
+        size -= chunk;
+    }
+    return crc;
+#else
+    static constexpr std::array<std::uint32_t, 256> table = [] {
+        std::array<std::uint32_t, 256> entries{};
+        for (std::uint32_t i = 0; i < entries.size(); ++i) {
+            std::uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit)
+                value = (value >> 1) ^ (value & 1 ? 0xEDB88320 : 0);
+            entries[i] = value;
+        }
+        return entries;
+    }();
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+#endif
+}
+
+/**
+ * @brief The MPQ encryption table, from which both the name hashes and the keystream of
+ * encrypted tables and members derive.
+ */
+constexpr std::array<std::uint32_t, 0x500> kMpqCryptTable = [] {
+    std::array<std::uint32_t, 0x500> table{};
+    std::uint32_t seed = 0x00100001;
+    for (std::uint32_t first = 0; first < 0x100; ++first) {
+        for (std::uint32_t index = first; index < table.size(); index += 0x100) {
+            seed = (seed * 125 + 3) % 0x2AAAAB;
+            const std::uint32_t high = (seed & 0xFFFF) << 16;
+            seed = (seed * 125 + 3) % 0x2AAAAB;
+            table[index] = high | (seed & 0xFFFF);
+        }
+    }
+    return table;
+}();
+
+/**
+ * @brief The kinds of name hash an MPQ archive uses; each selects a quarter of kMpqCryptTable.
+ */
+enum class MpqHash : std::uint32_t {
+    /** The starting slot in the hash table. */
+    TableOffset = 0x000,
+    NameA = 0x100,
+    NameB = 0x200,
+    /** The encryption key of a table or member. */
+    FileKey = 0x300
+};
+
+/**
+ * Hashes a member name the way MPQ archives do: case-insensitively, with `/` and `\` equal.
+ *
+ * @param name The member name.
+ * @param type The kind of hash.
+ * @return The hash.
+ */
+[[nodiscard]] std::uint32_t mpqHash(const std::string_view name, const MpqHash type) {
+    std::uint32_t seed1 = 0x7FED7FED;
+    std::uint32_t seed2 = 0xEEEEEEEE;
+    for (const char c: name) {
+        std::uint32_t ch = static_cast<unsigned char>(c == '/' ? '\\' : c);
+        if (ch >= 'a' && ch <= 'z')
+            ch -= 'a' - 'A';
+        seed1 = kMpqCryptTable[static_cast<std::uint32_t>(type) + ch] ^ (seed1 + seed2);
+        seed2 = ch + seed1 + seed2 + (seed2 << 5) + 3;
+    }
+    return seed1;
+}
+
+/**
+ * Decrypts MPQ data in place. A trailing partial word is not encrypted and is left as is.
+ *
+ * @param data The data.
+ * @param size The size of the data in bytes.
+ * @param key The encryption key.
+ */
+void mpqDecrypt(std::uint8_t *data, const std::size_t size, std::uint32_t key) {
+    std::uint32_t seed = 0xEEEEEEEE;
+    for (std::size_t at = 0; at + 4 <= size; at += 4) {
+        seed += kMpqCryptTable[0x400 + (key & 0xFF)];
+        std::uint32_t word = 0;
+        std::memcpy(&word, data + at, sizeof(word));
+        word ^= key + seed;
+        key = ((~key << 0x15) + 0x11111111) | (key >> 0x0B);
+        seed = word + seed + (seed << 5) + 3;
+        std::memcpy(data + at, &word, sizeof(word));
+    }
+}
+
+/**
+ * @brief An entry of an MPQ hash table, which maps name hashes to block table entries.
+ */
+struct MpqHashEntry {
+    std::uint32_t nameA = 0;
+    std::uint32_t nameB = 0;
+    std::uint16_t locale = 0;
+    std::uint16_t platform = 0;
+    /** The block table index, or one of the `kMpqSlot*` markers. */
+    std::uint32_t blockIndex = 0;
+};
+
+/**
+ * @brief An entry of an MPQ block table: where one member is stored and how.
+ */
+struct MpqBlockEntry {
+    /** The offset of the member from the archive header (low 32 bits). */
+    std::uint32_t position = 0;
+    std::uint32_t storedSize = 0;
+    std::uint32_t fileSize = 0;
+    std::uint32_t flags = 0;
+};
+
+static_assert(sizeof(MpqHashEntry) == 16 && sizeof(MpqBlockEntry) == 16);
+
+constexpr std::uint32_t kMpqSlotEmpty = 0xFFFFFFFF;
+constexpr std::uint32_t kMpqFileImplode = 0x00000100;
+constexpr std::uint32_t kMpqFileCompress = 0x00000200;
+constexpr std::uint32_t kMpqFileEncrypted = 0x00010000;
+constexpr std::uint32_t kMpqFileFixKey = 0x00020000;
+constexpr std::uint32_t kMpqFileSingleUnit = 0x01000000;
+constexpr std::uint32_t kMpqFileDeleteMarker = 0x02000000;
+constexpr std::uint32_t kMpqFileExists = 0x80000000;
+constexpr std::uint8_t kMpqCompressionZlib = 0x02;
+
+/**
+ * @brief The tables of an MPQ archive (format 1 or 2, as shipped with 3.3.5a) over its mapping.
+ */
+struct MpqArchive {
+    const MappedFile *file = nullptr;
+    /** The file offset of the archive header, which member positions are relative to. */
+    std::uint64_t headerOffset = 0;
+    std::uint32_t sectorSize = 0;
+    std::vector<MpqHashEntry> hashes;
+    std::vector<MpqBlockEntry> blocks;
+    /** The high 16 bits of every member position (format 2), or empty. */
+    std::vector<std::uint16_t> blockHigh;
+};
+
+/**
+ * Copies an encrypted MPQ table out of the mapping and decrypts it.
+ *
+ * @tparam Entry The table entry type.
+ * @param file The archive mapping.
+ * @param offset The file offset of the table.
+ * @param count The number of entries.
+ * @param name The name the table is keyed by, e.g. `(hash table)`.
+ * @return The decrypted table, or an empty std::optional if it lies outside the file.
+ */
+template<typename Entry>
+[[nodiscard]] std::optional<std::vector<Entry> > readMpqTable(const MappedFile &file, const std::uint64_t offset,
+                                                              const std::uint32_t count, const std::string_view name) {
+    const std::uint64_t bytes = std::uint64_t{count} * sizeof(Entry);
+    if (offset > file.size() || file.size() - offset < bytes)
+        return std::nullopt;
+    std::vector<Entry> table(count);
+    std::memcpy(table.data(), file.data() + offset, bytes);
+    mpqDecrypt(reinterpret_cast<std::uint8_t *>(table.data()), bytes, mpqHash(name, MpqHash::FileKey));
+    return table;
+}
+
+/**
+ * Finds the archive header of an MPQ file and loads its hash and block tables.
+ *
+ * The header may sit at any 512-byte boundary, or be pointed at by a user data header.
+ *
+ * @param file The archive mapping.
+ * @return The archive, or an empty std::optional if the file is not a readable MPQ archive.
+ */
+[[nodiscard]] std::optional<MpqArchive> openMpqArchive(const MappedFile &file) {
+    MpqArchive archive{.file = &file, .headerOffset = 0, .sectorSize = 0, .hashes = {}, .blocks = {}, .blockHigh = {}};
+    std::vector<std::uint8_t> header;
+    for (std::uint64_t at = 0; at + 32 <= file.size(); at += 512) {
+        if (std::memcmp(file.data() + at, "MPQ\x1B", 4) == 0 && at + 12 <= file.size()) {
+            std::uint32_t target = 0;
+            std::memcpy(&target, file.data() + at + 8, sizeof(target));
+            if (at + target + 32 <= file.size() && std::memcmp(file.data() + at + target, "MPQ\x1A", 4) == 0)
+                at += target;
+        }
+        if (std::memcmp(file.data() + at, "MPQ\x1A", 4) == 0) {
+            archive.headerOffset = at;
+            header.assign(file.data() + at, file.data() + std::min<std::uint64_t>(file.size(), at + 44));
+            break;
+        }
+    }
+    if (header.empty()) {
+        std::cerr << "Not an MPQ archive: no archive header found.\n";
+        return std::nullopt;
+    }
+
+    const auto version = readScalar<std::uint16_t>(header, 12);
+    const auto sectorShift = readScalar<std::uint16_t>(header, 14);
+    std::uint64_t hashTable = *readScalar<std::uint32_t>(header, 16);
+    std::uint64_t blockTable = *readScalar<std::uint32_t>(header, 20);
+    const auto hashCount = *readScalar<std::uint32_t>(header, 24);
+    const auto blockCount = *readScalar<std::uint32_t>(header, 28);
+    if (*version > 1 || *sectorShift > 20 || hashCount == 0 || (hashCount & (hashCount - 1)) != 0) {
+        std::cerr << "Unsupported MPQ archive: format " << *version << ".\n";
+        return std::nullopt;
+    }
+    archive.sectorSize = 512u << *sectorShift;
+
+    std::uint64_t highTable = 0;
+    if (*version == 1) {
+        const auto high = readScalar<std::uint64_t>(header, 32);
+        const auto hashHigh = readScalar<std::uint16_t>(header, 40);
+        const auto blockHigh = readScalar<std::uint16_t>(header, 42);
+        if (!high || !hashHigh || !blockHigh) {
+            std::cerr << "Truncated MPQ archive header.\n";
+            return std::nullopt;
+        }
+        highTable = *high;
+        hashTable |= std::uint64_t{*hashHigh} << 32;
+        blockTable |= std::uint64_t{*blockHigh} << 32;
+    }
+
+    auto hashes = readMpqTable<MpqHashEntry>(file, archive.headerOffset + hashTable, hashCount, "(hash table)");
+    auto blocks = readMpqTable<MpqBlockEntry>(file, archive.headerOffset + blockTable, blockCount, "(block table)");
+    if (!hashes || !blocks) {
+        std::cerr << "Damaged MPQ archive: the hash or block table lies outside the file.\n";
+        return std::nullopt;
+    }
+    archive.hashes = std::move(*hashes);
+    archive.blocks = std::move(*blocks);
+    if (highTable != 0) {
+        const std::uint64_t offset = archive.headerOffset + highTable;
+        if (offset > file.size() || file.size() - offset < std::uint64_t{blockCount} * 2) {
+            std::cerr << "Damaged MPQ archive: the high block table lies outside the file.\n";
+            return std::nullopt;
+        }
+        archive.blockHigh.resize(blockCount);
+        std::memcpy(archive.blockHigh.data(), file.data() + offset, std::uint64_t{blockCount} * 2);
+    }
+    return archive;
+}
+
+/**
+ * Looks a member name up in the hash table of an archive.
+ *
+ * @param archive The archive.
+ * @param name The member name.
+ * @return The block indices stored under the name (one per locale), empty if there are none.
+ */
+[[nodiscard]] std::vector<std::uint32_t> findMpqMember(const MpqArchive &archive, const std::string_view name) {
+    std::vector<std::uint32_t> found;
+    const std::size_t mask = archive.hashes.size() - 1;
+    const std::uint32_t nameA = mpqHash(name, MpqHash::NameA);
+    const std::uint32_t nameB = mpqHash(name, MpqHash::NameB);
+    const std::size_t start = mpqHash(name, MpqHash::TableOffset) & mask;
+    for (std::size_t probe = 0; probe < archive.hashes.size(); ++probe) {
+        const auto &entry = archive.hashes[(start + probe) & mask];
+        if (entry.blockIndex == kMpqSlotEmpty)
+            break;
+        if (entry.nameA == nameA && entry.nameB == nameB && entry.blockIndex < archive.blocks.size())
+            found.push_back(entry.blockIndex);
+    }
+    return found;
+}
+
+/**
+ * @brief Whether an archive member could be read.
+ */
+enum class MpqMemberState {
+    Intact,
+    /** The stored data is truncated, fails to decompress or does not match its checksum. */
+    Damaged,
+    /** The member is encrypted under an unknown name or uses a compression other than zlib. */
+    Unverifiable
+};
+
+/**
+ * Reads one archive member sector by sector and hands its decompressed contents to a sink.
+ *
+ * @tparam Sink A callable taking `(const std::uint8_t *data, std::size_t size)`.
+ * @param archive The archive.
+ * @param index The block table index of the member.
+ * @param name The member name, needed only if the member is encrypted.
+ * @param sink Receives the contents in order.
+ * @return Whether the member was read in full.
+ */
+template<typename Sink>
+[[nodiscard]] MpqMemberState readMpqMember(const MpqArchive &archive, const std::uint32_t index,
+                                           const std::optional<std::string_view> name, Sink &&sink) {
+    const MpqBlockEntry &block = archive.blocks[index];
+    if ((block.flags & kMpqFileImplode) != 0)
+        return MpqMemberState::Unverifiable;
+
+    std::uint32_t key = 0;
+    const bool encrypted = (block.flags & kMpqFileEncrypted) != 0;
+    if (encrypted) {
+        if (!name)
+            return MpqMemberState::Unverifiable;
+        const std::size_t slash = name->find_last_of("\\/");
+        key = mpqHash(slash == std::string_view::npos ? *name : name->substr(slash + 1), MpqHash::FileKey);
+        if ((block.flags & kMpqFileFixKey) != 0)
+            key = (key + block.position) ^ block.fileSize;
+    }
+
+    const std::uint64_t high = archive.blockHigh.empty() ? 0 : archive.blockHigh[index];
+    const std::uint64_t offset = archive.headerOffset + ((high << 32) | block.position);
+    const MappedFile &file = *archive.file;
+    if (offset > file.size() || file.size() - offset < block.storedSize)
+        return MpqMemberState::Damaged;
+    const std::uint8_t *stored = file.data() + offset;
+
+    const bool compressed = (block.flags & kMpqFileCompress) != 0;
+    const bool singleUnit = (block.flags & kMpqFileSingleUnit) != 0;
+    const std::uint32_t sectorSize = singleUnit ? std::max(block.fileSize, 1u) : archive.sectorSize;
+    const std::uint32_t sectorCount = (block.fileSize + sectorSize - 1) / sectorSize;
+
+    // Sector boundaries within the stored data: implicit for uncompressed members, an
+    // (encrypted) offset table in front of the sectors for compressed ones.
+    std::vector<std::uint32_t> bounds(sectorCount + 1);
+    if (compressed && !singleUnit) {
+        if (block.storedSize / 4 < bounds.size())
+            return MpqMemberState::Damaged;
+        std::memcpy(bounds.data(), stored, bounds.size() * 4);
+        if (encrypted)
+            mpqDecrypt(reinterpret_cast<std::uint8_t *>(bounds.data()), bounds.size() * 4, key - 1);
+    } else if (singleUnit) {
+        bounds.back() = block.storedSize;
+    } else {
+        for (std::uint32_t s = 0; s <= sectorCount; ++s)
+            bounds[s] = static_cast<std::uint32_t>(std::min<std::uint64_t>(std::uint64_t{s} * sectorSize, block.fileSize));
+    }
+
+    std::vector<std::uint8_t> sector;
+    std::vector<std::uint8_t> expanded(sectorSize);
+    for (std::uint32_t s = 0; s < sectorCount; ++s) {
+        if (bounds[s] > bounds[s + 1] || bounds[s + 1] > block.storedSize)
+            return MpqMemberState::Damaged;
+        const std::uint32_t plainSize = std::min(sectorSize, block.fileSize - s * sectorSize);
+        sector.assign(stored + bounds[s], stored + bounds[s + 1]);
+        if (encrypted)
+            mpqDecrypt(sector.data(), sector.size(), key + s);
+        if (!compressed || sector.size() >= plainSize) {
+            if (sector.size() != plainSize)
+                return MpqMemberState::Damaged;
+            sink(sector.data(), sector.size());
+            continue;
+        }
+#if defined(PATCHER_HAVE_ZLIB)
+        if (sector.empty() || sector[0] != kMpqCompressionZlib)
+            return MpqMemberState::Unverifiable;
+        uLongf expandedSize = plainSize;
+        if (uncompress(expanded.data(), &expandedSize, sector.data() + 1, static_cast<uLong>(sector.size() - 1)) != Z_OK
+            || expandedSize != plainSize)
+            return MpqMemberState::Damaged;
+        sink(expanded.data(), plainSize);
+#else
+        return MpqMemberState::Unverifiable;
+#endif
+    }
+    return MpqMemberState::Intact;
+}
+
+/**
+ * Reads an archive member whole.
+ *
+ * @param archive The archive.
+ * @param name The member name.
+ * @return The contents, or an empty std::optional if the member is absent or unreadable.
+ */
+[[nodiscard]] std::optional<std::vector<std::uint8_t> > readMpqMember(const MpqArchive &archive,
+                                                                      const std::string_view name) {
+    const auto indices = findMpqMember(archive, name);
+    if (indices.empty())
+        return std::nullopt;
+    std::vector<std::uint8_t> contents;
+    const auto state = readMpqMember(archive, indices.front(), name, [&](const std::uint8_t *data, const std::size_t size) {
+        contents.insert(contents.end(), data, data + size);
+    });
+    if (state != MpqMemberState::Intact)
+        return std::nullopt;
+    return contents;
+}
+
+/**
+ * @brief Verifies the members of client MPQ archives against their `(attributes)` checksums.
+ *
+ * Each archive is mapped, its hash and block tables are decrypted, and the CRC32 of every
+ * member listed in `(attributes)` is computed in parallel and compared. Member names come
+ * from `(listfile)`; they are only needed to decrypt encrypted members and to name damaged
+ * ones. Only damaged members are printed, as `damaged <archive> <member>`, so a repair
+ * can fetch those members instead of the whole archive. Members that cannot be checked
+ * (encrypted under an unlisted name, or compressed with something other than zlib) are
+ * counted in the summary.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments: `--verify-mpq <archive>...`.
+ * @return `EXIT_SUCCESS` if every member checked is intact, `EXIT_FAILURE` otherwise.
+ */
+int runVerifyMpq(const int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " --verify-mpq <archive>...\n";
+        return EXIT_FAILURE;
+    }
+#if !defined(PATCHER_HAVE_ZLIB)
+    std::cerr << "Warning: built without zlib; compressed members cannot be verified.\n";
+#endif
+    bool allIntact = true;
+    for (int i = 2; i < argc; ++i) {
+        const std::string archivePath = argv[i];
+        const auto start = std::chrono::steady_clock::now();
+        const MappedFile file(archivePath);
+        const auto archive = file.valid() ? openMpqArchive(file) : std::nullopt;
+        if (!archive) {
+            std::cerr << "Failed to open " << archivePath << "\n";
+            allIntact = false;
+            continue;
+        }
+
+        const auto attributes = readMpqMember(*archive, "(attributes)");
+        const auto flags = attributes ? readScalar<std::uint32_t>(*attributes, 4) : std::nullopt;
+        if (!flags || (*flags & 1) == 0) {
+            std::cerr << archivePath << " has no readable (attributes) with CRC32 values; nothing to verify.\n";
+            allIntact = false;
+            continue;
+        }
+        // The CRC32, FILETIME and MD5 arrays hold one entry per block and the patch bits (0x8)
+        // one bit per block; some archives leave the last block table entry out of all of them.
+        const auto attributesSize = [&](const std::size_t entries) {
+            return 8 + entries * (4 + (*flags & 2 ? 8 : 0) + (*flags & 4 ? 16 : 0)) +
+                   (*flags & 8 ? (entries + 7) / 8 : 0);
+        };
+        const std::size_t blockCount = archive->blocks.size();
+        std::size_t covered = blockCount;
+        if (attributesSize(covered) != attributes->size() && blockCount != 0)
+            --covered;
+        if (attributesSize(covered) != attributes->size()) {
+            std::cerr << archivePath << " has an (attributes) file of unexpected size; nothing to verify.\n";
+            allIntact = false;
+            continue;
+        }
+
+        std::vector<std::string> names(archive->blocks.size());
+        if (const auto listfile = readMpqMember(*archive, "(listfile)")) {
+            std::string_view text(reinterpret_cast<const char *>(listfile->data()), listfile->size());
+            std::size_t at = 0;
+            while (at < text.size()) {
+                const std::size_t end = std::min(text.find_first_of(";\r\n", at), text.size());
+                const std::string_view name = text.substr(at, end - at);
+                at = end + 1;
+                if (name.empty())
+                    continue;
+                for (const std::uint32_t index: findMpqMember(*archive, name))
+                    names[index] = name;
+            }
+        }
+        for (const std::string_view special: {"(listfile)", "(attributes)"}) {
+            for (const std::uint32_t index: findMpqMember(*archive, special))
+                names[index] = special;
+        }
+
+        // Members without a recorded checksum stay empty.
+        std::vector<std::optional<MpqMemberState> > states(covered);
+        parallelFor(covered, [&](const std::size_t begin, const std::size_t end) {
+            for (std::size_t index = begin; index < end; ++index) {
+                const MpqBlockEntry &block = archive->blocks[index];
+                std::uint32_t expected = 0;
+                std::memcpy(&expected, attributes->data() + 8 + 4 * index, sizeof(expected));
+                if ((block.flags & kMpqFileExists) == 0 || (block.flags & kMpqFileDeleteMarker) != 0 || expected == 0)
+                    continue;
+                const auto name = names[index].empty() ? std::nullopt : std::optional<std::string_view>(names[index]);
+                std::uint32_t crc = 0;
+                auto state = readMpqMember(*archive, static_cast<std::uint32_t>(index), name,
+                                           [&](const std::uint8_t *data, const std::size_t size) {
+                                               crc = crc32Update(crc, data, size);
+                                           });
+                if (state == MpqMemberState::Intact && crc != expected)
+                    state = MpqMemberState::Damaged;
+                states[index] = state;
+            }
+        });
+
+        std::size_t damaged = 0;
+        std::size_t unverifiable = 0;
+        std::size_t verified = 0;
+        for (std::size_t index = 0; index < covered; ++index) {
+            if (!states[index])
+                continue;
+            ++verified;
+            if (states[index] == MpqMemberState::Unverifiable) {
+                ++unverifiable;
+            } else if (states[index] == MpqMemberState::Damaged) {
+                ++damaged;
+                std::cout << "damaged " << archivePath << " "
+                        << (names[index].empty() ? "#" + std::to_string(index) : names[index]) << "\n";
+            }
+        }
+        allIntact = allIntact && damaged == 0;
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Verified " << verified << " member(s) of " << archivePath << " in " << seconds << " s: "
+                << damaged << " damaged, " << unverifiable << " could not be checked.\n";
+    }
+    return allIntact ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief A fix too large for a code cave: code placed in an appended `.patch` section and
+ * reached through a trampoline written over the original instructions at its site.
+ *
+ * The trampoline is a `jmp rel32` padded with NOPs to `hookLength` bytes, which must end
+ * on an instruction boundary. The code must replay whatever it displaced; a jump back to
+ * the first instruction after the trampoline is appended to it automatically.
+ */
+struct Injection {
+    std::string name;
+    /** The file offset the trampoline is written at. */
+    std::streampos site;
+    std::uint32_t hookLength = 0;
+    std::vector<std::uint8_t> code;
+    /** `rel32` operands inside the code, as (code offset, absolute target VA) pairs. */
+    std::vector<std::pair<std::uint32_t, std::uint32_t> > relocations;
+};
+
+/** The name of the section injected code is placed in. */
+constexpr std::string_view kInjectedSectionName = ".patch";
+
+/**
+ * Loads injections from a text file.
+ *
+ * Every non-empty line that does not start with `#` describes one injection as
+ * `<fix name> <site offset> <hook length> <code byte>...`, all in hex. A
+ * `rel32=<code offset>:<target VA>,...` field marks `call`/`jmp` operands in the code
+ * that must reach a fixed address in the client; they are rewritten once the code's
+ * address is known:
+ *
+ *     frame-timing 0x1E3C40 6 60 E8 00 00 00 00 61 ... rel32=0x2:0x86B7F0
+ *
+ * @param filepath The injection file.
+ * @return The injections, or an empty std::optional if the file is missing or malformed.
+ */
+[[nodiscard]] std::optional<std::vector<Injection> > loadInjectionFile(const std::string &filepath) {
+    std::ifstream file(filepath);
+    if (!file) {
+        std::cerr << "Failed to open injection file " << filepath << ".\n";
+        return std::nullopt;
+    }
+    std::vector<Injection> injections;
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+        std::istringstream fields(line);
+        std::string name, site, length, byte;
+        if (!(fields >> name) || name.starts_with('#'))
+            continue;
+        Injection injection{.name = name, .site = 0, .hookLength = 0, .code = {}, .relocations = {}};
+        const auto pos = (fields >> site) ? parseHex(site) : std::nullopt;
+        const auto hookLength = (fields >> length) ? parseHex(length) : std::nullopt;
+        bool valid = pos && hookLength && *hookLength >= 5 && *hookLength <= 0x20;
+        while (valid && fields >> byte) {
+            if (byte.starts_with("rel32=")) {
+                std::istringstream pairs(byte.substr(6));
+                for (std::string pair; valid && std::getline(pairs, pair, ',');) {
+                    const std::size_t colon = pair.find(':');
+                    const auto at = colon == std::string::npos ? std::nullopt : parseHex(pair.substr(0, colon));
+                    const auto target = colon == std::string::npos ? std::nullopt : parseHex(pair.substr(colon + 1));
+                    valid = at && target && *target <= 0xFFFFFFFF;
+                    if (valid)
+                        injection.relocations.emplace_back(*at, *target);
+                }
+                continue;
+            }
+            const auto value = parseHex(byte);
+            valid = value && *value <= 0xFF;
+            if (valid)
+                injection.code.push_back(static_cast<std::uint8_t>(*value));
+        }
+        valid = valid && !injection.code.empty() && std::ranges::all_of(injection.relocations, [&](const auto &r) {
+            return r.first + 4 <= injection.code.size();
+        });
+        if (!valid) {
+            std::cerr << filepath << ":" << lineNumber
+                    << ": expected '<name> <site> <hook length, 5 to 0x20> <bytes...> [rel32=<at>:<va>,...]' in hex.\n";
+            return std::nullopt;
+        }
+        injection.site = static_cast<std::streamoff>(*pos);
+        injection.hookLength = static_cast<std::uint32_t>(*hookLength);
+        injections.push_back(std::move(injection));
+    }
+    return injections;
+}
+
+/**
+ * Checks that no injection's trampoline overlaps a selected patch or another trampoline.
+ *
+ * @param injections The injections.
+ * @param table The patch table.
+ * @param selection The patches that will be written as well.
+ * @return true if every trampoline has its bytes to itself.
+ */
+[[nodiscard]] bool checkInjectionSites(const std::vector<Injection> &injections, const PatchTable &table,
+                                       const PatchSelection selection) {
+    std::vector<std::tuple<std::streamoff, std::streamoff, std::string_view> > ranges;
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        if (isSelected(selection, i)) {
+            const auto begin = static_cast<std::streamoff>(table[i].pos);
+            ranges.emplace_back(begin, begin + static_cast<std::streamoff>(table[i].data.size()), table[i].name);
+        }
+    }
+    for (const auto &injection: injections) {
+        const auto begin = static_cast<std::streamoff>(injection.site);
+        const auto end = begin + injection.hookLength;
+        for (const auto &[otherBegin, otherEnd, name]: ranges) {
+            if (begin < otherEnd && otherBegin < end) {
+                std::cerr << "Injection '" << injection.name << "' at 0x" << std::hex << begin << std::dec
+                        << " overlaps '" << name << "'.\n";
+                return false;
+            }
+        }
+        ranges.emplace_back(begin, end, injection.name);
+    }
+    return true;
+}
+
+/**
+ * Computes the PE image checksum the way `CheckSumMappedFile` does.
+ *
+ * @param image The image; its checksum field is skipped.
+ * @param checksumOffset The file offset of the checksum field.
+ * @return The checksum.
+ */
+[[nodiscard]] std::uint32_t peChecksum(const std::vector<std::uint8_t> &image, const std::size_t checksumOffset) {
+    std::uint64_t sum = 0;
+    for (std::size_t at = 0; at < image.size(); at += 2) {
+        if (at == checksumOffset || at == checksumOffset + 2)
+            continue;
+        sum += image[at] | (at + 1 < image.size() ? image[at + 1] << 8 : 0);
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return static_cast<std::uint32_t>(sum + image.size());
+}
+
+/**
+ * Appends a `.patch` section holding the injections' code to an image and writes their trampolines.
+ *
+ * The section goes after the last section in both the file and the address space, aligned to
+ * `FileAlignment` and `SectionAlignment`. The section table, `NumberOfSections`,
+ * `SizeOfImage`, `SizeOfCode` and the checksum are updated to match. The header must have
+ * a free section table slot, and every hook site must lie in an executable section and
+ * end on an instruction boundary.
+ *
+ * @param image The image to grow; it is modified in place.
+ * @param injections The injections.
+ * @return true if the image was grown, false if it cannot take the section (the image is then unchanged).
+ */
+[[nodiscard]] bool appendInjectedSection(std::vector<std::uint8_t> &image, const std::vector<Injection> &injections) {
+    const auto pe = parsePeHeaders(image);
+    if (!pe)
+        return false;
+    const std::size_t optionalOffset = pe->fileHeaderOffset + 20;
+    const auto optionalSize = readScalar<std::uint16_t>(image, pe->fileHeaderOffset + 16);
+    const auto sectionAlignment = readScalar<std::uint32_t>(image, optionalOffset + 32);
+    const auto fileAlignment = readScalar<std::uint32_t>(image, optionalOffset + 36);
+    const auto securitySize = readScalar<std::uint32_t>(image, optionalOffset + 96 + 4 * 8 + 4);
+    if (!sectionAlignment || !fileAlignment || *fileAlignment == 0 || *sectionAlignment < *fileAlignment) {
+        std::cerr << "Malformed PE alignment fields.\n";
+        return false;
+    }
+    if (std::ranges::any_of(pe->sections, [](const PeSection &s) { return s.name == kInjectedSectionName; })) {
+        std::cerr << "The image already carries a " << kInjectedSectionName << " section; roll it back first.\n";
+        return false;
+    }
+    // Appending after an Authenticode signature would corrupt it.
+    if (securitySize && *securitySize != 0) {
+        std::cerr << "The image is signed; a section cannot be appended to it.\n";
+        return false;
+    }
+
+    const std::size_t entry = optionalOffset + *optionalSize + pe->sections.size() * 40;
+    std::uint32_t firstRaw = pe->sizeOfHeaders;
+    std::uint32_t imageEnd = 0;
+    for (const auto &section: pe->sections) {
+        if (section.rawSize != 0)
+            firstRaw = std::min(firstRaw, section.rawPointer);
+        imageEnd = std::max(imageEnd, section.virtualAddress + std::max(section.virtualSize, section.rawSize));
+    }
+    if (entry + 40 > firstRaw || !std::all_of(image.begin() + static_cast<std::ptrdiff_t>(entry),
+                                              image.begin() + static_cast<std::ptrdiff_t>(entry + 40),
+                                              [](const std::uint8_t b) { return b == 0; })) {
+        std::cerr << "The section table has no free slot for a " << kInjectedSectionName << " section.\n";
+        return false;
+    }
+
+    const auto align = [](const std::uint64_t value, const std::uint32_t to) { return (value + to - 1) / to * to; };
+    const auto sectionRva = static_cast<std::uint32_t>(align(imageEnd, *sectionAlignment));
+    const auto rawPointer = static_cast<std::uint32_t>(align(image.size(), *fileAlignment));
+
+    // Lay the code out, each injection followed by its jump back and padded to 16 bytes.
+    std::vector<std::uint8_t> code;
+    std::vector<std::pair<std::uint32_t, std::uint32_t> > trampolines;
+    for (const auto &injection: injections) {
+        const auto site = static_cast<std::uint32_t>(static_cast<std::streamoff>(injection.site));
+        const auto siteRva = fileOffsetToRva(*pe, site, injection.hookLength);
+        const auto owner = std::ranges::find_if(pe->sections, [&](const PeSection &s) {
+            return site >= s.rawPointer && site < s.rawPointer + s.rawSize;
+        });
+        if (!siteRva || owner == pe->sections.end() || (owner->characteristics & kSectionExecutable) == 0) {
+            std::cerr << "Injection '" << injection.name << "' hooks a site outside executable code.\n";
+            return false;
+        }
+        std::uint32_t covered = 0;
+        while (covered < injection.hookLength) {
+            if (site + covered >= image.size()) {
+                std::cerr << "Injection '" << injection.name << "' hooks instructions past the end of the image.\n";
+                return false;
+            }
+            const std::uint32_t length =
+                    decodeInstruction(image.data() + site + covered, image.size() - site - covered).length;
+            if (length == 0) {
+                std::cerr << "Injection '" << injection.name << "' hooks bytes that do not decode.\n";
+                return false;
+            }
+            covered += length;
+        }
+        if (covered != injection.hookLength) {
+            std::cerr << "Injection '" << injection.name << "' would split an instruction: the hook must cover "
+                    << covered << " bytes.\n";
+            return false;
+        }
+
+        const auto start = static_cast<std::uint32_t>(code.size());
+        const std::uint32_t startVa = pe->imageBase + sectionRva + start;
+        code.insert(code.end(), injection.code.begin(), injection.code.end());
+        for (const auto &[at, target]: injection.relocations) {
+            const std::uint32_t displacement = target - (startVa + at + 4);
+            std::memcpy(code.data() + start + at, &displacement, sizeof(displacement));
+        }
+        const std::uint32_t back = pe->imageBase + *siteRva + injection.hookLength;
+        const std::uint32_t backDisplacement = back - (pe->imageBase + sectionRva + static_cast<std::uint32_t>(code.size()) + 5);
+        code.push_back(0xE9);
+        code.insert(code.end(), reinterpret_cast<const std::uint8_t *>(&backDisplacement),
+                    reinterpret_cast<const std::uint8_t *>(&backDisplacement) + 4);
+        code.resize(align(code.size(), 16), 0xCC);
+        trampolines.emplace_back(site, sectionRva + start - (*siteRva + 5));
+    }
+
+    // Trampolines over the hook sites.
+    for (std::size_t i = 0; i < injections.size(); ++i) {
+        const auto [site, displacement] = trampolines[i];
+        image[site] = 0xE9;
+        std::memcpy(image.data() + site + 1, &displacement, sizeof(displacement));
+        std::fill_n(image.begin() + site + 5, injections[i].hookLength - 5, 0x90);
+    }
+
+    const auto rawSize = static_cast<std::uint32_t>(align(code.size(), *fileAlignment));
+    const auto virtualSize = static_cast<std::uint32_t>(code.size());
+    std::array<std::uint8_t, 40> header{};
+    std::ranges::copy(kInjectedSectionName, header.begin());
+    const std::uint32_t characteristics = 0x60000020; // code, execute, read
+    for (const auto &[offset, value]: {std::pair{8, virtualSize}, {12, sectionRva}, {16, rawSize},
+                                       {20, rawPointer}, {36, characteristics}})
+        std::memcpy(header.data() + offset, &value, sizeof(value));
+    std::ranges::copy(header, image.begin() + static_cast<std::ptrdiff_t>(entry));
+
+    const auto sectionCount = static_cast<std::uint16_t>(pe->sections.size() + 1);
+    const std::uint32_t sizeOfCode = *readScalar<std::uint32_t>(image, optionalOffset + 4) + rawSize;
+    const auto sizeOfImage = static_cast<std::uint32_t>(align(sectionRva + virtualSize, *sectionAlignment));
+    std::memcpy(image.data() + pe->fileHeaderOffset + 2, &sectionCount, sizeof(sectionCount));
+    std::memcpy(image.data() + optionalOffset + 4, &sizeOfCode, sizeof(sizeOfCode));
+    std::memcpy(image.data() + optionalOffset + 56, &sizeOfImage, sizeof(sizeOfImage));
+
+    image.resize(rawPointer, 0);
+    image.insert(image.end(), code.begin(), code.end());
+    image.resize(rawPointer + rawSize, 0);
+    if (*readScalar<std::uint32_t>(image, optionalOffset + 64) != 0) {
+        const std::uint32_t checksum = peChecksum(image, optionalOffset + 64);
+        std::memcpy(image.data() + optionalOffset + 64, &checksum, sizeof(checksum));
+    }
+    return true;
+}
+
+bool isInjectedImage(const std::string &filepath, const std::streamoff size) {
+    const auto pe = readPeHeaders(filepath);
+    if (!pe || pe->sections.empty())
+        return false;
+    const PeSection &last = pe->sections.back();
+    return last.name == kInjectedSectionName && last.rawPointer >= kExpectedSize &&
+           std::streamoff{last.rawPointer} + last.rawSize == size;
+}
+
+/**
+ * @brief Grows a patched image with a `.patch` section holding the given injections.
+ *
+ * The whole image is rebuilt in memory by appendInjectedSection and written back to the
+ * same file. patchFused runs this on its temporary patched copy, so the section is
+ * flushed and renamed into place by the same commit as the patches, and a failure leaves
+ * the original untouched. The backup still holds the original.
+ *
+ * @param imagePath The patched image, a temporary file nothing else refers to.
+ * @param injections The injections.
+ * @return true if the image was grown, false otherwise.
+ */
+bool injectImage(const std::string &imagePath, const std::vector<Injection> &injections) {
+    // A branch into the middle of a trampoline would land inside its jump (see compilePlan).
+    const auto pe = readPeHeaders(imagePath);
+    const auto xrefs = pe ? loadXrefIndex(imagePath, *pe, Digest{}) : std::nullopt;
+    if (!xrefs)
+        return false;
+    for (const auto &injection: injections) {
+        const auto begin = static_cast<std::uint32_t>(static_cast<std::streamoff>(injection.site));
+        const auto end = begin + injection.hookLength;
+        for (auto it = std::ranges::upper_bound(*xrefs, begin, {}, &BranchXref::target);
+             it != xrefs->end() && it->target < end; ++it) {
+            if (it->source < begin || it->source >= end) {
+                std::cerr << "Injection '" << injection.name << "' hooks over 0x" << std::hex << it->target
+                        << ", the target of a branch at 0x" << it->source << std::dec << ".\n";
+                return false;
+            }
+        }
+    }
+
+    auto image = readWholeFile(imagePath);
+    if (!image || !appendInjectedSection(*image, injections)) {
+        std::cerr << "Failed to inject code into " << imagePath << ".\n";
+        return false;
+    }
+    std::ofstream output(imagePath, std::ios::binary | std::ios::trunc);
+    output.write(reinterpret_cast<const char *>(image->data()), static_cast<std::streamsize>(image->size()));
+    output.close();
+    if (!output) {
+        std::cerr << "Failed to write " << imagePath << ".\n";
+        return false;
+    }
+    std::cout << "Injected " << injections.size() << " fix(es) into a " << kInjectedSectionName << " section.\n";
+    return true;
+}
+
+#if defined(__linux__)
+/**
+ * Returns the directory session images are kept in: a private directory on tmpfs, so the
+ * images live in memory and every session of the same profile maps the same pages.
+ *
+ * @return The directory, or an empty std::optional if it is missing or not private.
+ */
+[[nodiscard]] std::optional<fs::path> sessionImageDirectory() {
+    const char *runtime = std::getenv("XDG_RUNTIME_DIR");
+    const fs::path directory = runtime && *runtime
+                                   ? fs::path(runtime) / "wow_patcher"
+                                   : fs::path("/dev/shm") / ("wow_patcher-" + std::to_string(getuid()));
+    mkdir(directory.c_str(), 0700);
+    struct stat info {};
+    if (lstat(directory.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) || info.st_uid != getuid() ||
+        (info.st_mode & 077) != 0) {
+        std::cerr << directory.string() << " is not a private directory; refusing to keep session images there.\n";
+        return std::nullopt;
+    }
+    return directory;
+}
+
+/**
+ * Describes the identity of a session image's original: device, inode, size and mtime.
+ *
+ * @param info The original's stat.
+ * @return The identity, as space-separated fields.
+ */
+[[nodiscard]] std::string sessionSourceIdentity(const struct stat &info) {
+    return std::to_string(info.st_dev) + " " + std::to_string(info.st_ino) + " " + std::to_string(info.st_size) +
+           " " + std::to_string(info.st_mtim.tv_sec) + "." + std::to_string(info.st_mtim.tv_nsec);
+}
+
+/**
+ * Removes session images that no session can use any more.
+ *
+ * Every image has a `.source` record beside it naming its original, the original's
+ * identity and the catalog version. An image goes when its original is gone or has
+ * changed, when it was built from another catalog, or when it has no record. Sessions
+ * still running keep their image through the bind mount, so removing it is safe.
+ *
+ * @param directory The session image directory.
+ * @param catalog The hexadecimal version of the catalog in use.
+ */
+void pruneSessionImages(const fs::path &directory, const std::string &catalog) {
+    std::error_code ec;
+    std::vector<fs::path> stale;
+    for (auto it = fs::directory_iterator(directory, ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        if (it->path().extension() != ".exe")
+            continue;
+        std::ifstream record(fs::path(it->path()).replace_extension(".source"));
+        std::string dev, ino, size, mtime, version, source;
+        struct stat info {};
+        const bool current = record >> dev >> ino >> size >> mtime >> version && record.get() == ' ' &&
+                             std::getline(record, source) && version == catalog &&
+                             stat(source.c_str(), &info) == 0 &&
+                             sessionSourceIdentity(info) == dev + " " + ino + " " + size + " " + mtime;
+        if (!current)
+            stale.push_back(it->path());
+    }
+    for (auto &path: stale) {
+        fs::remove(path, ec);
+        fs::remove(path.replace_extension(".source"), ec);
+    }
+}
+
+/**
+ * Writes a string to a `/proc` control file with a single write, as the id map files require.
+ *
+ * @param path The control file.
+ * @param contents What to write.
+ * @return true if the whole string was written.
+ */
+[[nodiscard]] bool writeProcFile(const char *path, const std::string &contents) {
+    const int fd = open(path, O_WRONLY | O_CLOEXEC);
+    const bool written = fd >= 0 && write(fd, contents.data(), contents.size()) ==
+                                    static_cast<ssize_t>(contents.size());
+    if (!written)
+        std::cerr << "Failed to write " << path << ": " << std::strerror(errno) << "\n";
+    if (fd >= 0)
+        close(fd);
+    return written;
+}
+#endif
+
+/**
+ * @brief Runs a command that sees a patched executable in place of a read-only original.
+ *
+ * The original is read once and patched in memory, and the result is kept as a read-only
+ * file in a private tmpfs directory under a name derived from the original's identity,
+ * the catalog version and the profile (see sessionImageDirectory), so later sessions of
+ * the same profile reuse it and share its pages. Images of originals that changed or
+ * disappeared are removed on every run (see pruneSessionImages). The patcher then enters a new user and
+ * mount namespace, bind-mounts the image over the executable's path, and execs the
+ * command, which with everything it starts sees the patched file there. The original is
+ * never written and nothing is copied to disk. The image is a tmpfs file rather than a
+ * memfd because the kernel refuses memfds as bind mount sources.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments:
+ *             `--session [--profile <profile>] <path> -- <command> [argument...]`.
+ * @return Does not return if the command starts; `EXIT_FAILURE` otherwise.
+ */
+int runSession(const int argc, char **argv) {
+#if defined(__linux__)
+    std::string profile = "all";
+    int at = 2;
+    if (at + 1 < argc && std::string_view(argv[at]) == "--profile") {
+        profile = argv[at + 1];
+        at += 2;
+    }
+    if (at + 2 >= argc || std::string_view(argv[at + 1]) != "--") {
+        std::cerr << "Usage: " << argv[0] << " --session [--profile <profile>] <path> -- <command> [argument...]\n";
+        return EXIT_FAILURE;
+    }
+    char **command = argv + at + 2;
+    std::error_code ec;
+    const fs::path target = fs::canonical(argv[at], ec);
+    if (ec) {
+        std::cerr << "Failed to resolve " << argv[at] << ": " << ec.message() << "\n";
+        return EXIT_FAILURE;
+    }
+    if (!validateExecutable(target.string()))
+        return EXIT_FAILURE;
+    const PatchTable table = buildPatchTable();
+    const auto selection = parseProfile(table, profile);
+    const auto directory = sessionImageDirectory();
+    struct stat source {};
+    if (!selection || !directory || stat(target.c_str(), &source) != 0)
+        return EXIT_FAILURE;
+
+    const std::string catalog = toHex(catalogVersion(table));
+    pruneSessionImages(*directory, catalog);
+    const std::string identity = target.string() + '\0' + sessionSourceIdentity(source) + '\0' + catalog + '\0' +
+                                 std::to_string(*selection);
+    Sha256 sha;
+    sha.update(reinterpret_cast<const std::uint8_t *>(identity.data()), identity.size());
+    const fs::path imagePath = *directory / (toHex(sha.finish()).substr(0, 32) + ".exe");
+    if (!fs::exists(imagePath, ec)) {
+        auto image = readWholeFile(target.string());
+        const std::string record = sessionSourceIdentity(source) + " " + catalog + " " + target.string() + "\n";
+        if (!image || !applyPatches(*image, table, *selection) ||
+            !writeFileAtomically(fs::path(imagePath).replace_extension(".source"),
+                                 reinterpret_cast<const std::uint8_t *>(record.data()), record.size()) ||
+            !writeFileAtomically(imagePath, image->data(), image->size()))
+            return EXIT_FAILURE;
+        fs::permissions(imagePath, fs::perms::owner_read | fs::perms::owner_exec, ec);
+        std::cout << "Session image written to " << imagePath.string() << "\n";
+    }
+
+    const uid_t uid = getuid();
+    const gid_t gid = getgid();
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0) {
+        std::cerr << "Failed to enter a user and mount namespace: " << std::strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+    // Keep the caller's identity inside the namespace so the command runs as it would outside.
+    if (!writeProcFile("/proc/self/setgroups", "deny") ||
+        !writeProcFile("/proc/self/uid_map", std::to_string(uid) + " " + std::to_string(uid) + " 1") ||
+        !writeProcFile("/proc/self/gid_map", std::to_string(gid) + " " + std::to_string(gid) + " 1"))
+        return EXIT_FAILURE;
+    if (mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0 ||
+        mount(imagePath.c_str(), target.c_str(), nullptr, MS_BIND, nullptr) != 0) {
+        std::cerr << "Failed to mount the session image over " << target.string() << ": " << std::strerror(errno)
+                << "\n";
+        return EXIT_FAILURE;
+    }
+    std::cout.flush();
+    execvp(command[0], command);
+    std::cerr << "Failed to run " << command[0] << ": " << std::strerror(errno) << "\n";
+    return EXIT_FAILURE;
+#else
+    (void) argc;
+    std::cerr << "Usage: " << argv[0] << " --session needs Linux namespaces.\n";
+    return EXIT_FAILURE;
+#endif
+}
+
+/**
+ * Copies a file by sharing its extents where the filesystem can (FICLONE), and otherwise
+ * with an in-kernel copy_file_range, and flushes the copy.
+ *
+ * @param source The file to copy.
+ * @param destination The copy; it is created or truncated.
+ * @return true if the copy is complete and on disk.
+ */
+[[nodiscard]] bool cloneFile(const fs::path &source, const fs::path &destination) {
+#if defined(__linux__)
+    const int from = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    const int to = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    struct stat info {};
+    bool copied = from >= 0 && to >= 0 && fstat(from, &info) == 0;
+    if (copied && ioctl(to, FICLONE, from) != 0) {
+        for (off_t remaining = info.st_size; copied && remaining > 0;) {
+            const ssize_t moved = copy_file_range(from, nullptr, to, nullptr, static_cast<std::size_t>(remaining), 0);
+            copied = moved > 0;
+            remaining -= moved;
+        }
+    }
+    copied = copied && fsync(to) == 0;
+    if (from >= 0)
+        close(from);
+    if (to >= 0)
+        close(to);
+    return copied;
+#else
+    std::error_code ec;
+    fs::copy_file(source, destination, fs::copy_options::overwrite_existing, ec);
+    return !ec;
+#endif
+}
+
+/**
+ * Returns the output cache entry for an original, a catalog and a profile.
+ *
+ * @param source The digest of the original.
+ * @param catalog The catalog version.
+ * @param selection The profile.
+ * @return The path of the cached patched image under cacheDirectory().
+ */
+[[nodiscard]] fs::path outputCachePath(const Digest &source, const Digest &catalog, const PatchSelection selection) {
+    std::ostringstream name;
+    name << toHex(source) << "-" << toHex(catalog).substr(0, 16) << "-" << std::hex << selection << ".exe";
+    return cacheDirectory() / "outputs" / name.str();
+}
+
+/**
+ * @brief Produces a patched executable by cloning a cached output instead of patching.
+ *
+ * The original's digest comes from the leaf cache when its stat key still matches, and is
+ * hashed otherwise. On a hit the original is hard-linked (or cloned) to the backup, the
+ * cached image is cloned next to the executable, checked against the patched digest
+ * stored beside the entry and renamed over it, and the backup digest is recorded,
+ * leaving the same files as the fused engine. An entry that fails the check is evicted.
+ * The entry's modification time is bumped, which is what evictOutputCache orders by.
+ *
+ * @param wowPath The executable, not yet patched.
+ * @param catalog The catalog version.
+ * @param selection The profile.
+ * @return true if the executable was produced from the cache, false on a miss or error
+ *         (the executable is then untouched).
+ */
+[[nodiscard]] bool materializeCachedOutput(const std::string &wowPath, const Digest &catalog,
+                                           const PatchSelection selection) {
+    std::error_code ec;
+    if (fs::file_size(wowPath, ec) != static_cast<std::uintmax_t>(kExpectedSize))
+        return false;
+    const auto leaves = loadImageLeaves(wowPath);
+    if (!leaves)
+        return false;
+    const Digest digest = combineLeaves(*leaves);
+    const fs::path entry = outputCachePath(digest, catalog, selection);
+    std::ifstream record(entry.string() + ".digest");
+    std::string hex;
+    const auto expected = record >> hex ? parseDigest(hex) : std::nullopt;
+    if (!expected || !fs::exists(entry, ec))
+        return false;
+
+    const std::string backupPath = wowPath + ".backup";
+    const auto backupName = createTempSibling(backupPath, "tmp");
+    const auto outputName = createTempSibling(wowPath, "patching");
+    const std::string backupTemp = backupName.value_or("");
+    const std::string outputTemp = outputName.value_or("");
+    bool backedUp = false;
+    if (backupName && outputName) {
+        // The name stays reserved by its random suffix while the placeholder is replaced by a link.
+        fs::remove(backupTemp, ec);
+        fs::create_hard_link(wowPath, backupTemp, ec);
+        backedUp = (!ec || (cloneFile(wowPath, backupTemp) && copyFileMetadata(wowPath, backupTemp))) &&
+                   syncFile(backupTemp);
+    }
+    const bool cloned = backedUp && cloneFile(entry, outputTemp) && copyFileMetadata(wowPath, outputTemp);
+    const auto patched = cloned ? computeImageLeaves(outputTemp) : std::nullopt;
+    if (!patched || combineLeaves(*patched) != *expected) {
+        if (cloned) {
+            std::cerr << "Output cache entry " << entry.filename().string() << " is damaged; evicting it.\n";
+            fs::remove(entry, ec);
+            fs::remove(entry.string() + ".digest", ec);
+        }
+        if (!backupTemp.empty())
+            fs::remove(backupTemp, ec);
+        if (!outputTemp.empty())
+            fs::remove(outputTemp, ec);
+        return false;
+    }
+    fs::rename(backupTemp, backupPath, ec);
+    if (!ec && !recordBackupDigest(backupPath, digest))
+        ec = std::make_error_code(std::errc::io_error);
+    if (!ec)
+        fs::rename(outputTemp, wowPath, ec);
+    if (!ec && !syncDirectory(wowPath))
+        ec = std::make_error_code(std::errc::io_error);
+    if (ec) {
+        std::cerr << "Failed to replace " << wowPath << " from the output cache: " << ec.message() << "\n";
+        fs::remove(backupTemp, ec);
+        fs::remove(outputTemp, ec);
+        return false;
+    }
+    storeImageLeaves(backupPath, *leaves);
+    fs::last_write_time(entry, fs::file_time_type::clock::now(), ec);
+    std::cout << "Backup created at: " << backupPath << "\n";
+    std::cout << "Patched from the output cache.\n";
+    return true;
+}
+
+/**
+ * Evicts the least recently used output cache entries until the cache fits its bound.
+ *
+ * @param limitBytes The bound on the total size of the entries.
+ */
+void evictOutputCache(const std::uint64_t limitBytes) {
+    std::vector<std::tuple<fs::file_time_type, std::uint64_t, fs::path> > entries;
+    std::uint64_t total = 0;
+    std::error_code ec;
+    for (auto it = fs::directory_iterator(cacheDirectory() / "outputs", ec); !ec && it != fs::directory_iterator();
+         it.increment(ec)) {
+        if (it->path().extension() != ".exe" || !it->is_regular_file(ec))
+            continue;
+        const std::uint64_t size = it->file_size(ec);
+        entries.emplace_back(it->last_write_time(ec), size, it->path());
+        total += size;
+    }
+    std::ranges::sort(entries);
+    for (const auto &[used, size, path]: entries) {
+        if (total <= limitBytes)
+            break;
+        if (fs::remove(path, ec))
+            total -= size;
+        fs::remove(path.string() + ".digest", ec);
+    }
+}
+
+/**
+ * Adds a freshly patched executable to the output cache, with its digest beside it, and
+ * evicts old entries to stay within the bound.
+ *
+ * @param wowPath The executable, just patched.
+ * @param catalog The catalog version.
+ * @param selection The profile.
+ * @param limitBytes The bound on the total size of the cache.
+ */
+void storeCachedOutput(const std::string &wowPath, const Digest &catalog, const PatchSelection selection,
+                       const std::uint64_t limitBytes) {
+    const auto source = readBackupDigest(wowPath + ".backup");
+    if (!source)
+        return;
+    const fs::path entry = outputCachePath(*source, catalog, selection);
+    std::error_code ec;
+    if (fs::exists(entry, ec))
+        return;
+    fs::create_directories(entry.parent_path(), ec);
+    const fs::path temp = entry.string() + ".tmp" + std::to_string(std::hash<std::thread::id>{}(
+                                                        std::this_thread::get_id()));
+    // The digest is hashed from the copy, so it describes exactly what later hits clone.
+    const auto leaves = cloneFile(wowPath, temp) ? computeImageLeaves(temp.string()) : std::nullopt;
+    const std::string hex = leaves ? toHex(combineLeaves(*leaves)) + "\n" : std::string();
+    if (leaves && writeFileAtomically(entry.string() + ".digest", reinterpret_cast<const std::uint8_t *>(hex.data()),
+                                      hex.size()))
+        fs::rename(temp, entry, ec);
+    else
+        fs::remove(temp, ec);
+    evictOutputCache(limitBytes);
+}
+
+/**
+ * @brief Main function to patch the World of Warcraft executable.
+ *
+ * This function performs several operations to patch the World of Warcraft executable
+ * located at the provided path. It verifies if the path is valid, creates a backup
+ * of the executable, validates the executable before patching, and applies several
+ * patches to it. The patches include fixes such as resolving a remote code execution
+ * exploit, enabling full screen mode from windowed mode, making certain animations
+ * and actions consistent, among others.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line arguments: the paths to the World of Warcraft
+ * executables (or `@list` files naming them), optionally preceded by
+ * `--engine fused|inplace`, `--profile <profile>`, `--jobs <n>|auto`, `--report <file>`,
+ * `--report-format json|columnar`, `--durability file|group`, `--journal <file>` and
+ * `--lower`, which patches the lower-layer file behind an overlayfs path in place instead
+ * of copying it up (see resolveLowerPath) and keeps its backup in the cache directory
+ * rather than in the layer (see lowerBackupPath). `--durability group` flushes the batch with one
+ * syncfs per filesystem and appends the files it made durable to the journal (see GroupCommit).
+ * `--shared-catalog` takes the compiled patch table from a concurrently running patcher
+ * instead of building it (see loadSharedCatalog). `--output-cache <MiB>` keeps patched
+ * outputs in a cache of that size and clones them for originals patched before with the
+ * same catalog and profile (see materializeCachedOutput). `--inject <file>` grows every
+ * patched executable with a `.patch` section holding fixes too large for a code cave, as
+ * part of the fused engine's commit (see loadInjectionFile and injectImage).
+ * `--backup-store <store>` adds every backup to a content-defined chunk store once the
+ * batch is committed, so near-identical originals share their storage (see runChunkStore).
+ * Several paths are patched in parallel; `--jobs auto` tunes the number of concurrent
+ * jobs per device while the batch runs, and `--report` writes a run report with per-file
+ * phase timings and the tuner's decisions (see runBatch and writeRunReport).
+ * When `argv[1]` names a mode instead, the matching handler runs:
+ *  - `--live <pid> <path>` patches a running client (see runLivePatch).
+ *  - `--live-standin <path>` loads an executable and waits, for `--live` to be tried against (see runLiveStandIn).
+ *  - `--hash <path> [profile...]` prints the patched digest per profile (see runHashProfiles).
+ *  - `--manifest <path> <output> ...` exports a per-region integrity manifest (see runManifestExport).
+ *  - `--serve [...]` patches paths read from stdin with a hot-reloadable catalog and an
+ *    interactive priority lane (see runServe).
+ *  - `--dedupe <path>...` shares extents of identical executables and backups (see runDedupe).
+ *  - `--store-put` / `--store-get` add images to or restore them from a chunk store (see runChunkStore).
+ *  - `--sync <source> <destination>...` mirrors an executable writing only changed blocks (see runSync).
+ *  - `--rollback [...] <path>...` restores a batch of executables from their backups (see runRollback).
+ *  - `--overlay-layer <path> <layer.tar>` writes a container layer with the patched executable
+ *    (see runOverlayLayer).
+ *  - `--report-query <report> [...]` summarizes a columnar run report (see runReportQuery).
+ *  - `--self-bench <dir>` measures I/O and hashing on the host and recommends settings (see runSelfBench).
+ *  - `--install-manifest <root> <manifest>` lists the sizes and digests of a client tree (see runInstallManifest).
+ *  - `--verify-install <root> <manifest>` checks a client tree against such a manifest (see runVerifyInstall).
+ *  - `--verify-mpq <archive>...` checks archive members against their `(attributes)` CRCs (see runVerifyMpq).
+ *  - `--session [...] <path> -- <command>...` runs a command that sees a patched view of a
+ *    read-only executable (see runSession).
+ *
+ * @return An integer indicating the status of the execution. Returns `EXIT_SUCCESS`
+ * if patching is completed successfully, or `EXIT_FAILURE` if an error occurs at any
+ * stage of the process.
+ */
+int main(const int argc, char **argv) {
+    constexpr int errorState = EXIT_SUCCESS;
+    if (argc < 2) {
+        std::cerr << "World of Warcraft exe path not provided!\n";
+        return EXIT_FAILURE;
+    }
+
+    if (const std::string_view mode = argv[1]; mode == "--live")
+        return runLivePatch(argc, argv);
+    else if (mode == "--live-standin")
+        return runLiveStandIn(argc, argv);
+    else if (mode == "--hash")
+        return runHashProfiles(argc, argv);
+    else if (mode == "--manifest")
+        return runManifestExport(argc, argv);
+    else if (mode == "--serve")
+        return runServe(argc, argv);
+    else if (mode == "--dedupe")
+        return runDedupe(argc, argv);
+    else if (mode == "--store-put" || mode == "--store-get")
+        return runChunkStore(argc, argv);
+    else if (mode == "--sync")
+        return runSync(argc, argv);
+    else if (mode == "--rollback")
+        return runRollback(argc, argv);
+    else if (mode == "--overlay-layer")
+        return runOverlayLayer(argc, argv);
+    else if (mode == "--report-query")
+        return runReportQuery(argc, argv);
+    else if (mode == "--self-bench")
+        return runSelfBench(argc, argv);
+    else if (mode == "--install-manifest")
+        return runInstallManifest(argc, argv);
+    else if (mode == "--verify-install")
+        return runVerifyInstall(argc, argv);
+    else if (mode == "--verify-mpq")
+        return runVerifyMpq(argc, argv);
+    else if (mode == "--session")
+        return runSession(argc, argv);
+
+    std::vector<char *> inputs;
+    std::string profile = "all";
+    PatchEngine engine = PatchEngine::Fused;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::optional<std::string> reportPath;
+    ReportFormat reportFormat = ReportFormat::Json;
+    bool patchLower = false;
+    Durability durability = Durability::PerFile;
+    std::optional<fs::path> journalPath;
+    std::optional<std::string> injectionPath;
+    std::optional<fs::path> backupStore;
+    bool shareCatalog = false;
+    std::uint64_t outputCacheLimit = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (const std::string_view arg = argv[i]; arg == "--engine" && i + 1 < argc) {
+            const auto parsed = parsePatchEngine(argv[++i]);
+            if (!parsed)
+                return EXIT_FAILURE;
+            engine = *parsed;
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            const auto count = parseJobCount(argv[++i]);
+            if (!count)
+                return EXIT_FAILURE;
+            jobs = *count;
+        } else if (arg == "--report" && i + 1 < argc) {
+            reportPath = argv[++i];
+        } else if (arg == "--report-format" && i + 1 < argc) {
+            const auto parsed = parseReportFormat(argv[++i]);
+            if (!parsed)
+                return EXIT_FAILURE;
+            reportFormat = *parsed;
+        } else if (arg == "--durability" && i + 1 < argc) {
+            const auto parsed = parseDurability(argv[++i]);
+            if (!parsed)
+                return EXIT_FAILURE;
+            durability = *parsed;
+        } else if (arg == "--journal" && i + 1 < argc) {
+            journalPath = argv[++i];
+        } else if (arg == "--inject" && i + 1 < argc) {
+            injectionPath = argv[++i];
+        } else if (arg == "--backup-store" && i + 1 < argc) {
+            backupStore = argv[++i];
+        } else if (arg == "--shared-catalog") {
+            shareCatalog = true;
+        } else if (arg == "--output-cache" && i + 1 < argc) {
+            const auto mebibytes = parseJobCount(argv[++i]);
+            if (!mebibytes || *mebibytes == kAdaptiveJobs) {
+                std::cerr << "--output-cache needs a size in MiB.\n";
+                return EXIT_FAILURE;
+            }
+            outputCacheLimit = std::uint64_t{*mebibytes} << 20;
+        } else if (arg == "--lower") {
+            patchLower = true;
+        } else {
+            inputs.push_back(argv[i]);
+        }
+    }
+    auto wowPaths = expandPathArguments(inputs.data(), inputs.data() + inputs.size());
+    if (!wowPaths || wowPaths->empty()) {
+        std::cerr << "World of Warcraft exe path not provided!\n";
+        return EXIT_FAILURE;
+    }
+
+    // Patching through an overlay copies the whole executable up into every container.
+    for (auto &path: *wowPaths) {
+        if (patchLower) {
+            const auto lower = resolveLowerPath(path);
+            if (!lower)
+                return EXIT_FAILURE;
+            path = lower->string();
+        } else if (const auto overlay = findOverlay(path)) {
+            std::error_code ec;
+            if (!overlay->upperDir || !fs::exists(*overlay->upperDir / overlay->relative, ec))
+                std::cerr << path << " is on overlayfs; patching it copies it up. Use --lower to patch the"
+                        << " shared lower layer or --overlay-layer to build a patched layer.\n";
+        }
+    }
+    // The lower file is shared by every container, so it is patched in place to keep its inode.
+    if (patchLower)
+        engine = PatchEngine::InPlace;
+    // In-place patching orders its dependency waves with flushes, which a group commit would drop.
+    if (durability == Durability::Group && engine != PatchEngine::Fused) {
+        std::cerr << "--durability group requires the fused engine.\n";
+        return EXIT_FAILURE;
+    }
+    // Only the group commit writes a journal; per-file durability would leave it empty.
+    if (journalPath && durability != Durability::Group) {
+        std::cerr << "--journal requires --durability group.\n";
+        return EXIT_FAILURE;
+    }
+
+    std::shared_ptr<const Catalog> shared;
+    if (shareCatalog && !(shared = loadSharedCatalog(std::nullopt)))
+        return EXIT_FAILURE;
+    const PatchTable patches = shared ? shared->patches : buildPatchTable();
+    const auto selection = parseProfile(patches, profile);
+    if (!selection)
+        return EXIT_FAILURE;
+    std::optional<std::vector<Injection> > injections;
+    if (injectionPath) {
+        injections = loadInjectionFile(*injectionPath);
+        if (!injections || !checkInjectionSites(*injections, patches, *selection))
+            return EXIT_FAILURE;
+        // The section is built on the fused engine's temporary copy; growing the file in
+        // place could not be committed atomically, nor renamed over a shared lower file.
+        if (engine != PatchEngine::Fused) {
+            std::cerr << "--inject requires the fused engine, so it cannot be combined with --engine inplace"
+                    << " or --lower.\n";
+            return EXIT_FAILURE;
+        }
+    }
+    // Cached outputs replace the file like the fused engine does and hold no injected code.
+    if (outputCacheLimit != 0 && (engine != PatchEngine::Fused || injections || durability == Durability::Group)) {
+        std::cerr << "--output-cache requires the fused engine, per-file durability and no --inject.\n";
+        return EXIT_FAILURE;
+    }
+    const Digest catalog = outputCacheLimit != 0 ? catalogVersion(patches) : Digest{};
+    const auto backupOf = [&](const std::string &path) {
+        return patchLower ? lowerBackupPath(path).string() : path + ".backup";
+    };
+    if (wowPaths->size() == 1 && !reportPath && durability == Durability::PerFile && outputCacheLimit == 0 &&
+        !backupStore) {
+        const bool patched = patchExecutable(wowPaths->front(), patches, *selection, engine, nullptr, nullptr,
+                                             injections ? &*injections : nullptr, backupOf(wowPaths->front()));
+        return patched ? errorState : EXIT_FAILURE;
+    }
+
+    std::optional<GroupCommit> group;
+    if (durability == Durability::Group)
+        group.emplace(journalPath);
+    auto report = runBatch(*wowPaths, jobs, [&](const std::string &path, JobResult &result) {
+        if (outputCacheLimit != 0 && materializeCachedOutput(path, catalog, *selection)) {
+            if (const auto recorded = readBackupDigest(path + ".backup"))
+                result.digest = *recorded;
+            result.size = static_cast<std::uint64_t>(kExpectedSize);
+            return true;
+        }
+        const bool patched = patchExecutable(path, patches, *selection, engine, &result.phases,
+                                             group ? &*group : nullptr, injections ? &*injections : nullptr,
+                                             backupOf(path));
+        if (patched && outputCacheLimit != 0)
+            storeCachedOutput(path, catalog, *selection, outputCacheLimit);
+        std::error_code ec;
+        result.size = fs::file_size(path, ec);
+        // A grouped job's backup is only in place after the flush, which records its digest.
+        if (const auto recorded = group ? std::nullopt : readBackupDigest(backupOf(path)))
+            result.digest = *recorded;
+        return patched;
+    });
+    if (group) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto failed = group->flush();
+        for (auto &result: report.jobs) {
+            if (std::ranges::find(failed, result.path) != failed.end()) {
+                result.succeeded = false;
+                result.digest = Digest{};
+            } else if (const auto recorded = readBackupDigest(backupOf(result.path)); result.succeeded && recorded) {
+                result.digest = *recorded;
+            }
+        }
+        std::cout << "Group commit made " << report.jobs.size() - report.failures() << " file(s) durable in "
+                << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s.\n";
+    }
+    const std::size_t failures = report.failures();
+    std::cout << "Patched " << wowPaths->size() - failures << " of " << wowPaths->size() << " executable(s).\n";
+    if (reportPath && !writeRunReport(*reportPath, report, reportFormat))
+        return EXIT_FAILURE;
+    if (failures != 0)
+        return EXIT_FAILURE;
+
+    // Backups are only in place once the batch is committed, so they are deposited afterwards.
+    if (backupStore) {
+        std::atomic<std::uint64_t> storedBytes = 0;
+        std::atomic<bool> stored = true;
+        parallelFor(report.jobs.size(), [&](const std::size_t begin, const std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) {
+                std::uint64_t bytes = 0;
+                if (!putIntoChunkStore(*backupStore, backupOf(report.jobs[i].path), bytes)) {
+                    std::cerr << "Failed to add the backup of " << report.jobs[i].path << " to "
+                            << backupStore->string() << ".\n";
+                    stored = false;
+                }
+                storedBytes += bytes;
+            }
+        });
+        std::cout << "Added " << report.jobs.size() << " backup(s) to " << backupStore->string() << " ("
+                << storedBytes << " new bytes).\n";
+        if (!stored)
+            return EXIT_FAILURE;
+    }
 
     return errorState;
 }